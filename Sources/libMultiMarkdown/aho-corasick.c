@@ -63,6 +63,8 @@
 
 #define kTrieStartingSize 256
 
+#define kACDenseEdges 8		//!< Automaton states with more edges than this get a row in the transition table
+
 void trie_to_graphviz(trie * a);
 
 
@@ -340,12 +342,13 @@ match * match_new(size_t start, size_t len, unsigned short match_type) {
 
 
 void match_free(match * m) {
-	if (m) {
-		if (m->next) {
-			match_free(m->next);
-		}
+	match * next;
 
+	// Iterate rather than recurse, since there can be many matches
+	while (m) {
+		next = m->next;
 		free(m);
+		m = next;
 	}
 }
 
@@ -518,6 +521,225 @@ match * ac_trie_leftmost_longest_search(trie * a, const char * source, size_t st
 }
 
 
+/// Where does state s go after reading character c?  States with a row have
+/// every transition (including failures) in the table; other states follow
+/// the failure path.
+static inline uint32_t ac_automaton_step(ac_automaton * ac, uint32_t s, unsigned char c) {
+	ac_state * n;
+	size_t i;
+
+	while (s != 0) {
+		n = &ac->state[s];
+
+		if (n->row) {
+			return ac->table[n->row + ac->char_class[c]];
+		}
+
+		// Outgoing characters are sorted
+		for (i = n->edge; i < n->edge + n->edge_count; ++i) {
+			if (ac->edge_char[i] == c) {
+				return ac->edge_target[i];
+			}
+
+			if (ac->edge_char[i] > c) {
+				break;
+			}
+		}
+
+		s = n->fail;
+	}
+
+	return ac->root[c];
+}
+
+
+/// Build compact automaton from a trie (ac_trie_prepare() is not needed, since
+/// the automaton finds its own failure paths).  The trie is not needed for
+/// searching afterwards.
+ac_automaton * ac_automaton_new(trie * a) {
+	if (!a || (a->size > UINT32_MAX)) {
+		return NULL;
+	}
+
+	ac_automaton * ac = calloc(1, sizeof(ac_automaton));
+	size_t * order = malloc(sizeof(size_t) * a->size);		// Trie node for each state
+
+	if (ac) {
+		ac->size = (uint32_t) a->size;
+		ac->state = calloc(a->size, sizeof(ac_state));
+		ac->edge_char = malloc(a->size);
+		ac->edge_target = malloc(sizeof(uint32_t) * a->size);
+	}
+
+	if (!ac || !order || !ac->state || !ac->edge_char || !ac->edge_target) {
+		ac_automaton_free(ac);
+		free(order);
+		return NULL;
+	}
+
+	// Number states breadth first, so that shallow (busy) states are together.
+	// Children of each state are numbered consecutively, as are its edges.
+	unsigned char class_char[257];
+	uint16_t classes = 1;
+	size_t rows = 1;
+	size_t head = 0;
+	size_t tail = 1;
+	size_t i;
+	int c;
+
+	order[0] = 0;
+	class_char[0] = 0;
+
+	while (head < tail) {
+		trie_node * n = &a->node[order[head]];
+		ac_state * s = &ac->state[head];
+
+		s->edge = (uint32_t) (tail - 1);
+		s->match_type = n->match_type;
+		s->len = n->len;
+
+		for (c = 0; c < 256; ++c) {
+			if (n->child[c]) {
+				ac->edge_char[tail - 1] = (unsigned char) c;
+				ac->edge_target[tail - 1] = (uint32_t) tail;
+				s->edge_count++;
+
+				// Give each character used in a key a class
+				if (ac->char_class[c] == 0) {
+					class_char[classes] = (unsigned char) c;
+					ac->char_class[c] = classes++;
+				}
+
+				order[tail++] = n->child[c];
+			}
+		}
+
+		if (head == 0) {
+			for (i = s->edge; i < s->edge + s->edge_count; ++i) {
+				ac->root[ac->edge_char[i]] = ac->edge_target[i];
+			}
+		} else if (s->edge_count > kACDenseEdges) {
+			rows++;
+		}
+
+		head++;
+	}
+
+	ac->classes = classes;
+
+	if (rows > 1) {
+		ac->table = (rows * classes <= UINT32_MAX) ? calloc(rows * classes, sizeof(uint32_t)) : NULL;
+
+		if (!ac->table) {
+			ac_automaton_free(ac);
+			free(order);
+			return NULL;
+		}
+	}
+
+	// Find failure paths breadth first, so that everything on the failure path
+	// of a state (which is shorter) is already complete.  Wide states get a row
+	// with failures resolved in advance.
+	uint32_t row = 0;
+	uint32_t edge;
+	ac_state * child;
+	ac_state * fail;
+
+	for (i = 0; i < tail; ++i) {
+		ac_state * s = &ac->state[i];
+
+		if ((i != 0) && (s->edge_count > kACDenseEdges)) {
+			row += classes;
+
+			for (c = 1; c < classes; ++c) {
+				ac->table[row + c] = ac_automaton_step(ac, s->fail, class_char[c]);
+			}
+
+			for (edge = s->edge; edge < s->edge + s->edge_count; ++edge) {
+				ac->table[row + ac->char_class[ac->edge_char[edge]]] = ac->edge_target[edge];
+			}
+
+			s->row = row;
+		}
+
+		for (edge = s->edge; edge < s->edge + s->edge_count; ++edge) {
+			child = &ac->state[ac->edge_target[edge]];
+
+			if (i != 0) {
+				child->fail = ac_automaton_step(ac, s->fail, ac->edge_char[edge]);
+			}
+
+			fail = &ac->state[child->fail];
+			child->output = (fail->match_type) ? child->fail : fail->output;
+		}
+	}
+
+	free(order);
+
+	return ac;
+}
+
+
+void ac_automaton_free(ac_automaton * ac) {
+	if (ac) {
+		free(ac->state);
+		free(ac->edge_char);
+		free(ac->edge_target);
+		free(ac->table);
+		free(ac);
+	}
+}
+
+
+/// Same results as ac_trie_search(), using compact automaton
+match * ac_automaton_search(ac_automaton * ac, const char * source, size_t start, size_t len) {
+	match * result = NULL;
+	match * m = result;
+
+	uint32_t state = 0;
+	uint32_t temp_state;
+
+	size_t counter = start;
+	size_t stop = start + len;
+
+	while ((counter < stop) && (source[counter] != '\0')) {
+		state = ac_automaton_step(ac, state, (unsigned char)source[counter++]);
+
+		if (state == 0) {
+			continue;
+		}
+
+		// Check for matches, longest first
+		temp_state = (ac->state[state].match_type) ? state : ac->state[state].output;
+
+		while (temp_state != 0) {
+			if (!m) {
+				result = match_new(0, 0, 0);
+				m = result;
+			}
+
+			m = match_add(m, counter - ac->state[temp_state].len,
+						  ac->state[temp_state].len, ac->state[temp_state].match_type);
+
+			temp_state = ac->state[temp_state].output;
+		}
+	}
+
+	return result;
+}
+
+
+match * ac_automaton_leftmost_longest_search(ac_automaton * ac, const char * source, size_t start, size_t len) {
+	match * result = ac_automaton_search(ac, source, start, len);
+
+	if (result) {
+		match_set_filter_leftmost_longest(result);
+	}
+
+	return result;
+}
+
+
 #ifdef TEST
 void Test_aho_trie_search(CuTest* tc) {
 	trie * a = trie_new(0);
@@ -566,6 +788,67 @@ void Test_aho_trie_search(CuTest* tc) {
 #endif
 
 
+#ifdef TEST
+void Test_ac_automaton_search(CuTest* tc) {
+	trie * a = trie_new(0);
+
+	trie_insert(a, "A", 1);
+	trie_insert(a, "AB", 2);
+	trie_insert(a, "ABC", 3);
+	trie_insert(a, "BC", 4);
+	trie_insert(a, "BCD", 5);
+	trie_insert(a, "E", 6);
+	trie_insert(a, "EFGHIJ", 7);
+	trie_insert(a, "F", 8);
+	trie_insert(a, "ZABCABCZ", 9);
+	trie_insert(a, "ZAB", 10);
+
+	ac_trie_prepare(a);
+
+	ac_automaton * ac = ac_automaton_new(a);
+	CuAssertIntEquals(tc, a->size, ac->size);
+
+	const char * source = "ABCDEFGGGAZABCABCDZABCABCZ";
+
+	// Results should be identical to the trie
+	match * m1 = ac_trie_search(a, source, 0, 26);
+	match * m2 = ac_automaton_search(ac, source, 0, 26);
+	match * w1 = m1;
+	match * w2 = m2;
+
+	CuAssertIntEquals(tc, match_count(m1), match_count(m2));
+
+	while (w1 && w2) {
+		CuAssertIntEquals(tc, w1->start, w2->start);
+		CuAssertIntEquals(tc, w1->len, w2->len);
+		CuAssertIntEquals(tc, w1->match_type, w2->match_type);
+
+		w1 = w1->next;
+		w2 = w2->next;
+	}
+
+	match_free(m1);
+	match_free(m2);
+
+	m2 = ac_automaton_leftmost_longest_search(ac, source, 0, 26);
+	CuAssertIntEquals(tc, 7, match_count(m2));
+
+	// ABC
+	w2 = m2->next;
+	CuAssertIntEquals(tc, 0, w2->start);
+	CuAssertIntEquals(tc, 3, w2->match_type);
+
+	match_free(m2);
+
+	m2 = ac_automaton_search(ac, "xyz", 0, 3);
+	CuAssertPtrEquals(tc, NULL, m2);
+
+	ac_automaton_free(ac);
+	trie_free(a);
+}
+#endif
+
+
 void trie_node_to_graphviz(trie * a, size_t s) {
 	trie_node * n = &a->node[s];
 
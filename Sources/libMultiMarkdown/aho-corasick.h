@@ -56,6 +56,7 @@
 #ifndef AC_TEMPLATE_H
 #define AC_TEMPLATE_H
 
+#include <stdint.h>
 #include <string.h>
 
 struct trie_node {
@@ -79,6 +80,40 @@ struct trie {
 typedef struct trie trie;
 
 
+/// Compact, read-only form of a prepared trie that is used for searching.
+/// States are numbered breadth first, the root has a full transition table,
+/// states with many outgoing characters have a row in a table indexed by
+/// character class (only characters used in keys get a class), and all other
+/// states keep a sorted list of their outgoing characters.
+struct ac_state {
+	uint32_t			edge;				// Index of first outgoing edge
+	uint32_t			fail;				// Where should we go if we fail?
+	uint32_t			output;				// Next state on failure path that is a match (0 = none)
+	uint32_t			row;				// Offset of row in transition table (0 = no row)
+	uint16_t			edge_count;			// Number of outgoing edges
+	unsigned short		match_type;			// 0 = no match, otherwise what have we matched?
+	unsigned short		len;				// Length of string matched
+};
+
+typedef struct ac_state ac_state;
+
+
+struct ac_automaton {
+	uint32_t			root[256];			// Where should we go next from the root?
+	uint32_t			size;				// How many states are there?
+
+	ac_state *			state;				// Array of states
+	unsigned char *		edge_char;			// Character for each edge
+	uint32_t *			edge_target;		// Where each edge goes
+
+	uint16_t			char_class[256];	// Class for each character (0 = not used in any key)
+	uint16_t			classes;			// Number of classes (including 0)
+	uint32_t *			table;				// Rows of transitions by class (first row is unused)
+};
+
+typedef struct ac_automaton ac_automaton;
+
+
 struct match {
 	size_t				start;				// Starting offset for this match
 	size_t				len;				// Length for this match
@@ -102,6 +137,14 @@ match * ac_trie_leftmost_longest_search(trie * a, const char * source, size_t st
 
 void trie_free(trie * a);
 
+ac_automaton * ac_automaton_new(trie * a);
+
+match * ac_automaton_search(ac_automaton * ac, const char * source, size_t start, size_t len);
+
+match * ac_automaton_leftmost_longest_search(ac_automaton * ac, const char * source, size_t start, size_t len);
+
+void ac_automaton_free(ac_automaton * ac);
+
 void match_set_describe(match * m, const char * source);
 
 void match_set_filter_leftmost_longest(match * header);
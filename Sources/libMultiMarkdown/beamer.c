@@ -302,12 +302,10 @@ void mmd_export_token_beamer(DString * out, const char * source, token * t, scra
 void mmd_export_token_tree_beamer(DString * out, const char * source, token * t, scratch_pad * scratch) {
 
 	// Prevent stack overflow with "dangerous" input causing extreme recursion
-	if (scratch->recurse_depth == kMaxExportRecursiveDepth) {
+	if (!mmd_export_tree_begin(scratch)) {
 		return;
 	}
 
-	scratch->recurse_depth++;
-
 	while (t != NULL) {
 		if (scratch->skip_token) {
 			scratch->skip_token--;
@@ -315,10 +313,12 @@ void mmd_export_token_tree_beamer(DString * out, const char * source, token * t,
 			mmd_export_token_beamer(out, source, t, scratch);
 		}
 
+		mmd_export_block_done(out, scratch);
+
 		t = t->next;
 	}
 
-	scratch->recurse_depth--;
+	mmd_export_tree_end(scratch);
 }
 
 
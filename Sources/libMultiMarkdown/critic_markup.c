@@ -55,16 +55,34 @@
 */
 
 #include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 
+#ifdef USE_PTHREADS
+	#include <pthread.h>
+#endif
+
 
 #include "aho-corasick.h"
 #include "critic_markup.h"
+#include "object_pool.h"
 #include "stack.h"
 #include "token_pairs.h"
 
 
-token * mmd_critic_tokenize_string(const char * source, size_t start, size_t len) {
+/// The automaton for CriticMarkup markers never changes, so it is built once
+/// and then shared (read-only) by every thread
+static ac_automaton * critic_automaton = NULL;
+
+/// Searched instead if there wasn't memory for the automaton
+static trie * critic_trie = NULL;
+
+#ifdef USE_PTHREADS
+static pthread_once_t critic_automaton_once = PTHREAD_ONCE_INIT;
+#endif
+
+
+static void critic_automaton_build(void) {
 	trie * ac = trie_new(0);
 
 	trie_insert(ac, "{++", CM_ADD_OPEN);
@@ -92,10 +110,43 @@ token * mmd_critic_tokenize_string(const char * source, size_t start, size_t len
 	trie_insert(ac, "\\>", CM_PLAIN_TEXT);
 	trie_insert(ac, "\\=", CM_PLAIN_TEXT);
 
+	critic_automaton = ac_automaton_new(ac);
+
+	if (critic_automaton) {
+		trie_free(ac);
+	} else if (ac) {
+		ac_trie_prepare(ac);
+		critic_trie = ac;
+	}
+}
+
+
+/// Find CriticMarkup markers, with the shared automaton (or trie)
+static match * critic_search(const char * source, size_t start, size_t len) {
+	#ifdef USE_PTHREADS
+	pthread_once(&critic_automaton_once, critic_automaton_build);
+	#else
+
+	if ((critic_automaton == NULL) && (critic_trie == NULL)) {
+		critic_automaton_build();
+	}
+
+	#endif
+
+	if (critic_automaton) {
+		return ac_automaton_leftmost_longest_search(critic_automaton, source, start, len);
+	}
+
+	if (critic_trie) {
+		return ac_trie_leftmost_longest_search(critic_trie, source, start, len);
+	}
 
-	ac_trie_prepare(ac);
+	return NULL;
+}
 
-	match * m = ac_trie_leftmost_longest_search(ac, source, start, len);
+
+token * mmd_critic_tokenize_string(const char * source, size_t start, size_t len) {
+	match * m = critic_search(source, start, len);
 
 	token * root = NULL;
 
@@ -125,7 +176,6 @@ token * mmd_critic_tokenize_string(const char * source, size_t start, size_t len
 		}
 
 		match_free(m);
-		trie_free(ac);
 	}
 
 	return root;
@@ -147,7 +197,7 @@ token * critic_parse_substring(const char * source, size_t start, size_t len) {
 
 		stack * s = stack_new(0);
 
-		token_pairs_match_pairs_inside_token(chain, e, s, 0);
+		token_pairs_match_pairs_inside_token(chain, e, s);
 
 		stack_free(s);
 		token_pair_engine_free(e);
@@ -157,33 +207,149 @@ token * critic_parse_substring(const char * source, size_t start, size_t len) {
 }
 
 
-void accept_token_tree(DString * d, token * t);
-void accept_token(DString * d, token * t);
+/// Byte range to be removed from the string
+typedef struct {
+	size_t	start;
+	size_t	len;
+} critic_range;
+
+
+/// Ranges to be removed are collected first, so that the string can be
+/// rewritten in a single pass instead of erasing each one separately
+typedef struct {
+	critic_range *	range;
+	size_t			count;
+	size_t			size;
+} critic_edit;
+
+
+static void critic_edit_erase(critic_edit * edit, size_t start, size_t len) {
+	if (edit->count == edit->size) {
+		size_t size = (edit->size) ? edit->size * 2 : 64;
+		critic_range * range = realloc(edit->range, size * sizeof(critic_range));
 
+		if (!range) {
+			return;
+		}
+
+		edit->range = range;
+		edit->size = size;
+	}
+
+	edit->range[edit->count].start = start;
+	edit->range[edit->count].len = len;
+	edit->count++;
+}
 
-void accept_token_tree_sub(DString * d, token * t) {
+
+static int critic_range_compare(const void * a, const void * b) {
+	const critic_range * r1 = a;
+	const critic_range * r2 = b;
+
+	if (r1->start < r2->start) {
+		return -1;
+	}
+
+	return (r1->start > r2->start);
+}
+
+
+/// Remove all of the ranges from `d` with a read and a write cursor, then
+/// release the list of ranges
+static void critic_edit_apply(critic_edit * edit, DString * d) {
+	if (edit->count == 0) {
+		free(edit->range);
+		return;
+	}
+
+	// Ranges are usually collected from back to front
+	size_t i;
+	bool descending = true;
+
+	for (i = 1; i < edit->count; ++i) {
+		if (edit->range[i].start > edit->range[i - 1].start) {
+			descending = false;
+			break;
+		}
+	}
+
+	if (descending) {
+		for (i = 0; i < edit->count / 2; ++i) {
+			critic_range temp = edit->range[i];
+			edit->range[i] = edit->range[edit->count - 1 - i];
+			edit->range[edit->count - 1 - i] = temp;
+		}
+	} else {
+		qsort(edit->range, edit->count, sizeof(critic_range), critic_range_compare);
+	}
+
+	size_t length = d->currentStringLength;
+	size_t write = edit->range[0].start;
+	size_t read = write;
+	size_t stop;
+
+	for (i = 0; i < edit->count; ++i) {
+		if (edit->range[i].start > length) {
+			break;
+		}
+
+		// Keep text up to the start of this range
+		if (edit->range[i].start > read) {
+			memmove(&d->str[write], &d->str[read], edit->range[i].start - read);
+			write += edit->range[i].start - read;
+			read = edit->range[i].start;
+		}
+
+		// Skip over the range (which may overlap the previous one)
+		stop = edit->range[i].start + edit->range[i].len;
+
+		if (stop > length) {
+			stop = length;
+		}
+
+		if (stop > read) {
+			read = stop;
+		}
+	}
+
+	// Keep the rest of the string
+	memmove(&d->str[write], &d->str[read], length - read);
+	write += length - read;
+
+	d->currentStringLength = write;
+	d->str[write] = '\0';
+
+	free(edit->range);
+}
+
+
+void accept_token_tree(critic_edit * edit, token * t);
+void accept_token(critic_edit * edit, token * t);
+
+
+void accept_token_tree_sub(critic_edit * edit, token * t) {
 	while (t) {
 		if (t->type == CM_SUB_DIV) {
 			while (t) {
-				d_string_erase(d, t->start, t->len);
+				critic_edit_erase(edit, t->start, t->len);
 				t = t->prev;
 			}
 
 			return;
 		}
 
-		accept_token(d, t);
+		accept_token(edit, t);
 
 		t = t->prev;
 	}
 }
 
 
-void accept_token(DString * d, token * t) {
+void accept_token(critic_edit * edit, token * t) {
 	switch (t->type) {
 		case CM_SUB_CLOSE:
 			if (t->mate) {
-				d_string_erase(d, t->start, t->len);
+				critic_edit_erase(edit, t->start, t->len);
 			}
 
 			break;
@@ -201,14 +367,14 @@ void accept_token(DString * d, token * t) {
 		case CM_DEL_PAIR:
 		case CM_COM_PAIR:
 			// Erase these
-			d_string_erase(d, t->start, t->len);
+			critic_edit_erase(edit, t->start, t->len);
 			break;
 
 		case CM_SUB_PAIR:
 
 			// Erase old version and markers
 			if (t->child) {
-				accept_token_tree_sub(d, t->child->mate);
+				accept_token_tree_sub(edit, t->child->mate);
 			}
 
 			break;
@@ -218,7 +384,7 @@ void accept_token(DString * d, token * t) {
 
 			// Check children
 			if (t->child) {
-				accept_token_tree(d, t->child->mate);
+				accept_token_tree(edit, t->child->mate);
 			}
 
 			break;
@@ -226,24 +392,38 @@ void accept_token(DString * d, token * t) {
 }
 
 
-void accept_token_tree(DString * d, token * t) {
+void accept_token_tree(critic_edit * edit, token * t) {
 	while (t) {
-		accept_token(d, t);
+		accept_token(edit, t);
 
-		// Iterate backwards so offsets are right
+		// Iterate backwards (ranges are collected from the end of the string)
 		t = t->prev;
 	}
 }
 
 
 void mmd_critic_markup_accept_range(DString * d, size_t start, size_t len) {
+	#ifdef kUseObjectPool
+	// Use a private pool so these tokens are released as soon as we're done
+	pool * p = token_pool_new();
+	pool * old_pool = token_pool_set_active(p);
+	#endif
+
 	token * t = critic_parse_substring(d->str, start, len);
 
 	if (t && t->child) {
-		accept_token_tree(d, t->child->tail);
+		critic_edit edit = {NULL, 0, 0};
+
+		accept_token_tree(&edit, t->child->tail);
+		critic_edit_apply(&edit, d);
 	}
 
 	token_free(t);
+
+	#ifdef kUseObjectPool
+	token_pool_set_active(old_pool);
+	pool_free(p);
+	#endif
 }
 
 
@@ -252,30 +432,30 @@ void mmd_critic_markup_accept(DString * d) {
 }
 
 
-void reject_token_tree(DString * d, token * t);
-void reject_token(DString * d, token * t);
+void reject_token_tree(critic_edit * edit, token * t);
+void reject_token(critic_edit * edit, token * t);
 
 
-void reject_token_tree_sub(DString * d, token * t) {
+void reject_token_tree_sub(critic_edit * edit, token * t) {
 	while (t && t->type != CM_SUB_DIV) {
-		d_string_erase(d, t->start, t->len);
+		critic_edit_erase(edit, t->start, t->len);
 		t = t->prev;
 	}
 
 	while (t) {
 
-		reject_token(d, t);
+		reject_token(edit, t);
 
 		t = t->prev;
 	}
 }
 
 
-void reject_token(DString * d, token * t) {
+void reject_token(critic_edit * edit, token * t) {
 	switch (t->type) {
 		case CM_SUB_CLOSE:
 			if (t->mate) {
-				d_string_erase(d, t->start, t->len);
+				critic_edit_erase(edit, t->start, t->len);
 			}
 
 			break;
@@ -293,14 +473,14 @@ void reject_token(DString * d, token * t) {
 		case CM_ADD_PAIR:
 		case CM_COM_PAIR:
 			// Erase these
-			d_string_erase(d, t->start, t->len);
+			critic_edit_erase(edit, t->start, t->len);
 			break;
 
 		case CM_SUB_PAIR:
 
 			// Erase new version and markers
 			if (t->child) {
-				reject_token_tree_sub(d, t->child->mate);
+				reject_token_tree_sub(edit, t->child->mate);
 			}
 
 			break;
@@ -310,7 +490,7 @@ void reject_token(DString * d, token * t) {
 
 			// Check children
 			if (t->child) {
-				reject_token_tree(d, t->child->mate);
+				reject_token_tree(edit, t->child->mate);
 			}
 
 			break;
@@ -318,25 +498,38 @@ void reject_token(DString * d, token * t) {
 }
 
 
-void reject_token_tree(DString * d, token * t) {
+void reject_token_tree(critic_edit * edit, token * t) {
 	while (t) {
-		reject_token(d, t);
+		reject_token(edit, t);
 
-		// Iterate backwards so offsets are right
+		// Iterate backwards (ranges are collected from the end of the string)
 		t = t->prev;
 	}
 }
 
 
 void mmd_critic_markup_reject_range(DString * d, size_t start, size_t len) {
+	#ifdef kUseObjectPool
+	// Use a private pool so these tokens are released as soon as we're done
+	pool * p = token_pool_new();
+	pool * old_pool = token_pool_set_active(p);
+	#endif
+
 	token * t = critic_parse_substring(d->str, start, len);
 
 	if (t && t->child) {
-		reject_token_tree(d, t->child->tail);
+		critic_edit edit = {NULL, 0, 0};
+
+		reject_token_tree(&edit, t->child->tail);
+		critic_edit_apply(&edit, d);
 	}
 
 	token_free(t);
 
+	#ifdef kUseObjectPool
+	token_pool_set_active(old_pool);
+	pool_free(p);
+	#endif
 }
 
 
@@ -416,6 +609,21 @@ void Test_critic(CuTest* tc) {
 	mmd_critic_markup_reject(test);
 	CuAssertStrEquals(tc, "", test->str);
 
+	d_string_erase(test, 0, -1);
+	d_string_append(test, "a {++b++} c {--d--} e {~~f~>g~~} h");
+	mmd_critic_markup_accept(test);
+	CuAssertStrEquals(tc, "a b c  e g h", test->str);
+
+	d_string_erase(test, 0, -1);
+	d_string_append(test, "a {++b++} c {--d--} e {~~f~>g~~} h");
+	mmd_critic_markup_reject(test);
+	CuAssertStrEquals(tc, "a  c d e f h", test->str);
+
+	d_string_erase(test, 0, -1);
+	d_string_append(test, "a {++b++} c {--d--} e");
+	mmd_critic_markup_accept_range(test, 0, 10);
+	CuAssertStrEquals(tc, "a b c {--d--} e", test->str);
+
 	#ifdef kUseObjectPool
 	// Decrement counter and clean up token pool
 	token_pool_drain();
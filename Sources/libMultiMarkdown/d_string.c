@@ -63,6 +63,7 @@
 #include <stdarg.h>
 
 #include "d_string.h"
+#include "thread_local.h"
 
 #ifdef TEST
 	#include "CuTest.h"
@@ -114,6 +115,81 @@ int vasprintf(char** strp, const char* fmt, va_list ap) {
 #define kStringBufferMaxIncrement 1024 * 1024 * 100		//!< Maximum growth increment when resizing (to limit exponential growth)
 
 
+/// Buffer statistics for dynamic strings resized on this thread (kept per
+/// thread, so that counting never needs a lock)
+static THREAD_LOCAL d_string_stats stats = { 0, 0, 0 };
+
+/// Buffers resized on this thread are also counted here (e.g. to measure a
+/// single conversion)
+static THREAD_LOCAL d_string_stats * stats_active = NULL;
+
+
+static void stats_add(unsigned long reallocs, unsigned long realloc_bytes, unsigned long reserves) {
+	stats.reallocs += reallocs;
+	stats.realloc_bytes += realloc_bytes;
+	stats.reserves += reserves;
+
+	if (stats_active) {
+		stats_active->reallocs += reallocs;
+		stats_active->realloc_bytes += realloc_bytes;
+		stats_active->reserves += reserves;
+	}
+}
+
+
+/// Copy buffer statistics for dynamic strings resized on this thread
+void d_string_stats_get(d_string_stats * result) {
+	if (result) {
+		*result = stats;
+	}
+}
+
+
+/// Reset buffer statistics for dynamic strings resized on this thread
+void d_string_stats_reset(void) {
+	memset(&stats, 0, sizeof(stats));
+}
+
+
+/// Also count buffers resized on this thread in `s` (NULL to stop).  Returns
+/// the previous destination so that it can be restored.
+d_string_stats * d_string_stats_set_active(d_string_stats * s) {
+	d_string_stats * previous = stats_active;
+
+	stats_active = s;
+
+	return previous;
+}
+
+
+#ifdef TEST
+void Test_d_string_stats_set_active(CuTest* tc) {
+	d_string_stats local = { 0, 0, 0 };
+	DString * result = d_string_new("");
+
+	CuAssertPtrEquals(tc, NULL, d_string_stats_set_active(&local));
+
+	d_string_reserve(result, 5000);
+
+	for (int i = 0; i < 5001; ++i) {
+		d_string_append_c(result, 'x');
+	}
+
+	CuAssertPtrEquals(tc, &local, d_string_stats_set_active(NULL));
+	CuAssertIntEquals(tc, 1, local.reserves);
+	CuAssertIntEquals(tc, 1, local.reallocs);
+	CuAssertIntEquals(tc, 5001, local.realloc_bytes);
+
+	// No longer counted here
+	d_string_append_c_array(result, "x", 1);
+	d_string_reserve(result, 100000);
+	CuAssertIntEquals(tc, 1, local.reserves);
+
+	d_string_free(result, true);
+}
+#endif
+
+
 /// Create a new dynamic string
 DString* d_string_new(const char * startingString) {
 	DString* newString = malloc(sizeof(DString));
@@ -196,6 +272,11 @@ char* d_string_free(DString * ripString, bool freeCharacterData) {
 }
 
 
+bool d_string_is_writable(DString * baseString) {
+	return (baseString->currentStringBufferSize != 0);
+}
+
+
 /// Ensure that dynamic string has specified capacity
 static void ensureStringBufferCanHold(DString * baseString, size_t newStringSize) {
 	if (baseString) {
@@ -222,6 +303,8 @@ static void ensureStringBufferCanHold(DString * baseString, size_t newStringSize
 				exit(1);
 			}
 
+			stats_add(1, baseString->currentStringBufferSize, 0);
+
 			baseString->str = temp;
 			baseString->currentStringBufferSize = newBufferSize;
 		}
@@ -258,6 +341,59 @@ void Test_ensureStringBufferCanHold(CuTest* tc) {
 #endif
 
 
+/// Allocate enough room for a string of the specified length, so that it can
+/// be built up without resizing
+void d_string_reserve(DString * baseString, size_t capacity) {
+	if (baseString && (capacity + 1 > baseString->currentStringBufferSize)) {
+		char * temp = realloc(baseString->str, capacity + 1);
+
+		if (temp == NULL) {
+			// Not fatal -- the buffer will simply grow as needed
+			return;
+		}
+
+		stats_add(0, 0, 1);
+
+		baseString->str = temp;
+		baseString->currentStringBufferSize = capacity + 1;
+	}
+}
+
+
+#ifdef TEST
+void Test_d_string_reserve(CuTest* tc) {
+	d_string_stats before, after;
+	DString * result = d_string_new("foo");
+
+	d_string_reserve(result, 100);
+	CuAssertIntEquals(tc, kStringBufferStartingSize, result->currentStringBufferSize);
+
+	d_string_reserve(result, 5000);
+	CuAssertIntEquals(tc, 5001, result->currentStringBufferSize);
+	CuAssertStrEquals(tc, "foo", result->str);
+
+	d_string_stats_get(&before);
+
+	for (int i = 3; i < 5000; ++i) {
+		d_string_append_c(result, 'x');
+	}
+
+	d_string_stats_get(&after);
+	CuAssertIntEquals(tc, 5000, result->currentStringLength);
+	CuAssertIntEquals(tc, 5001, result->currentStringBufferSize);
+	CuAssertIntEquals(tc, before.reallocs, after.reallocs);
+
+	d_string_append_c(result, 'x');
+	d_string_stats_get(&after);
+	CuAssertIntEquals(tc, before.reallocs + 1, after.reallocs);
+
+	d_string_reserve(NULL, 100);
+
+	d_string_free(result, true);
+}
+#endif
+
+
 /// Append null-terminated string to end of dynamic string
 void d_string_append(DString * baseString, const char * appendedString) {
 	if (baseString && appendedString) {
@@ -385,17 +521,30 @@ void Test_d_string_append_c_array(CuTest* tc) {
 void d_string_append_printf(DString * baseString, const char * format, ...) {
 	if (baseString && format) {
 		va_list args;
+
+		// Format directly into the free space at the end of the buffer, and
+		// only format again if that wasn't enough room
+		size_t available = baseString->currentStringBufferSize - baseString->currentStringLength;
+
 		va_start(args, format);
+		int written = vsnprintf(baseString->str + baseString->currentStringLength, available, format, args);
+		va_end(args);
 
-		char* formattedString = NULL;
-		vasprintf(&formattedString, format, args);
+		if (written < 0) {
+			// Restore the terminator in case anything was written
+			baseString->str[baseString->currentStringLength] = '\0';
+			return;
+		}
 
-		if (formattedString != NULL) {
-			d_string_append(baseString, formattedString);
-			free(formattedString);
+		if ((size_t) written >= available) {
+			ensureStringBufferCanHold(baseString, baseString->currentStringLength + written);
+
+			va_start(args, format);
+			vsnprintf(baseString->str + baseString->currentStringLength, written + 1, format, args);
+			va_end(args);
 		}
 
-		va_end(args);
+		baseString->currentStringLength += written;
 	}
 }
 
@@ -420,6 +569,11 @@ void Test_d_string_append_printf(CuTest* tc) {
 
 	d_string_append_printf(NULL, "foo");
 
+	// Formatted text that doesn't fit in the current buffer
+	d_string_append_printf(result, "%2000d|%s", 1, "end");
+	CuAssertIntEquals(tc, 2012, result->currentStringLength);
+	CuAssertStrEquals(tc, "1|end", &result->str[2007]);
+
 	d_string_free(result, true);
 }
 #endif
@@ -102,6 +102,7 @@
 */
 
 
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -111,11 +112,111 @@
 
 #if defined(__WIN32)
 	#include <windows.h>
+#else
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
 #endif
 
 #define kBUFFERSIZE 4096	// How many bytes to read at a time
 
 
+/// A read-only file mapping, presented as a DString
+struct mapped_file {
+	DString			d;				//!< Must be first, so that DString * can be cast back
+	void *			base;			//!< Start of mapping
+	size_t			size;			//!< Size of mapping
+};
+
+typedef struct mapped_file mapped_file;
+
+
+/// Map a regular file into memory (read-only).  If `terminated` is true, the
+/// mapping must be followed by at least one '\0' byte so it can be used as a
+/// C string -- this is guaranteed by the OS when the file does not end exactly
+/// at a page boundary.
+static mapped_file * mapped_file_new(const char * fname, bool terminated) {
+	#if defined(__WIN32)
+	return NULL;
+	#else
+	struct stat st;
+	mapped_file * m = NULL;
+	int fd = open(fname, O_RDONLY);
+
+	if (fd == -1) {
+		return NULL;
+	}
+
+	if ((fstat(fd, &st) != 0) || !S_ISREG(st.st_mode) || (st.st_size == 0)) {
+		// Pipes, devices, and empty files must be read normally
+		goto exit;
+	}
+
+	if (terminated && (st.st_size % sysconf(_SC_PAGESIZE) == 0)) {
+		// No room for terminating '\0'
+		goto exit;
+	}
+
+	void * base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+	if (base == MAP_FAILED) {
+		goto exit;
+	}
+
+	m = malloc(sizeof(mapped_file));
+
+	if (m) {
+		m->base = base;
+		m->size = st.st_size;
+
+		m->d.str = base;
+		m->d.currentStringLength = st.st_size;
+		m->d.currentStringBufferSize = 0;			// Read-only
+
+		// Skip BOM
+		if ((m->size >= 3) && (strncmp(m->d.str, "\xef\xbb\xbf", 3) == 0)) {
+			m->d.str += 3;
+			m->d.currentStringLength -= 3;
+		}
+	} else {
+		munmap(base, st.st_size);
+	}
+
+exit:
+	close(fd);
+
+	return m;
+	#endif
+}
+
+
+static void mapped_file_free(mapped_file * m) {
+	#if !defined(__WIN32)
+
+	if (m) {
+		munmap(m->base, m->size);
+		free(m);
+	}
+
+	#endif
+}
+
+
+/// Map file into memory as a read-only DString, without copying it
+DString * map_file(const char * fname) {
+	mapped_file * m = mapped_file_new(fname, true);
+
+	return (m) ? &m->d : NULL;
+}
+
+
+/// Release a DString created by map_file()
+void unmap_file(DString * d) {
+	mapped_file_free((mapped_file *) d);
+}
+
+
 /// Scan file into a DString
 DString * scan_file(const char * fname) {
 	/* Read from stdin and return a DString *
@@ -126,6 +227,19 @@ DString * scan_file(const char * fname) {
 
 	FILE * file;
 
+	// Regular files can be copied in one step, without repeatedly growing buffer
+	mapped_file * m = mapped_file_new(fname, false);
+
+	if (m) {
+		DString * buffer = d_string_new("");
+
+		d_string_append_c_array(buffer, m->d.str, m->d.currentStringLength);
+
+		mapped_file_free(m);
+
+		return buffer;
+	}
+
 	#if defined(__WIN32)
 	int wchars_num = MultiByteToWideChar(CP_UTF8, 0, fname, -1, NULL, 0);
 	wchar_t wstr[wchars_num];
@@ -144,17 +258,15 @@ DString * scan_file(const char * fname) {
 
 	while ((bytes = fread(chunk, 1, kBUFFERSIZE, file)) > 0) {
 		d_string_append_c_array(buffer, chunk, bytes);
-
-		if (buffer->currentStringLength < kBUFFERSIZE) {
-			// Strip BOM
-			if (strncmp(buffer->str, "\xef\xbb\xbf", 3) == 0) {
-				d_string_erase(buffer, 0, 3);
-			}
-		}
 	}
 
 	fclose(file);
 
+	// Strip BOM
+	if (strncmp(buffer->str, "\xef\xbb\xbf", 3) == 0) {
+		d_string_erase(buffer, 0, 3);
+	}
+
 	return buffer;
 }
 
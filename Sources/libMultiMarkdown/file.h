@@ -124,6 +124,17 @@ DString * scan_file(const char * fname);
 DString * stdin_buffer();
 
 
+/// Map a file into memory as a read-only DString, without copying it.  The
+/// DString must *never* be modified (d_string_is_writable() is false) or freed
+/// with d_string_free() -- use unmap_file() instead.  Returns NULL if the file can't be mapped (e.g. pipes,
+/// stdin, or Windows), in which case scan_file() should be used.
+DString * map_file(const char * fname);
+
+
+/// Release a DString created by map_file()
+void unmap_file(DString * d);
+
+
 /// Windows can use either `\` or `/` as a separator -- thanks to t-beckmann on github
 ///	for suggesting a fix for this.
 bool is_separator(char c);
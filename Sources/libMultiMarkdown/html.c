@@ -57,14 +57,20 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef USE_PTHREADS
+	#include <pthread.h>
+#endif
+
 #include "char.h"
 #include "d_string.h"
 #include "html.h"
 #include "i18n.h"
 #include "libMultiMarkdown.h"
 #include "parser.h"
+#include "rng.h"
 #include "token.h"
 #include "scanners.h"
+#include "stats.h"
 #include "writer.h"
 
 
@@ -92,9 +98,6 @@ static char * my_strdup(const char * source) {
 }
 
 
-// Use Knuth's pseudo random generator to obfuscate email addresses predictably
-long ran_num_next();
-
 void mmd_print_char_html(DString * out, char c, bool obfuscate) {
 	switch (c) {
 		case '"':
@@ -130,11 +133,34 @@ void mmd_print_char_html(DString * out, char c, bool obfuscate) {
 
 
 void mmd_print_string_html(DString * out, const char * str, bool obfuscate) {
-	if (str) {
+	if (str == NULL) {
+		return;
+	}
+
+	if (obfuscate) {
 		while (*str != '\0') {
 			mmd_print_char_html(out, *str, obfuscate);
 			str++;
 		}
+
+		return;
+	}
+
+	size_t run;
+
+	while (*str != '\0') {
+		// Copy the run of characters that don't need escaping in one step
+		run = strcspn(str, "\"&<>");
+
+		if (run) {
+			d_string_append_c_array(out, str, run);
+			str += run;
+		}
+
+		if (*str != '\0') {
+			mmd_print_char_html(out, *str, false);
+			str++;
+		}
 	}
 }
 
@@ -271,6 +297,31 @@ static char * strip_dimension_units(char *original) {
 }
 
 
+/// Images remove "px" from the dimensions of the link they use, which is seen by
+/// any later use of the same reference link.  Do this for every reference in
+/// advance, so that output doesn't depend on which blocks were exported before.
+void strip_dimension_px_from_links_html(scratch_pad * scratch) {
+	link * l, * tmp;
+	attr * a;
+	char * dimension;
+
+	HASH_ITER(hh, scratch->link_hash, l, tmp) {
+		for (a = l->attributes; a; a = a->next) {
+			if ((strcmp(a->key, "width") == 0) || (strcmp(a->key, "height") == 0)) {
+				dimension = strip_dimension_units(a->value);
+
+				if ((strlen(dimension) + 2 == strlen(a->value)) &&
+						(strcmp(&(a->value[strlen(dimension)]), "px") == 0)) {
+					a->value[strlen(dimension)] = '\0';
+				}
+
+				free(dimension);
+			}
+		}
+	}
+}
+
+
 void mmd_export_link_html(DString * out, const char * source, token * text, link * link, scratch_pad * scratch) {
 	attr * a = link->attributes;
 
@@ -501,11 +552,354 @@ void mmd_export_toc_html(DString * out, const char * source, scratch_pad * scrat
 }
 
 
-void mmd_export_token_html(DString * out, const char * source, token * t, scratch_pad * scratch) {
-	if (t == NULL) {
+#ifdef USE_PTHREADS
+
+#define kMinExportBlocksPerThread 64	//!< Don't give a thread fewer top level blocks than this
+
+
+/// One top level block, possibly exported ahead of time by a worker thread
+typedef struct {
+	token *		t;
+	DString *	html;					//!< Output from worker thread (NULL if exported in order)
+	short		padded;					//!< Value of scratch->padded after exporting
+	short		skip_token;				//!< Value of scratch->skip_token after exporting
+} html_export_block;
+
+
+/// Export of a run of top level blocks, done by one thread
+typedef struct {
+	const char *		source;
+	scratch_pad			scratch;		//!< Private copy of the shared scratch pad
+	html_export_block *	blocks;
+	size_t				start;
+	size_t				stop;
+
+	#ifdef kUseObjectPool
+	struct pool *		pool;			//!< Tokens created by this thread
+	#endif
+
+	#ifdef USE_STATS
+	mmd_stats			stats;			//!< Gathered by this thread
+	#endif
+} html_export_job;
+
+
+/// Would any token in this chain use the shared note/glossary/etc. lists, or
+/// otherwise depend on what was exported before it?
+static bool token_chain_export_is_ordered(token * t, bool links_shared) {
+	stack * pending = NULL;			// Tokens still to be checked after those inside
+	bool ordered = false;
+
+	while (t && !ordered) {
+		switch (t->type) {
+			case PAIR_ANGLE:
+			case PAIR_BRACKET_ABBREVIATION:
+			case PAIR_BRACKET_CITATION:
+			case PAIR_BRACKET_FOOTNOTE:
+			case PAIR_BRACKET_GLOSSARY:
+			case TOC:
+				ordered = true;
+				continue;
+
+			case PAIR_BRACKET:
+			case PAIR_BRACKET_IMAGE:
+				if (links_shared) {
+					ordered = true;
+					continue;
+				}
+
+				break;
+		}
+
+		// Check tokens inside this one, then the ones that follow
+		if (t->child) {
+			if (t->next) {
+				if (pending == NULL) {
+					pending = stack_new(0);
+				}
+
+				stack_push(pending, t->next);
+			}
+
+			t = t->child;
+		} else if (t->next) {
+			t = t->next;
+		} else {
+			t = (pending && pending->size) ? stack_pop(pending) : NULL;
+		}
+	}
+
+	if (pending) {
+		stack_free(pending);
+	}
+
+	return ordered;
+}
+
+
+/// Can this top level block be exported out of order?  `links_shared` means
+/// that exporting an image can alter a reference link seen by other blocks.
+static bool block_exports_independently(token * t, bool links_shared) {
+	// A table exports the following block as its caption
+	if (t->prev && (t->prev->type == BLOCK_TABLE)) {
+		return false;
+	}
+
+	switch (t->type) {
+		case BLOCK_BLOCKQUOTE:
+		case BLOCK_CODE_FENCED:
+		case BLOCK_CODE_INDENTED:
+		case BLOCK_DEFLIST:
+		case BLOCK_HR:
+		case BLOCK_HTML:
+		case BLOCK_LIST_BULLETED:
+		case BLOCK_LIST_BULLETED_LOOSE:
+		case BLOCK_LIST_ENUMERATED:
+		case BLOCK_LIST_ENUMERATED_LOOSE:
+		case BLOCK_PARA:
+		case BLOCK_TABLE:
+			// These all start with pad(out, 2, scratch)
+			break;
+
+		// Headers are left out, since a TOC exports (and alters) them as well
+
+		default:
+			return false;
+	}
+
+	if (token_chain_export_is_ordered(t->child, links_shared)) {
+		return false;
+	}
+
+	if ((t->type == BLOCK_TABLE) && t->next &&
+			token_chain_export_is_ordered(t->next->child, links_shared)) {
+		return false;
+	}
+
+	return true;
+}
+
+
+/// Do any reference links have dimensions that mmd_export_image_html() will
+/// change?
+static bool links_have_px_dimensions(scratch_pad * scratch) {
+	link * l, * tmp;
+	attr * a;
+	size_t len;
+
+	HASH_ITER(hh, scratch->link_hash, l, tmp) {
+		for (a = l->attributes; a; a = a->next) {
+			if ((strcmp(a->key, "width") == 0) || (strcmp(a->key, "height") == 0)) {
+				len = strlen(a->value);
+
+				if ((len >= 2) && (strcmp(&(a->value[len - 2]), "px") == 0)) {
+					return true;
+				}
+			}
+		}
+	}
+
+	return false;
+}
+
+
+static void * html_export_worker(void * arg) {
+	html_export_job * job = arg;
+	html_export_block * block;
+
+	#ifdef kUseObjectPool
+	struct pool * old_pool = token_pool_set_active(job->pool);
+	#endif
+
+	#ifdef USE_STATS
+	stats_scope scope;
+	stats_scope_begin(&scope, &job->stats);
+	#endif
+
+	for (size_t i = job->start; i < job->stop; ++i) {
+		block = &job->blocks[i];
+
+		if (block->html) {
+			// The block starts by padding the output, which the main thread does
+			job->scratch.padded = 2;
+			job->scratch.skip_token = 0;
+
+			mmd_export_token_html(block->html, job->source, block->t, &job->scratch);
+
+			block->padded = job->scratch.padded;
+			block->skip_token = job->scratch.skip_token;
+		}
+	}
+
+	#ifdef USE_STATS
+	stats_scope_end(&scope);
+	#endif
+
+	#ifdef kUseObjectPool
+	token_pool_set_active(old_pool);
+	#endif
+
+	return NULL;
+}
+
+
+/// Export top level blocks on scratch->threads threads.  Blocks that depend on
+/// the order of export (notes, TOC, etc.) are left for this thread, which then
+/// puts everything together so that output matches mmd_export_token_tree_html()
+static void mmd_export_token_tree_html_parallel(DString * out, const char * source, token * t, scratch_pad * scratch) {
+	size_t count = 0;
+	token * walker;
+
+	for (walker = t; walker; walker = walker->next) {
+		count++;
+	}
+
+	size_t threads = scratch->threads;
+
+	if (threads > count / kMinExportBlocksPerThread) {
+		threads = count / kMinExportBlocksPerThread;
+	}
+
+	if ((threads < 2) || scratch->store_assets || scratch->remember_assets) {
+		mmd_export_token_tree_html(out, source, t, scratch);
+		return;
+	}
+
+	html_export_block * blocks = calloc(count, sizeof(html_export_block));
+	html_export_job * jobs = calloc(threads, sizeof(html_export_job));
+	pthread_t * workers = malloc(sizeof(pthread_t) * threads);
+	bool * started = calloc(threads, sizeof(bool));
+
+	if (!blocks || !jobs || !workers || !started) {
+		free(blocks);
+		free(jobs);
+		free(workers);
+		free(started);
+		mmd_export_token_tree_html(out, source, t, scratch);
 		return;
 	}
 
+	bool links_shared = links_have_px_dimensions(scratch);
+	size_t i = 0;
+	size_t total = 0;
+
+	for (walker = t; walker; walker = walker->next) {
+		blocks[i].t = walker;
+
+		if (block_exports_independently(walker, links_shared)) {
+			blocks[i].html = d_string_new("");
+			total += walker->len;
+		}
+
+		i++;
+	}
+
+	scratch->recurse_depth++;
+
+	// Divide blocks into runs with roughly equal amounts of work
+	size_t done = 0;
+	size_t b = 0;
+
+	for (i = 0; i < threads; ++i) {
+		jobs[i].source = source;
+		jobs[i].scratch = *scratch;
+		jobs[i].scratch.sink = NULL;
+		jobs[i].blocks = blocks;
+		jobs[i].start = b;
+
+		if (i == threads - 1) {
+			b = count;
+		} else {
+			while ((b < count) && (done < total / threads * (i + 1))) {
+				if (blocks[b].html) {
+					done += blocks[b].t->len;
+				}
+
+				b++;
+			}
+		}
+
+		jobs[i].stop = b;
+
+		#ifdef kUseObjectPool
+		jobs[i].pool = token_pool_new();
+		#endif
+	}
+
+	// This thread handles the first run, and any that can't be started
+	for (i = 1; i < threads; ++i) {
+		started[i] = (pthread_create(&workers[i], NULL, html_export_worker, &jobs[i]) == 0);
+	}
+
+	for (i = 0; i < threads; ++i) {
+		if (!started[i]) {
+			html_export_worker(&jobs[i]);
+		}
+	}
+
+	for (i = 1; i < threads; ++i) {
+		if (started[i]) {
+			pthread_join(workers[i], NULL);
+		}
+	}
+
+	#ifdef kUseObjectPool
+
+	for (i = 0; i < threads; ++i) {
+		token_pool_adopt(jobs[i].pool);
+	}
+
+	#endif
+
+	#ifdef USE_STATS
+
+	// (Runs on this thread were already counted when their scope ended)
+	for (i = 1; i < threads; ++i) {
+		if (started[i] && stats_active()) {
+			stats_add(stats_active(), &jobs[i].stats);
+		}
+	}
+
+	#endif
+
+	// Put the output together in order, exporting the remaining blocks
+	for (i = 0; i < count; ++i) {
+		if (scratch->skip_token) {
+			scratch->skip_token--;
+		} else if (blocks[i].html) {
+			pad(out, 2, scratch);
+			d_string_append_c_array(out, blocks[i].html->str, blocks[i].html->currentStringLength);
+			scratch->padded = blocks[i].padded;
+			scratch->skip_token = blocks[i].skip_token;
+		} else {
+			mmd_export_token_html(out, source, blocks[i].t, scratch);
+		}
+
+		mmd_export_block_done(out, scratch);
+
+		if (blocks[i].html) {
+			d_string_free(blocks[i].html, true);
+		}
+	}
+
+	scratch->recurse_depth--;
+
+	free(started);
+	free(workers);
+	free(jobs);
+	free(blocks);
+}
+
+#endif
+
+
+/// Export the start of `t` -- returns true if its children and then
+/// mmd_export_token_close_html() should follow
+static bool mmd_export_token_open_html(DString * out, const char * source, token * t, scratch_pad * scratch, mmd_export_saved * saved) {
+	if (t == NULL) {
+		return false;
+	}
+
 	short	temp_short;
 	short	temp_short2;
 	short	temp_short3;
@@ -559,31 +953,21 @@ void mmd_export_token_html(DString * out, const char * source, token * t, scratc
 			pad(out, 2, scratch);
 			print_const("<blockquote>\n");
 			scratch->padded = 2;
-			mmd_export_token_tree_html(out, source, t->child, scratch);
-			pad(out, 1, scratch);
-			print_const("</blockquote>");
-			scratch->padded = 0;
-			break;
+			return true;
 
 		case BLOCK_DEFINITION:
 			pad(out, 2, scratch);
 			print_const("<dd>");
 
-			temp_short = scratch->list_is_tight;
+			saved->list_is_tight = scratch->list_is_tight;
 
 			if (t->child) {
 				if (!(t->child->next && (t->child->next->type == BLOCK_EMPTY) && t->child->next->next)) {
 					scratch->list_is_tight = true;
 				}
-
-				mmd_export_token_tree_html(out, source, t->child, scratch);
 			}
 
-			print_const("</dd>");
-			scratch->padded = 0;
-
-			scratch->list_is_tight = temp_short;
-			break;
+			return true;
 
 		case BLOCK_DEFLIST:
 			pad(out, 2, scratch);
@@ -596,16 +980,7 @@ void mmd_export_token_html(DString * out, const char * source, token * t, scratc
 			}
 
 			scratch->padded = 2;
-
-			mmd_export_token_tree_html(out, source, t->child, scratch);
-			pad(out, 1, scratch);
-
-			if (!(t->next && (t->next->type == BLOCK_DEFLIST))) {
-				print_const("</dl>\n");
-			}
-
-			scratch->padded = 1;
-			break;
+			return true;
 
 		case BLOCK_CODE_FENCED:
 			pad(out, 2, scratch);
@@ -700,7 +1075,7 @@ void mmd_export_token_html(DString * out, const char * source, token * t, scratc
 
 		case BLOCK_LIST_BULLETED_LOOSE:
 		case BLOCK_LIST_BULLETED:
-			temp_short = scratch->list_is_tight;
+			saved->list_is_tight = scratch->list_is_tight;
 
 			switch (t->type) {
 				case BLOCK_LIST_BULLETED_LOOSE:
@@ -715,16 +1090,11 @@ void mmd_export_token_html(DString * out, const char * source, token * t, scratc
 			pad(out, 2, scratch);
 			print_const("<ul>");
 			scratch->padded = 0;
-			mmd_export_token_tree_html(out, source, t->child, scratch);
-			pad(out, 1, scratch);
-			print_const("</ul>");
-			scratch->padded = 0;
-			scratch->list_is_tight = temp_short;
-			break;
+			return true;
 
 		case BLOCK_LIST_ENUMERATED_LOOSE:
 		case BLOCK_LIST_ENUMERATED:
-			temp_short = scratch->list_is_tight;
+			saved->list_is_tight = scratch->list_is_tight;
 
 			switch (t->type) {
 				case BLOCK_LIST_ENUMERATED_LOOSE:
@@ -739,21 +1109,13 @@ void mmd_export_token_html(DString * out, const char * source, token * t, scratc
 			pad(out, 2, scratch);
 			print_const("<ol>");
 			scratch->padded = 0;
-			mmd_export_token_tree_html(out, source, t->child, scratch);
-			pad(out, 1, scratch);
-			print_const("</ol>");
-			scratch->padded = 0;
-			scratch->list_is_tight = temp_short;
-			break;
+			return true;
 
 		case BLOCK_LIST_ITEM:
 			pad(out, 1, scratch);
 			print_const("<li>");
 			scratch->padded = 2;
-			mmd_export_token_tree_html(out, source, t->child, scratch);
-			print_const("</li>");
-			scratch->padded = 0;
-			break;
+			return true;
 
 		case BLOCK_LIST_ITEM_TIGHT:
 			pad(out, 1, scratch);
@@ -764,19 +1126,7 @@ void mmd_export_token_html(DString * out, const char * source, token * t, scratc
 			}
 
 			scratch->padded = 2;
-			mmd_export_token_tree_html(out, source, t->child, scratch);
-
-			if (scratch->close_para) {
-				if (!scratch->list_is_tight) {
-					print_const("</p>");
-				}
-			} else {
-				scratch->close_para = true;
-			}
-
-			print_const("</li>");
-			scratch->padded = 0;
-			break;
+			return true;
 
 		case BLOCK_META:
 			break;
@@ -808,8 +1158,7 @@ void mmd_export_token_html(DString * out, const char * source, token * t, scratc
 					temp_short = scratch->footnote_being_printed;
 
 					if (scratch->extensions & EXT_RANDOM_FOOT) {
-						srand(scratch->random_seed_base + temp_short);
-						temp_short = rand() % 32000 + 1;
+						temp_short = random_footnote_id(scratch, temp_short);
 					}
 
 					printf(" <a href=\"#fnref:%d\" title=\"%s\" class=\"reversefootnote\">&#160;&#8617;</a>", temp_short, LC("return to body"));
@@ -981,10 +1330,7 @@ void mmd_export_token_html(DString * out, const char * source, token * t, scratc
 		case BLOCK_TERM:
 			pad(out, 2, scratch);
 			print_const("<dt>");
-			mmd_export_token_tree_html(out, source, t->child, scratch);
-			print_const("</dt>\n");
-			scratch->padded = 2;
-			break;
+			return true;
 
 		case BLOCK_TOC:
 
@@ -1108,6 +1454,15 @@ void mmd_export_token_html(DString * out, const char * source, token * t, scratc
 			break;
 
 		case DOC_START_TOKEN:
+			#ifdef USE_PTHREADS
+
+			if (scratch->threads > 1) {
+				mmd_export_token_tree_html_parallel(out, source, t->child, scratch);
+				break;
+			}
+
+			#endif
+
 			mmd_export_token_tree_html(out, source, t->child, scratch);
 			break;
 
@@ -1339,7 +1694,7 @@ void mmd_export_token_html(DString * out, const char * source, token * t, scratc
 			} else if (scan_html(&source[t->start])) {
 				print_token(t);
 			} else {
-				mmd_export_token_tree_html(out, source, t->child, scratch);
+				return true;
 			}
 
 			free(temp_char);
@@ -1348,8 +1703,7 @@ void mmd_export_token_html(DString * out, const char * source, token * t, scratc
 		case PAIR_BRACE:
 		case PAIR_BRACES:
 		case PAIR_RAW_FILTER:
-			mmd_export_token_tree_html(out, source, t->child, scratch);
-			break;
+			return true;
 
 		case PAIR_BRACKET:
 			if ((scratch->extensions & EXT_NOTES) &&
@@ -1395,12 +1749,11 @@ void mmd_export_token_html(DString * out, const char * source, token * t, scratc
 
 				scratch->skip_token = temp_short;
 
-				return;
+				return false;
 			}
 
 			// No links exist, so treat as normal
-			mmd_export_token_tree_html(out, source, t->child, scratch);
-			break;
+			return true;
 
 		case PAIR_BRACKET_ABBREVIATION:
 
@@ -1584,8 +1937,7 @@ parse_citation:
 					// This is a re-use of a previously used note
 
 					if (scratch->extensions & EXT_RANDOM_FOOT) {
-						srand(scratch->random_seed_base + temp_short);
-						temp_short3 = rand() % 32000 + 1;
+						temp_short3 = random_footnote_id(scratch, temp_short);
 					} else {
 						temp_short3 = temp_short;
 					}
@@ -1596,8 +1948,7 @@ parse_citation:
 					// This is the first time this note was used
 
 					if (scratch->extensions & EXT_RANDOM_FOOT) {
-						srand(scratch->random_seed_base + temp_short);
-						temp_short3 = rand() % 32000 + 1;
+						temp_short3 = random_footnote_id(scratch, temp_short);
 					} else {
 						temp_short3 = temp_short;
 					}
@@ -1838,8 +2189,7 @@ parse_citation:
 		case PAIR_SUBSCRIPT:
 		case PAIR_SUPERSCRIPT:
 		case PAIR_UL:
-			mmd_export_token_tree_html(out, source, t->child, scratch);
-			break;
+			return true;
 
 		case PAREN_LEFT:
 			print_char('(');
@@ -2018,33 +2368,97 @@ parse_citation:
 			break;
 
 		default:
-			fprintf(stderr, "Unknown token type: %d (%lu:%lu)\n", t->type, t->start, t->len);
+			fprintf(stderr, "Unknown token type: %d (%lu:%lu)\n", t->type, (unsigned long) t->start, (unsigned long) t->len);
 			token_describe(t, source);
 			break;
 	}
+	return false;
 }
 
 
-void mmd_export_token_tree_html(DString * out, const char * source, token * t, scratch_pad * scratch) {
+/// Export the end of `t`, after its children
+static void mmd_export_token_close_html(DString * out, const char * source, token * t, scratch_pad * scratch, mmd_export_saved saved) {
+	switch (t->type) {
+		case BLOCK_BLOCKQUOTE:
+			pad(out, 1, scratch);
+			print_const("</blockquote>");
+			scratch->padded = 0;
+			break;
 
-	// Prevent stack overflow with "dangerous" input causing extreme recursion
-	if (scratch->recurse_depth == kMaxExportRecursiveDepth) {
-		return;
+		case BLOCK_DEFINITION:
+			print_const("</dd>");
+			scratch->padded = 0;
+
+			scratch->list_is_tight = saved.list_is_tight;
+			break;
+
+		case BLOCK_DEFLIST:
+			pad(out, 1, scratch);
+
+			if (!(t->next && (t->next->type == BLOCK_DEFLIST))) {
+				print_const("</dl>\n");
+			}
+
+			scratch->padded = 1;
+			break;
+
+		case BLOCK_LIST_BULLETED_LOOSE:
+		case BLOCK_LIST_BULLETED:
+			pad(out, 1, scratch);
+			print_const("</ul>");
+			scratch->padded = 0;
+			scratch->list_is_tight = saved.list_is_tight;
+			break;
+
+		case BLOCK_LIST_ENUMERATED_LOOSE:
+		case BLOCK_LIST_ENUMERATED:
+			pad(out, 1, scratch);
+			print_const("</ol>");
+			scratch->padded = 0;
+			scratch->list_is_tight = saved.list_is_tight;
+			break;
+
+		case BLOCK_LIST_ITEM:
+			print_const("</li>");
+			scratch->padded = 0;
+			break;
+
+		case BLOCK_LIST_ITEM_TIGHT:
+			if (scratch->close_para) {
+				if (!scratch->list_is_tight) {
+					print_const("</p>");
+				}
+			} else {
+				scratch->close_para = true;
+			}
+
+			print_const("</li>");
+			scratch->padded = 0;
+			break;
+
+		case BLOCK_TERM:
+			print_const("</dt>\n");
+			scratch->padded = 2;
+			break;
+
+		default:
+			break;
 	}
+}
 
-	scratch->recurse_depth++;
 
-	while (t != NULL) {
-		if (scratch->skip_token) {
-			scratch->skip_token--;
-		} else {
-			mmd_export_token_html(out, source, t, scratch);
-		}
+void mmd_export_token_html(DString * out, const char * source, token * t, scratch_pad * scratch) {
+	mmd_export_saved saved;
 
-		t = t->next;
+	if (mmd_export_token_open_html(out, source, t, scratch, &saved)) {
+		mmd_export_token_tree_html(out, source, t->child, scratch);
+		mmd_export_token_close_html(out, source, t, scratch, saved);
 	}
+}
 
-	scratch->recurse_depth--;
+
+void mmd_export_token_tree_html(DString * out, const char * source, token * t, scratch_pad * scratch) {
+	mmd_export_token_tree(out, source, t, scratch, mmd_export_token_open_html, mmd_export_token_close_html);
 }
 
 
@@ -2373,7 +2787,12 @@ void mmd_export_footnote_list_html(DString * out, const char * source, scratch_p
 			// Export footnote
 			pad(out, 2, scratch);
 
-			printf("<li id=\"fn:%d\">\n", i + 1);
+			if (scratch->extensions & EXT_RANDOM_FOOT) {
+				printf("<li id=\"fn:%d\">\n", random_footnote_id(scratch, i + 1));
+			} else {
+				printf("<li id=\"fn:%d\">\n", i + 1);
+			}
+
 			scratch->padded = 6;
 
 			note = stack_peek_index(scratch->used_footnotes, i);
@@ -2396,7 +2815,7 @@ void mmd_export_footnote_list_html(DString * out, const char * source, scratch_p
 			mmd_export_token_tree_html(out, source, content, scratch);
 
 			pad(out, 1, scratch);
-			printf("</li>");
+			print_const("</li>");
 			scratch->padded = 0;
 		}
 
@@ -2449,7 +2868,7 @@ void mmd_export_glossary_list_html(DString * out, const char * source, scratch_p
 			mmd_export_token_tree_html(out, source, content, scratch);
 
 			pad(out, 1, scratch);
-			printf("</li>");
+			print_const("</li>");
 			scratch->padded = 0;
 		}
 
@@ -2497,7 +2916,7 @@ void mmd_export_citation_list_html(DString * out, const char * source, scratch_p
 			mmd_export_token_tree_html(out, source, content, scratch);
 
 			pad(out, 1, scratch);
-			printf("</li>");
+			print_const("</li>");
 			scratch->padded = 0;
 		}
 
@@ -77,5 +77,7 @@ void mmd_end_complete_html(DString * out, const char * source, scratch_pad * scr
 
 void mmd_print_string_html(DString * out, const char * str, bool obfuscate);
 
+void strip_dimension_px_from_links_html(scratch_pad * scratch);
+
 
 #endif
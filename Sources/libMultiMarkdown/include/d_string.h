@@ -74,13 +74,23 @@
 /// Structure for dynamic string
 struct DString {
 	char * str;								//!< Pointer to UTF-8 byte stream for string
-	unsigned long currentStringBufferSize;	//!< Size of buffer currently allocated
+	unsigned long currentStringBufferSize;	//!< Size of buffer currently allocated (0 if `str` is read-only text belonging to someone else)
 	unsigned long currentStringLength;		//!< Size of current string
 };
 
 typedef struct DString DString;
 
 
+/// Buffer statistics for dynamic strings, to help tune how they are sized
+struct d_string_stats {
+	unsigned long reallocs;					//!< Number of times a buffer had to grow
+	unsigned long realloc_bytes;			//!< Total size of those buffers before growing (most that had to be copied)
+	unsigned long reserves;					//!< Number of buffers sized in advance with d_string_reserve()
+};
+
+typedef struct d_string_stats d_string_stats;
+
+
 /// Create a new dynamic string
 DString * d_string_new(
 	const char * startingString				//!< Initial contents for string
@@ -94,6 +104,38 @@ char * d_string_free(
 );
 
 
+/// Can the text of this string be changed?  Strings that present someone
+/// else's read-only text (e.g. map_file()) have no buffer of their own.
+bool d_string_is_writable(
+	DString * baseString					//!< DString to check
+);
+
+
+/// Allocate enough room for a string of the specified length, so that it can
+/// be built up without resizing
+void d_string_reserve(
+	DString * baseString,					//!< DString to be resized
+	size_t capacity							//!< Length of string (not including '\0') to make room for
+);
+
+
+/// Copy buffer statistics for dynamic strings resized on this thread
+void d_string_stats_get(
+	d_string_stats * result					//!< Where to store statistics
+);
+
+
+/// Reset buffer statistics for dynamic strings resized on this thread
+void d_string_stats_reset(void);
+
+
+/// Also count buffers resized on this thread in `s` (NULL to stop).  Returns
+/// the previous destination so that it can be restored.
+d_string_stats * d_string_stats_set_active(
+	d_string_stats * s						//!< Where to add statistics for this thread
+);
+
+
 /// Append null-terminated string to end of dynamic string
 void d_string_append(
 	DString * baseString,					//!< DString to be appended
@@ -13,16 +13,15 @@
 
 	******IMPORTANT******
 
-	If you are using libMultiMarkdown in your own project, you need to either:
+	When kUseObjectPool is enabled in `token.h`, each `mmd_engine` allocates
+	its tokens from its own private pool.  The pool is released when the
+	engine is freed, and separate engines can be used on separate threads
+	without any locking (a single engine must not be shared between threads).
 
-	1. Disable kUseObjectPool in `token.h`
-
-	2. Properly manage the `token_pool_init` and `token_pool_free` functions.
-
-
-	I recommend option #1, unless you absolutely need the best performance for
-	long documents.  Doing #2 properly is tricky in any program that can handle
-	multiple MMD text strings at overlapping times.
+	`token_pool_init` and `token_pool_free` are only needed if you create
+	tokens yourself outside of an `mmd_engine`.  That default pool is private
+	to the calling thread, and should be freed with `token_pool_free` before
+	the thread exits (with pthreads it is otherwise freed on thread exit).
 
 **/
 
@@ -71,6 +70,7 @@
 #define MMD6_H
 
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 
 
@@ -193,7 +193,10 @@ struct stack * mmd_d_string_transclusion_manifest(DString * source, const char *
 	MMD Engine variants
 */
 
-/// Create MMD Engine using an existing DString (A new copy is *not* made)
+/// Create MMD Engine using an existing DString (A new copy is *not* made).
+/// The DString may be read-only (e.g. from map_file()).  Functions that edit
+/// the source then give the engine a private copy to change instead, and your
+/// DString stays as it was.
 mmd_engine * mmd_engine_create_with_dstring(
 	DString *		d,
 	unsigned long	extensions
@@ -212,6 +215,16 @@ mmd_engine * mmd_engine_create_with_string(
 void mmd_engine_reset(mmd_engine * e);
 
 
+/// Reuse an existing engine for new source text, keeping its extensions and
+/// language.  The engine's DString is overwritten with a copy of `str` (so if
+/// the engine was created with your own DString, that DString is modified,
+/// unless it is read-only).  This avoids the setup cost of creating a new engine for each document.
+void mmd_engine_reset_with_string(
+	mmd_engine *	e,
+	const char *	str
+);
+
+
 /// Free an existing MMD Engine
 void mmd_engine_free(
 	mmd_engine *	e,
@@ -223,23 +236,122 @@ void mmd_engine_free(
 void mmd_engine_set_language(mmd_engine * e, short language);
 
 
-/// Parse part of the string into a token tree
+/// Parse part of the string into a token tree.  The tree belongs to the engine,
+/// and its memory is reused by the next parse (or mmd_engine_reset()).
 token * mmd_engine_parse_substring(mmd_engine * e, size_t byte_start, size_t byte_len);
 
 
+/// Set number of threads used for large documents (default 1).  Once the
+/// block structure is known, the blocks are divided among the threads to match
+/// up emphasis, links, etc.  HTML export renders blocks on separate threads,
+/// and the result is identical to single threaded output.  Has no effect
+/// without POSIX threads.
+void mmd_engine_set_threads(mmd_engine * e, int threads);
+
+
+/// Copy the token tree into a single block of memory, in the order it is
+/// read, after each parse (default false).  Export of large documents is
+/// faster, at the cost of the copy.
+void mmd_engine_set_freeze(mmd_engine * e, bool freeze);
+
+
 /// Parse the entire string into a token tree
 void mmd_engine_parse_string(mmd_engine * e);
 
 
+/// Did the last parse fail because the source was too long?  Only possible
+/// with compact tokens (`cmake -DCOMPACT_TOKENS=1`), which limit source text
+/// to 4 GB.  There is no token tree, and any output is empty.
+bool mmd_engine_source_too_long(mmd_engine * e);
+
+
+/// Edit the engine's source text (delete `deleted` bytes at `offset`, then
+/// insert `inserted`), and bring the token tree up to date.  Only the top level
+/// blocks near the edit are parsed again, and offsets of the following blocks
+/// are shifted.  Once an engine has been edited, export works on a copy of the
+/// token tree, so that it can be updated again after each export.  Before
+/// that, or if nothing has been parsed yet, the entire string is parsed
+/// instead.  A read-only source is copied before the first edit.
+void mmd_engine_update_source(mmd_engine * e, size_t offset, size_t deleted, const char * inserted);
+
+
 /// Export parsed token tree to output format
 void mmd_engine_export_token_tree(DString * out, mmd_engine * e, short format);
 
 
+/// Callback used to receive output as it is generated.  Return 0 on success,
+/// or non-zero to report an error (no further output will be sent).
+typedef int (*mmd_write_callback)(const char * data, size_t len, void * context);
+
+
+/// Convert MMD text to specified format, passing output to `write` in pieces as
+/// each top level block is finished, rather than building the entire document
+/// in memory.  Supports HTML, LaTeX, Beamer, Memoir, and FODT.
+/// Returns 0 on success, -1 for unsupported formats, or the callback's error
+int mmd_engine_convert_to_callback(mmd_engine * e, short format, mmd_write_callback write, void * context);
+
+
+/// Convert MMD text to specified format, writing output to `stream` as it is
+/// generated.  Returns 0 on success, -1 for unsupported formats, or the errno
+/// of the failed write
+int mmd_engine_convert_to_stream(mmd_engine * e, short format, FILE * stream);
+
+
 /// Convert MMD text to specified format, with specified extensions, and language
 /// Returned char * must be freed
 char * mmd_engine_convert(mmd_engine * e, short format);
 
 
+/// Cache of the HTML for each top level block of a document, used to refresh a
+/// preview by rendering only the blocks that changed
+typedef struct mmd_fragment_cache mmd_fragment_cache;
+
+
+/// Fragments changed by a conversion: the previous fragments [start, start + removed)
+/// were replaced by the new fragments [start, start + inserted)
+typedef struct {
+	size_t		start;
+	size_t		removed;
+	size_t		inserted;
+} mmd_fragment_diff;
+
+
+/// Create an empty fragment cache
+mmd_fragment_cache * mmd_fragment_cache_new(void);
+
+
+/// Free fragment cache
+void mmd_fragment_cache_free(mmd_fragment_cache * c);
+
+
+/// Number of fragments from the last conversion
+size_t mmd_fragment_cache_count(mmd_fragment_cache * c);
+
+
+/// HTML for the fragment at `index` (owned by the cache), with its length in `len`
+const char * mmd_fragment_cache_html(mmd_fragment_cache * c, size_t index, size_t * len);
+
+
+/// Number of blocks rendered by the last conversion, rather than taken from the cache
+size_t mmd_fragment_cache_rendered(mmd_fragment_cache * c);
+
+
+/// Convert MMD text to HTML fragments stored in `c` -- one for each top level
+/// block that has output, then one for footnotes, glossary, and citations.
+/// Blocks are rendered again only if their source, their neighbors, or any
+/// reference targets (definitions, headers, tables, metadata) changed, or if
+/// they use notes whose numbering depends on earlier blocks.  Complete
+/// document wrappers are not included.
+mmd_fragment_diff mmd_engine_convert_to_fragments(mmd_engine * e, mmd_fragment_cache * c);
+
+
+/// Export the parsed token tree to HTML fragments stored in `c`, as with
+/// mmd_engine_convert_to_fragments(), but without parsing the entire string
+/// again.  Used after mmd_engine_update_source() to refresh a preview as the
+/// text is edited.
+mmd_fragment_diff mmd_engine_export_html_fragments(mmd_engine * e, mmd_fragment_cache * c);
+
+
 /// Convert MMD text and write results to specified file -- used for "complex" output formats requiring
 /// multiple documents (e.g. EPUB)
 void mmd_engine_convert_to_file(mmd_engine * e, short format, const char * directory, const char * filepath);
@@ -274,6 +386,37 @@ void mmd_engine_update_metavalue_for_key(mmd_engine * e, const char * key, const
 struct stack * mmd_engine_transclusion_manifest(mmd_engine * e, const char * search_path, const char * source_path);
 
 
+/// Where the time went while processing, to help diagnose slow conversions.
+/// Only gathered when libMultiMarkdown is built with USE_STATS (`cmake
+/// -DSTATS=1`).
+typedef struct {
+	double			transclude_time;		//!< Seconds spent transcluding files
+	double			tokenize_time;			//!< Seconds spent in the lexer
+	double			parse_time;				//!< Seconds spent in the (lemon) block parser
+	double			pair_time;				//!< Seconds spent pairing span level tokens
+	double			export_time;			//!< Seconds spent exporting
+
+	unsigned long	tokens;					//!< Tokens allocated
+	unsigned long	pool_slabs;				//!< Token pool slabs allocated
+	unsigned long	pool_slabs_reused;		//!< Token pool slabs reused instead of allocated
+	unsigned long	string_reallocs;		//!< Times a DString buffer had to grow
+	unsigned long	string_realloc_bytes;	//!< Size of those buffers before they grew
+
+	unsigned long	export_depth_hits;		//!< Times kMaxExportRecursiveDepth stopped export (cycle of notes, or too many nested walkers)
+} mmd_stats;
+
+
+/// Copy statistics gathered by engine since it was created.  Returns false
+/// (and clears `result`) if libMultiMarkdown was built without USE_STATS.
+bool mmd_engine_get_stats(mmd_engine * e, mmd_stats * result);
+
+
+/// Also add statistics for work done on this thread to `s` (NULL to stop),
+/// including transclusion and conversions that use a temporary engine.
+/// Returns the previous destination so that it can be restored.
+mmd_stats * mmd_stats_set_active(mmd_stats * s);
+
+
 
 
 /*
@@ -289,11 +432,41 @@ char * mmd_version(void);
 DString * scan_file(const char * fname);
 
 
+/// Map file into memory as a read-only DString (without copying it).  Must not be
+/// modified, and must be released with unmap_file().  Returns NULL if the file
+/// can't be mapped, in which case use scan_file().
+DString * map_file(const char * fname);
+
+
+/// Release a DString created by map_file()
+void unmap_file(DString * d);
+
+
 /// Recursively transclude source text, given a search directory.
 /// Track files to prevent infinite recursive loops
 void mmd_transclude_source(DString * source, const char * search_path, const char * source_path, short format, struct stack * parsed, struct stack * manifest);
 
 
+/// Cache of files read during transclusion, so that files included by many
+/// documents (or many times in one document) are read from disk only once.  A
+/// file is read again if its modification time or size has changed.
+typedef struct mmd_transclusion_cache mmd_transclusion_cache;
+
+
+/// Create an empty transclusion cache
+mmd_transclusion_cache * mmd_transclusion_cache_new(void);
+
+
+/// Free transclusion cache
+void mmd_transclusion_cache_free(mmd_transclusion_cache * c);
+
+
+/// Use `c` for transclusion on this thread (NULL to read files every time).
+/// One cache can be used by several threads at once.  Returns the previous
+/// cache so that it can be restored.
+mmd_transclusion_cache * mmd_transclusion_cache_set_active(mmd_transclusion_cache * c);
+
+
 /// If MMD Header metadata used, insert it into appropriate place
 void mmd_prepend_mmd_header(DString * source);
 
@@ -65,25 +65,56 @@
 /// Should call init() once per thread/use, and drain() once per thread/use.
 /// This allows us to know when the pool is no longer being used and it is safe
 /// to free.
+///
+/// The default pool is private to each thread, and is freed when the thread
+/// exits if free() was never called (with pthreads -- otherwise the caller
+/// must call free() on each thread that used it).  Each mmd_engine also owns
+/// its own pool, which is made active while the engine is parsing/exporting,
+/// so that engines can be used on separate threads without any locking.
 
 #ifdef kUseObjectPool
+	struct pool;
+
 	void token_pool_init(void);			//!< Initialize object pool for allocating tokens
 	void token_pool_drain(void);		//!< Drain pool to free memory when parse complete
 	void token_pool_free(void);			//!< Free the token object pool
+
+	struct pool * token_pool_new(void);	//!< Create a separate pool for allocating tokens
+	struct pool * token_pool_set_active(struct pool * p);	//!< Allocate tokens on this thread from `p` (NULL for default); returns previous
+	void token_pool_adopt(struct pool * donor);	//!< Move tokens in `donor` to the pool in use on this thread, and free `donor`
 #endif
 
 
 /// Definition for token node struct.  This can be used to match an
 /// abstract syntax tree with the appropriate spans in the original
 /// source string.
+///
+/// With USE_COMPACT_TOKENS (`cmake -DCOMPACT_TOKENS=1`) offsets are stored in
+/// 32 bits and the flags are packed, so each token takes 56 bytes instead of
+/// 64.  Source text is then limited to 4 GB (kMaxTokenOffset).
+#ifdef USE_COMPACT_TOKENS
+	#include <stdint.h>
+
+	typedef uint32_t	token_offset;
+	#define kMaxTokenOffset UINT32_MAX
+#else
+	typedef size_t		token_offset;
+#endif
+
 struct token {
 	unsigned short		type;			//!< Type for the token
+#ifdef USE_COMPACT_TOKENS
+	unsigned short		can_open : 1;	//!< Can token open a matched pair?
+	unsigned short		can_close : 1;	//!< Can token close a matched pair?
+	unsigned short		unmatched : 1;	//!< Has token been matched yet?
+#else
 	short				can_open;		//!< Can token open a matched pair?
 	short				can_close;		//!< Can token close a matched pair?
 	short				unmatched;		//!< Has token been matched yet?
+#endif
 
-	size_t				start;			//!< Starting offset in the source string
-	size_t				len;			//!< Length of the token in the source string
+	token_offset		start;			//!< Starting offset in the source string
+	token_offset		len;			//!< Length of the token in the source string
 
 	struct token *		next;			//!< Pointer to next token in the chain
 	struct token *		prev;			//!< Pointer to previous marker in the chain
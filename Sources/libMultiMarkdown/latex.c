@@ -137,9 +137,21 @@ void mmd_print_string_latex(DString * out, const char * str) {
 		return;
 	}
 
+	size_t run;
+
 	while (*str != '\0') {
-		mmd_print_char_latex(out, *str);
-		str++;
+		// Copy the run of characters that don't need escaping in one step
+		run = strcspn(str, "\\~/^<>|#{}$%&_");
+
+		if (run) {
+			d_string_append_c_array(out, str, run);
+			str += run;
+		}
+
+		if (*str != '\0') {
+			mmd_print_char_latex(out, *str);
+			str++;
+		}
 	}
 }
 
@@ -419,7 +431,9 @@ void mmd_export_image_latex(DString * out, const char * source, token * text, li
 		if (link->label) {
 			// \todo: Need to decide on approach to id's
 			char * label = label_from_token(source, link->label);
-			printf("\\label{%s}\n", label);
+			print_const("\\label{");
+			print(label);
+			print_const("}\n");
 			free(label);
 		}
 
@@ -482,9 +496,11 @@ void mmd_export_toc_latex(DString * out, const char * source, scratch_pad * scra
 }
 
 
-void mmd_export_token_latex(DString * out, const char * source, token * t, scratch_pad * scratch) {
+/// Export the start of `t` -- returns true if its children and then
+/// mmd_export_token_close_latex() should follow
+static bool mmd_export_token_open_latex(DString * out, const char * source, token * t, scratch_pad * scratch, mmd_export_saved * saved) {
 	if (t == NULL) {
-		return;
+		return false;
 	}
 
 	short	temp_short;
@@ -529,11 +545,7 @@ void mmd_export_token_latex(DString * out, const char * source, token * t, scrat
 			pad(out, 2, scratch);
 			print_const("\\begin{quote}\n");
 			scratch->padded = 2;
-			mmd_export_token_tree_latex(out, source, t->child, scratch);
-			pad(out, 1, scratch);
-			print_const("\\end{quote}");
-			scratch->padded = 0;
-			break;
+			return true;
 
 		case BLOCK_CODE_FENCED:
 			pad(out, 2, scratch);
@@ -596,17 +608,13 @@ void mmd_export_token_latex(DString * out, const char * source, token * t, scrat
 		case BLOCK_DEFINITION:
 			pad(out, 2, scratch);
 
-			temp_short = scratch->list_is_tight;
+			saved->list_is_tight = scratch->list_is_tight;
 
 			if (!(t->child->next && (t->child->next->type == BLOCK_EMPTY) && t->child->next->next)) {
 				scratch->list_is_tight = true;
 			}
 
-			mmd_export_token_tree_latex(out, source, t->child, scratch);
-			scratch->padded = 0;
-
-			scratch->list_is_tight = temp_short;
-			break;
+			return true;
 
 		case BLOCK_DEFLIST:
 			pad(out, 2, scratch);
@@ -619,16 +627,7 @@ void mmd_export_token_latex(DString * out, const char * source, token * t, scrat
 			}
 
 			scratch->padded = 2;
-
-			mmd_export_token_tree_latex(out, source, t->child, scratch);
-			pad(out, 1, scratch);
-
-			if (!(t->next && (t->next->type == BLOCK_DEFLIST))) {
-				print_const("\\end{description}\n");
-			}
-
-			scratch->padded = 1;
-			break;
+			return true;
 
 		case BLOCK_EMPTY:
 			break;
@@ -718,7 +717,7 @@ void mmd_export_token_latex(DString * out, const char * source, token * t, scrat
 
 		case BLOCK_LIST_BULLETED_LOOSE:
 		case BLOCK_LIST_BULLETED:
-			temp_short = scratch->list_is_tight;
+			saved->list_is_tight = scratch->list_is_tight;
 
 			switch (t->type) {
 				case BLOCK_LIST_BULLETED_LOOSE:
@@ -733,16 +732,11 @@ void mmd_export_token_latex(DString * out, const char * source, token * t, scrat
 			pad(out, 2, scratch);
 			print_const("\\begin{itemize}");
 			scratch->padded = 1;
-			mmd_export_token_tree_latex(out, source, t->child, scratch);
-			pad(out, 2, scratch);
-			print_const("\\end{itemize}");
-			scratch->padded = 0;
-			scratch->list_is_tight = temp_short;
-			break;
+			return true;
 
 		case BLOCK_LIST_ENUMERATED_LOOSE:
 		case BLOCK_LIST_ENUMERATED:
-			temp_short = scratch->list_is_tight;
+			saved->list_is_tight = scratch->list_is_tight;
 
 			switch (t->type) {
 				case BLOCK_LIST_ENUMERATED_LOOSE:
@@ -757,28 +751,19 @@ void mmd_export_token_latex(DString * out, const char * source, token * t, scrat
 			pad(out, 2, scratch);
 			print_const("\\begin{enumerate}");
 			scratch->padded = 1;
-			mmd_export_token_tree_latex(out, source, t->child, scratch);
-			pad(out, 2, scratch);
-			print_const("\\end{enumerate}");
-			scratch->padded = 0;
-			scratch->list_is_tight = temp_short;
-			break;
+			return true;
 
 		case BLOCK_LIST_ITEM:
 			pad(out, 2, scratch);
 			print_const("\\item{} ");
 			scratch->padded = 2;
-			mmd_export_token_tree_latex(out, source, t->child, scratch);
-			scratch->padded = 0;
-			break;
+			return true;
 
 		case BLOCK_LIST_ITEM_TIGHT:
 			pad(out, 2, scratch);
 			print_const("\\item{} ");
 			scratch->padded = 2;
-			mmd_export_token_tree_latex(out, source, t->child, scratch);
-			scratch->padded = 0;
-			break;
+			return true;
 
 		case BLOCK_META:
 			break;
@@ -814,7 +799,9 @@ void mmd_export_token_latex(DString * out, const char * source, token * t, scrat
 				mmd_export_token_tree_latex(out, source, t->next->child->child, scratch);
 				print_const("}\n");
 
-				printf("\\label{%s}\n", temp_char);
+				print_const("\\label{");
+				print(temp_char);
+				print_const("}\n");
 				free(temp_char);
 
 				temp_short = 1;
@@ -882,10 +869,7 @@ void mmd_export_token_latex(DString * out, const char * source, token * t, scrat
 		case BLOCK_TERM:
 			pad(out, 2, scratch);
 			print_const("\\item[");
-			mmd_export_token_tree_latex(out, source, t->child, scratch);
-			print_const("]");
-			scratch->padded = 0;
-			break;
+			return true;
 
 		case BLOCK_TOC:
 			pad(out, 2, scratch);
@@ -1172,7 +1156,7 @@ void mmd_export_token_latex(DString * out, const char * source, token * t, scrat
 					d_string_append_c_array(out, &source[t->start + 4], t->len - 4 - 3);
 				}
 			} else {
-				mmd_export_token_tree_latex(out, source, t->child, scratch);
+				return true;
 			}
 
 			free(temp_char);
@@ -1236,8 +1220,7 @@ void mmd_export_token_latex(DString * out, const char * source, token * t, scrat
 
 		case PAIR_BRACE:
 		case PAIR_BRACES:
-			mmd_export_token_tree_latex(out, source, t->child, scratch);
-			break;
+			return true;
 
 		case PAIR_BRACKET:
 			if ((scratch->extensions & EXT_NOTES) &&
@@ -1283,12 +1266,11 @@ void mmd_export_token_latex(DString * out, const char * source, token * t, scrat
 
 				scratch->skip_token = temp_short;
 
-				return;
+				return false;
 			}
 
 			// No links exist, so treat as normal
-			mmd_export_token_tree_latex(out, source, t->child, scratch);
-			break;
+			return true;
 
 		case PAIR_BRACKET_ABBREVIATION:
 
@@ -1755,8 +1737,7 @@ parse_citation:
 		case PAIR_SUBSCRIPT:
 		case PAIR_SUPERSCRIPT:
 		case PAIR_UL:
-			mmd_export_token_tree_latex(out, source, t->child, scratch);
-			break;
+			return true;
 
 		case PAREN_LEFT:
 			print_const("(");
@@ -1954,29 +1935,79 @@ parse_citation:
 			token_describe(t, source);
 			break;
 	}
+	return false;
 }
 
 
-void mmd_export_token_tree_latex(DString * out, const char * source, token * t, scratch_pad * scratch) {
+/// Export the end of `t`, after its children
+static void mmd_export_token_close_latex(DString * out, const char * source, token * t, scratch_pad * scratch, mmd_export_saved saved) {
+	switch (t->type) {
+		case BLOCK_BLOCKQUOTE:
+			pad(out, 1, scratch);
+			print_const("\\end{quote}");
+			scratch->padded = 0;
+			break;
 
-	// Prevent stack overflow with "dangerous" input causing extreme recursion
-	if (scratch->recurse_depth == kMaxExportRecursiveDepth) {
-		return;
+		case BLOCK_DEFINITION:
+			scratch->padded = 0;
+
+			scratch->list_is_tight = saved.list_is_tight;
+			break;
+
+		case BLOCK_DEFLIST:
+			pad(out, 1, scratch);
+
+			if (!(t->next && (t->next->type == BLOCK_DEFLIST))) {
+				print_const("\\end{description}\n");
+			}
+
+			scratch->padded = 1;
+			break;
+
+		case BLOCK_LIST_BULLETED_LOOSE:
+		case BLOCK_LIST_BULLETED:
+			pad(out, 2, scratch);
+			print_const("\\end{itemize}");
+			scratch->padded = 0;
+			scratch->list_is_tight = saved.list_is_tight;
+			break;
+
+		case BLOCK_LIST_ENUMERATED_LOOSE:
+		case BLOCK_LIST_ENUMERATED:
+			pad(out, 2, scratch);
+			print_const("\\end{enumerate}");
+			scratch->padded = 0;
+			scratch->list_is_tight = saved.list_is_tight;
+			break;
+
+		case BLOCK_LIST_ITEM:
+		case BLOCK_LIST_ITEM_TIGHT:
+			scratch->padded = 0;
+			break;
+
+		case BLOCK_TERM:
+			print_const("]");
+			scratch->padded = 0;
+			break;
+
+		default:
+			break;
 	}
+}
 
-	scratch->recurse_depth++;
 
-	while (t != NULL) {
-		if (scratch->skip_token) {
-			scratch->skip_token--;
-		} else {
-			mmd_export_token_latex(out, source, t, scratch);
-		}
+void mmd_export_token_latex(DString * out, const char * source, token * t, scratch_pad * scratch) {
+	mmd_export_saved saved;
 
-		t = t->next;
+	if (mmd_export_token_open_latex(out, source, t, scratch, &saved)) {
+		mmd_export_token_tree_latex(out, source, t->child, scratch);
+		mmd_export_token_close_latex(out, source, t, scratch, saved);
 	}
+}
+
 
-	scratch->recurse_depth--;
+void mmd_export_token_tree_latex(DString * out, const char * source, token * t, scratch_pad * scratch) {
+	mmd_export_token_tree(out, source, t, scratch, mmd_export_token_open_latex, mmd_export_token_close_latex);
 }
 
 
@@ -54,6 +54,10 @@
 
 */
 
+#ifdef __SSE2__
+	#include <emmintrin.h>
+#endif
+
 #include "lexer.h"
 #include "libMultiMarkdown.h"
 #include "parser.h"
@@ -66,6 +70,131 @@
 #define YYMARKER	s->ptr
 #define YYCTXMARKER	s->ctx
 
+
+/// ASCII characters that can begin one of the tokens in `scan()`.  Other
+/// ASCII characters are only matched by the final "skip" rule, one byte at
+/// a time.  Spaces and periods only begin a token when followed by certain
+/// characters, so they are checked separately.  Non-ASCII characters are
+/// always left to the lexer, which skips UTF-8 sequences as a whole.
+enum token_start_class {
+	kStartNever = 0,
+	kStartAlways,
+	kStartSpace,
+	kStartPeriod,
+};
+
+static const unsigned char token_start[128] = {
+	['\t'] = kStartAlways,	['\n'] = kStartAlways,	['\r'] = kStartAlways,
+	['!'] = kStartAlways,	['"'] = kStartAlways,	['#'] = kStartAlways,
+	['$'] = kStartAlways,	['%'] = kStartAlways,	['&'] = kStartAlways,
+	['\''] = kStartAlways,	['('] = kStartAlways,	[')'] = kStartAlways,
+	['*'] = kStartAlways,	['+'] = kStartAlways,	['-'] = kStartAlways,
+	['/'] = kStartAlways,	[':'] = kStartAlways,	['<'] = kStartAlways,
+	['='] = kStartAlways,	['>'] = kStartAlways,	['['] = kStartAlways,
+	['\\'] = kStartAlways,	[']'] = kStartAlways,	['^'] = kStartAlways,
+	['_'] = kStartAlways,	['`'] = kStartAlways,	['{'] = kStartAlways,
+	['|'] = kStartAlways,	['}'] = kStartAlways,	['~'] = kStartAlways,
+	['0'] = kStartAlways,	['1'] = kStartAlways,	['2'] = kStartAlways,
+	['3'] = kStartAlways,	['4'] = kStartAlways,	['5'] = kStartAlways,
+	['6'] = kStartAlways,	['7'] = kStartAlways,	['8'] = kStartAlways,
+	['9'] = kStartAlways,
+	[' '] = kStartSpace,
+	['.'] = kStartPeriod,
+};
+
+
+/// Advance the scanner past bytes that cannot begin a token, so that the
+/// lexer only runs at candidate positions.  Skipped spaces and periods leave
+/// the same markers behind that the lexer's own "skip" rule would, and like
+/// the lexer this may look one byte past `stop`.
+static inline void skip_plain_text(Scanner * s, const char * stop) {
+	const unsigned char * c = (const unsigned char *) s->cur;
+	const unsigned char * end = (const unsigned char *) stop;
+	const char * ptr = s->ptr;
+	const char * ctx = s->ctx;
+
+	while (c < end) {
+		#ifdef __SSE2__
+		// Skip 16 bytes at a time while they are letters, or single spaces
+		while (c + 16 <= end) {
+			__m128i v = _mm_loadu_si128((const __m128i *) c);
+			__m128i next = _mm_loadu_si128((const __m128i *) (c + 1));
+
+			__m128i alpha = _mm_sub_epi8(_mm_or_si128(v, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+			alpha = _mm_cmpeq_epi8(_mm_min_epu8(alpha, _mm_set1_epi8(25)), alpha);
+
+			__m128i space = _mm_cmpeq_epi8(v, _mm_set1_epi8(' '));
+			__m128i followed = _mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi8(next, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(next, _mm_set1_epi8('\t'))),
+				_mm_or_si128(_mm_cmpeq_epi8(next, _mm_set1_epi8('\r')), _mm_cmpeq_epi8(next, _mm_set1_epi8('\n'))));
+			followed = _mm_or_si128(followed, _mm_cmpeq_epi8(next, _mm_set1_epi8((char) 0xC2)));
+
+			int spaces = _mm_movemask_epi8(_mm_andnot_si128(followed, space));
+			int plain = _mm_movemask_epi8(alpha) | spaces;
+			int count = (plain == 0xFFFF) ? 16 : __builtin_ctz(~plain);
+
+			spaces &= (1 << count) - 1;
+
+			if (spaces) {
+				// Leave the markers from the last skipped space
+				ctx = (const char *) c + (31 - __builtin_clz(spaces)) + 1;
+				ptr = ctx;
+			}
+
+			c += count;
+
+			if (count < 16) {
+				break;
+			}
+		}
+		#endif
+
+		while (c < end && !(*c & 0x80) && (token_start[*c] == kStartNever)) {
+			c++;
+		}
+
+		if ((c >= end) || (*c & 0x80)) {
+			break;
+		}
+
+		switch (token_start[*c]) {
+			case kStartSpace:
+				switch (c[1]) {
+					case ' ':
+					case '\t':
+					case '\r':
+					case '\n':
+					case 0xC2:
+						// Possible non-breaking space
+						goto done;
+				}
+
+				ctx = (const char *) c + 1;
+				ptr = ctx;
+				break;
+
+			case kStartPeriod:
+				if (c[1] == '.' || c[1] == ' ') {
+					goto done;
+				}
+
+				ptr = (const char *) c + 1;
+				break;
+
+			default:
+				goto done;
+		}
+
+		c++;
+	}
+
+done:
+	s->cur = (const char *) c;
+	s->ptr = ptr;
+	s->ctx = ctx;
+}
+
+
 int scan(Scanner * s, const char * stop) {
 
 	scan:
@@ -318,7 +447,7 @@ yy6:
 	default:	goto yy7;
 	}
 yy7:
-	{ goto scan; }
+	{ skip_plain_text(s, stop); goto scan; }
 yy8:
 	yych = *++YYCURSOR;
 	switch (yych) {
@@ -52,10 +52,20 @@
 
 */
 
+#include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef USE_PTHREADS
+	#include <pthread.h>
+#endif
+
+#if defined(_MSC_VER)
+	#include <intrin.h>
+#endif
+
 #include "char.h"
 #include "d_string.h"
 #include "epub.h"
@@ -68,12 +78,17 @@
 #include "parser.h"
 #include "scanners.h"
 #include "stack.h"
+#include "stats.h"
 #include "textbundle.h"
 #include "token.h"
 #include "token_pairs.h"
 #include "writer.h"
 #include "version.h"
 
+#ifdef TEST
+	#include "CuTest.h"
+#endif
+
 
 // Basic parser function declarations
 void * ParseAlloc();
@@ -81,7 +96,6 @@ void Parse();
 void ParseFree();
 void ParseTrace();
 
-void mmd_pair_tokens_in_block(token * block, token_pair_engine * e, stack * s);
 
 
 /// strdup() not available on all platforms
@@ -100,18 +114,210 @@ static char * my_strdup(const char * source) {
 }
 
 
-/// Build MMD Engine
+/// Token pairing configuration only depends on these extensions
+#define kPairingExtensions (EXT_CRITIC | EXT_NOTES | EXT_COMPATIBILITY)
+
+
+/// Pairing engines for a given set of extensions.  Once built, these are never
+/// modified and are shared by every mmd_engine using the same extensions.
+struct pairing_set {
+	token_pair_engine *		pairings1;
+	token_pair_engine *		pairings2;
+	token_pair_engine *		pairings3;
+	token_pair_engine *		pairings4;
+};
+
+typedef struct pairing_set pairing_set;
+
+
+/// One cached pairing set for each combination of kPairingExtensions
+static pairing_set * pairing_cache[8] = { NULL };
+
+
+/// Which pairing_cache slot should be used for these extensions?
+static int pairing_cache_index(unsigned long extensions) {
+	return ((extensions & EXT_CRITIC) ? 1 : 0) |
+		   ((extensions & EXT_NOTES) ? 2 : 0) |
+		   ((extensions & EXT_COMPATIBILITY) ? 4 : 0);
+}
+
+
+static void pairing_set_free(pairing_set * p);
+
+
+/// Build the pairing engines for the specified extensions
+static pairing_set * pairing_set_new(unsigned long extensions) {
+	pairing_set * p = malloc(sizeof(pairing_set));
+
+	if (p == NULL) {
+		return NULL;
+	}
+
+	p->pairings1 = token_pair_engine_new();
+	p->pairings2 = token_pair_engine_new();
+	p->pairings3 = token_pair_engine_new();
+	p->pairings4 = token_pair_engine_new();
+
+	if (!p->pairings1 || !p->pairings2 || !p->pairings3 || !p->pairings4) {
+		pairing_set_free(p);
+		return NULL;
+	}
+
+	// CriticMarkup
+	if (extensions & EXT_CRITIC) {
+		token_pair_engine_add_pairing(p->pairings1, CRITIC_ADD_OPEN, CRITIC_ADD_CLOSE, PAIR_CRITIC_ADD, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
+		token_pair_engine_add_pairing(p->pairings1, CRITIC_DEL_OPEN, CRITIC_DEL_CLOSE, PAIR_CRITIC_DEL, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
+		token_pair_engine_add_pairing(p->pairings1, CRITIC_COM_OPEN, CRITIC_COM_CLOSE, PAIR_CRITIC_COM, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
+		token_pair_engine_add_pairing(p->pairings1, CRITIC_SUB_OPEN, CRITIC_SUB_DIV_A, PAIR_CRITIC_SUB_DEL, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
+		token_pair_engine_add_pairing(p->pairings1, CRITIC_SUB_DIV_B, CRITIC_SUB_CLOSE, PAIR_CRITIC_SUB_ADD, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
+		token_pair_engine_add_pairing(p->pairings1, CRITIC_HI_OPEN, CRITIC_HI_CLOSE, PAIR_CRITIC_HI, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
+	}
+
+	// HTML Comments
+	token_pair_engine_add_pairing(p->pairings2, HTML_COMMENT_START, HTML_COMMENT_STOP, PAIR_HTML_COMMENT, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
+
+	// Brackets, Parentheses, Angles
+	token_pair_engine_add_pairing(p->pairings3, BRACKET_LEFT, BRACKET_RIGHT, PAIR_BRACKET, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
+
+	if (extensions & EXT_NOTES) {
+		token_pair_engine_add_pairing(p->pairings3, BRACKET_CITATION_LEFT, BRACKET_RIGHT, PAIR_BRACKET_CITATION, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
+		token_pair_engine_add_pairing(p->pairings3, BRACKET_FOOTNOTE_LEFT, BRACKET_RIGHT, PAIR_BRACKET_FOOTNOTE, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
+		token_pair_engine_add_pairing(p->pairings3, BRACKET_GLOSSARY_LEFT, BRACKET_RIGHT, PAIR_BRACKET_GLOSSARY, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
+		token_pair_engine_add_pairing(p->pairings3, BRACKET_ABBREVIATION_LEFT, BRACKET_RIGHT, PAIR_BRACKET_ABBREVIATION, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
+	} else {
+		token_pair_engine_add_pairing(p->pairings3, BRACKET_CITATION_LEFT, BRACKET_RIGHT, PAIR_BRACKET, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
+		token_pair_engine_add_pairing(p->pairings3, BRACKET_FOOTNOTE_LEFT, BRACKET_RIGHT, PAIR_BRACKET, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
+		token_pair_engine_add_pairing(p->pairings3, BRACKET_GLOSSARY_LEFT, BRACKET_RIGHT, PAIR_BRACKET, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
+		token_pair_engine_add_pairing(p->pairings3, BRACKET_ABBREVIATION_LEFT, BRACKET_RIGHT, PAIR_BRACKET, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
+	}
+
+	token_pair_engine_add_pairing(p->pairings3, BRACKET_VARIABLE_LEFT, BRACKET_RIGHT, PAIR_BRACKET_VARIABLE, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
+
+	token_pair_engine_add_pairing(p->pairings3, BRACKET_IMAGE_LEFT, BRACKET_RIGHT, PAIR_BRACKET_IMAGE, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
+	token_pair_engine_add_pairing(p->pairings3, PAREN_LEFT, PAREN_RIGHT, PAIR_PAREN, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
+	token_pair_engine_add_pairing(p->pairings3, ANGLE_LEFT, ANGLE_RIGHT, PAIR_ANGLE, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
+	token_pair_engine_add_pairing(p->pairings3, BRACE_DOUBLE_LEFT, BRACE_DOUBLE_RIGHT, PAIR_BRACES, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
+
+	// Strong/Emph
+	token_pair_engine_add_pairing(p->pairings4, STAR, STAR, PAIR_STAR, 0);
+	token_pair_engine_add_pairing(p->pairings4, UL, UL, PAIR_UL, 0);
+
+	// Quotes and Backticks
+	token_pair_engine_add_pairing(p->pairings3, BACKTICK, BACKTICK, PAIR_BACKTICK, PAIRING_PRUNE_MATCH | PAIRING_MATCH_LENGTH);
+
+	token_pair_engine_add_pairing(p->pairings4, BACKTICK,   QUOTE_RIGHT_ALT,   PAIR_QUOTE_ALT, PAIRING_ALLOW_EMPTY | PAIRING_MATCH_LENGTH);
+	token_pair_engine_add_pairing(p->pairings4, QUOTE_SINGLE, QUOTE_SINGLE, PAIR_QUOTE_SINGLE, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
+	token_pair_engine_add_pairing(p->pairings4, QUOTE_DOUBLE, QUOTE_DOUBLE, PAIR_QUOTE_DOUBLE, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
+
+	// Math
+	if (!(extensions & EXT_COMPATIBILITY)) {
+		token_pair_engine_add_pairing(p->pairings3, MATH_PAREN_OPEN, MATH_PAREN_CLOSE, PAIR_MATH, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
+		token_pair_engine_add_pairing(p->pairings3, MATH_BRACKET_OPEN, MATH_BRACKET_CLOSE, PAIR_MATH, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
+		token_pair_engine_add_pairing(p->pairings3, MATH_DOLLAR_SINGLE, MATH_DOLLAR_SINGLE, PAIR_MATH, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
+		token_pair_engine_add_pairing(p->pairings3, MATH_DOLLAR_DOUBLE, MATH_DOLLAR_DOUBLE, PAIR_MATH, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
+	}
+
+	// Superscript/Subscript
+	if (!(extensions & EXT_COMPATIBILITY)) {
+		token_pair_engine_add_pairing(p->pairings4, SUPERSCRIPT, SUPERSCRIPT, PAIR_SUPERSCRIPT, PAIRING_PRUNE_MATCH);
+		token_pair_engine_add_pairing(p->pairings4, SUBSCRIPT, SUBSCRIPT, PAIR_SUBSCRIPT, PAIRING_PRUNE_MATCH);
+	}
+
+	// Text Braces -- for raw text syntax
+	if (!(extensions & EXT_COMPATIBILITY)) {
+		token_pair_engine_add_pairing(p->pairings4, TEXT_BRACE_LEFT, TEXT_BRACE_RIGHT, PAIR_BRACE, PAIRING_PRUNE_MATCH);
+		token_pair_engine_add_pairing(p->pairings4, RAW_FILTER_LEFT, TEXT_BRACE_RIGHT, PAIR_RAW_FILTER, PAIRING_PRUNE_MATCH);
+	}
+
+	return p;
+}
+
+
+static void pairing_set_free(pairing_set * p) {
+	if (p) {
+		token_pair_engine_free(p->pairings1);
+		token_pair_engine_free(p->pairings2);
+		token_pair_engine_free(p->pairings3);
+		token_pair_engine_free(p->pairings4);
+
+		free(p);
+	}
+}
+
+
+/// Read a pairing_cache slot.  A set seen by this thread is complete (the
+/// load is ordered after the stores that built it).
+static pairing_set * pairing_cache_load(pairing_set ** slot) {
+	#if defined(_MSC_VER)
+	return _InterlockedCompareExchangePointer((void * volatile *) slot, NULL, NULL);
+	#else
+	return __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+	#endif
+}
+
+
+/// Store `p` in an empty pairing_cache slot.  Returns false if another thread
+/// filled it first.
+static bool pairing_cache_publish(pairing_set ** slot, pairing_set * p) {
+	#if defined(_MSC_VER)
+	return _InterlockedCompareExchangePointer((void * volatile *) slot, p, NULL) == NULL;
+	#else
+	pairing_set * expected = NULL;
+
+	return __atomic_compare_exchange_n(slot, &expected, p, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+	#endif
+}
+
+
+/// Get the shared pairing engines for the specified extensions, building them
+/// the first time they are needed.  Safe to call from multiple threads -- if
+/// two threads race to build the same set, only one copy is kept.  Returns
+/// NULL if out of memory.
+static pairing_set * pairing_set_for_extensions(unsigned long extensions) {
+	int index = pairing_cache_index(extensions);
+	pairing_set * p = pairing_cache_load(&pairing_cache[index]);
+
+	if (p == NULL) {
+		p = pairing_set_new(extensions & kPairingExtensions);
+
+		if (p == NULL) {
+			return NULL;
+		}
+
+		if (!pairing_cache_publish(&pairing_cache[index], p)) {
+			// Another thread beat us to it
+			pairing_set_free(p);
+			p = pairing_cache_load(&pairing_cache[index]);
+		}
+	}
+
+	return p;
+}
+
+
+/// Build MMD Engine (NULL if out of memory)
 mmd_engine * mmd_engine_create(DString * d, unsigned long extensions) {
+	pairing_set * p = pairing_set_for_extensions(extensions);
+
+	if (p == NULL) {
+		return NULL;
+	}
+
 	mmd_engine * e = malloc(sizeof(mmd_engine));
 
 	if (e) {
 		e->dstr = d;
+		e->dstr_private = false;
 
 		e->root = NULL;
+		e->too_long = false;
 
 		e->extensions = extensions;
 
-		e->recurse_depth = 0;
+		e->parse_jobs = NULL;
+		e->parse_job_count = 0;
+		e->parse_job_size = 0;
+		e->parse_job_mark = 0;
 
 		e->allow_meta = (extensions & EXT_COMPATIBILITY) ? false : true;
 
@@ -119,6 +325,11 @@ mmd_engine * mmd_engine_create(DString * d, unsigned long extensions) {
 			e->allow_meta = (extensions & EXT_NO_METADATA) ? false : true;
 		}
 
+		e->exported = false;
+		e->edited = false;
+
+		e->threads = 1;
+
 		e->language = LC_EN;
 		e->quotes_lang = ENGLISH;
 
@@ -133,76 +344,24 @@ mmd_engine * mmd_engine_create(DString * d, unsigned long extensions) {
 		e->table_stack = stack_new(0);
 		e->asset_hash = NULL;
 
-		e->pairings1 = token_pair_engine_new();
-		e->pairings2 = token_pair_engine_new();
-		e->pairings3 = token_pair_engine_new();
-		e->pairings4 = token_pair_engine_new();
-
-		// CriticMarkup
-		if (extensions & EXT_CRITIC) {
-			token_pair_engine_add_pairing(e->pairings1, CRITIC_ADD_OPEN, CRITIC_ADD_CLOSE, PAIR_CRITIC_ADD, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
-			token_pair_engine_add_pairing(e->pairings1, CRITIC_DEL_OPEN, CRITIC_DEL_CLOSE, PAIR_CRITIC_DEL, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
-			token_pair_engine_add_pairing(e->pairings1, CRITIC_COM_OPEN, CRITIC_COM_CLOSE, PAIR_CRITIC_COM, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
-			token_pair_engine_add_pairing(e->pairings1, CRITIC_SUB_OPEN, CRITIC_SUB_DIV_A, PAIR_CRITIC_SUB_DEL, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
-			token_pair_engine_add_pairing(e->pairings1, CRITIC_SUB_DIV_B, CRITIC_SUB_CLOSE, PAIR_CRITIC_SUB_ADD, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
-			token_pair_engine_add_pairing(e->pairings1, CRITIC_HI_OPEN, CRITIC_HI_CLOSE, PAIR_CRITIC_HI, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
-		}
-
-		// HTML Comments
-		token_pair_engine_add_pairing(e->pairings2, HTML_COMMENT_START, HTML_COMMENT_STOP, PAIR_HTML_COMMENT, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
-
-		// Brackets, Parentheses, Angles
-		token_pair_engine_add_pairing(e->pairings3, BRACKET_LEFT, BRACKET_RIGHT, PAIR_BRACKET, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
-
-		if (extensions & EXT_NOTES) {
-			token_pair_engine_add_pairing(e->pairings3, BRACKET_CITATION_LEFT, BRACKET_RIGHT, PAIR_BRACKET_CITATION, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
-			token_pair_engine_add_pairing(e->pairings3, BRACKET_FOOTNOTE_LEFT, BRACKET_RIGHT, PAIR_BRACKET_FOOTNOTE, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
-			token_pair_engine_add_pairing(e->pairings3, BRACKET_GLOSSARY_LEFT, BRACKET_RIGHT, PAIR_BRACKET_GLOSSARY, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
-			token_pair_engine_add_pairing(e->pairings3, BRACKET_ABBREVIATION_LEFT, BRACKET_RIGHT, PAIR_BRACKET_ABBREVIATION, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
-		} else {
-			token_pair_engine_add_pairing(e->pairings3, BRACKET_CITATION_LEFT, BRACKET_RIGHT, PAIR_BRACKET, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
-			token_pair_engine_add_pairing(e->pairings3, BRACKET_FOOTNOTE_LEFT, BRACKET_RIGHT, PAIR_BRACKET, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
-			token_pair_engine_add_pairing(e->pairings3, BRACKET_GLOSSARY_LEFT, BRACKET_RIGHT, PAIR_BRACKET, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
-			token_pair_engine_add_pairing(e->pairings3, BRACKET_ABBREVIATION_LEFT, BRACKET_RIGHT, PAIR_BRACKET, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
-		}
-
-		token_pair_engine_add_pairing(e->pairings3, BRACKET_VARIABLE_LEFT, BRACKET_RIGHT, PAIR_BRACKET_VARIABLE, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
-
-		token_pair_engine_add_pairing(e->pairings3, BRACKET_IMAGE_LEFT, BRACKET_RIGHT, PAIR_BRACKET_IMAGE, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
-		token_pair_engine_add_pairing(e->pairings3, PAREN_LEFT, PAREN_RIGHT, PAIR_PAREN, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
-		token_pair_engine_add_pairing(e->pairings3, ANGLE_LEFT, ANGLE_RIGHT, PAIR_ANGLE, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
-		token_pair_engine_add_pairing(e->pairings3, BRACE_DOUBLE_LEFT, BRACE_DOUBLE_RIGHT, PAIR_BRACES, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
-
-		// Strong/Emph
-		token_pair_engine_add_pairing(e->pairings4, STAR, STAR, PAIR_STAR, 0);
-		token_pair_engine_add_pairing(e->pairings4, UL, UL, PAIR_UL, 0);
-
-		// Quotes and Backticks
-		token_pair_engine_add_pairing(e->pairings3, BACKTICK, BACKTICK, PAIR_BACKTICK, PAIRING_PRUNE_MATCH | PAIRING_MATCH_LENGTH);
-
-		token_pair_engine_add_pairing(e->pairings4, BACKTICK,   QUOTE_RIGHT_ALT,   PAIR_QUOTE_ALT, PAIRING_ALLOW_EMPTY | PAIRING_MATCH_LENGTH);
-		token_pair_engine_add_pairing(e->pairings4, QUOTE_SINGLE, QUOTE_SINGLE, PAIR_QUOTE_SINGLE, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
-		token_pair_engine_add_pairing(e->pairings4, QUOTE_DOUBLE, QUOTE_DOUBLE, PAIR_QUOTE_DOUBLE, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
-
-		// Math
-		if (!(extensions & EXT_COMPATIBILITY)) {
-			token_pair_engine_add_pairing(e->pairings3, MATH_PAREN_OPEN, MATH_PAREN_CLOSE, PAIR_MATH, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
-			token_pair_engine_add_pairing(e->pairings3, MATH_BRACKET_OPEN, MATH_BRACKET_CLOSE, PAIR_MATH, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
-			token_pair_engine_add_pairing(e->pairings3, MATH_DOLLAR_SINGLE, MATH_DOLLAR_SINGLE, PAIR_MATH, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
-			token_pair_engine_add_pairing(e->pairings3, MATH_DOLLAR_DOUBLE, MATH_DOLLAR_DOUBLE, PAIR_MATH, PAIRING_ALLOW_EMPTY | PAIRING_PRUNE_MATCH);
-		}
+		#ifdef USE_STATS
+		memset(&e->stats, 0, sizeof(mmd_stats));
+		#endif
 
-		// Superscript/Subscript
-		if (!(extensions & EXT_COMPATIBILITY)) {
-			token_pair_engine_add_pairing(e->pairings4, SUPERSCRIPT, SUPERSCRIPT, PAIR_SUPERSCRIPT, PAIRING_PRUNE_MATCH);
-			token_pair_engine_add_pairing(e->pairings4, SUBSCRIPT, SUBSCRIPT, PAIR_SUBSCRIPT, PAIRING_PRUNE_MATCH);
-		}
+		#ifdef kUseObjectPool
+		e->token_pool = token_pool_new();
+		e->parsed_bytes = 0;
+		e->freeze = false;
+		e->frozen = NULL;
+		e->export_tokens = NULL;
+		e->export_capacity = 0;
+		e->export_originals = NULL;
+		#endif
 
-		// Text Braces -- for raw text syntax
-		if (!(extensions & EXT_COMPATIBILITY)) {
-			token_pair_engine_add_pairing(e->pairings4, TEXT_BRACE_LEFT, TEXT_BRACE_RIGHT, PAIR_BRACE, PAIRING_PRUNE_MATCH);
-			token_pair_engine_add_pairing(e->pairings4, RAW_FILTER_LEFT, TEXT_BRACE_RIGHT, PAIR_RAW_FILTER, PAIRING_PRUNE_MATCH);
-		}
+		e->pairings1 = p->pairings1;
+		e->pairings2 = p->pairings2;
+		e->pairings3 = p->pairings3;
+		e->pairings4 = p->pairings4;
 	}
 
 	return e;
@@ -223,6 +382,54 @@ mmd_engine * mmd_engine_create_with_string(const char * str, unsigned long exten
 }
 
 
+/// Make sure the engine's source text can be changed.  A read-only source
+/// (e.g. map_file()) is replaced by a private copy, which is freed with the
+/// engine.  Returns false if out of memory.
+static bool mmd_engine_make_source_writable(mmd_engine * e, bool keep_text) {
+	if (d_string_is_writable(e->dstr)) {
+		return true;
+	}
+
+	DString * copy = d_string_new("");
+
+	if (copy == NULL) {
+		return false;
+	}
+
+	if (keep_text) {
+		d_string_append_c_array(copy, e->dstr->str, e->dstr->currentStringLength);
+	}
+
+	e->dstr = copy;
+	e->dstr_private = true;
+
+	return true;
+}
+
+
+/// Reuse an existing engine for new source text.  The engine's DString is
+/// overwritten with a copy of `str` (reusing its memory, unless it is
+/// read-only), any previous parse is discarded, and the extensions and
+/// language are kept.
+void mmd_engine_reset_with_string(mmd_engine * e, const char * str) {
+	if (!e) {
+		return;
+	}
+
+	mmd_engine_reset(e);
+
+	if (!mmd_engine_make_source_writable(e, false)) {
+		return;
+	}
+
+	d_string_erase(e->dstr, 0, -1);
+
+	if (str) {
+		d_string_append(e->dstr, str);
+	}
+}
+
+
 /// Set language and smart quotes language
 void mmd_engine_set_language(mmd_engine * e, short language) {
 	if (!e) {
@@ -262,12 +469,8 @@ void mmd_engine_set_language(mmd_engine * e, short language) {
 }
 
 
-void mmd_engine_reset(mmd_engine * e) {
-	if (e->root) {
-		token_tree_free(e->root);
-		e->root = NULL;
-	}
-
+/// Free links, notes, etc. gathered by export
+static void mmd_engine_free_export_results(mmd_engine * e) {
 	// Abbreviations need to be freed
 	while (e->abbreviation_stack->size) {
 		footnote_free(stack_pop(e->abbreviation_stack));
@@ -293,22 +496,40 @@ void mmd_engine_reset(mmd_engine * e) {
 		link_free(stack_pop(e->link_stack));
 	}
 
-	// Metadata needs to be freed
-	while (e->metadata_stack->size) {
-		meta_free(stack_pop(e->metadata_stack));
-	}
-
 	// Free asset hash
 	asset * a, * a_tmp;
 	HASH_ITER(hh, e->asset_hash, a, a_tmp) {
 		HASH_DEL(e->asset_hash, a);	// Remove item from hash
 		asset_free(a);				// Free the asset
 	}
+}
+
+
+void mmd_engine_reset(mmd_engine * e) {
+	if (e->root) {
+		token_tree_free(e->root);
+		e->root = NULL;
+	}
+
+	mmd_engine_free_export_results(e);
+
+	// Metadata needs to be freed
+	while (e->metadata_stack->size) {
+		meta_free(stack_pop(e->metadata_stack));
+	}
 
 	// Reset other stacks
 	e->definition_stack->size = 0;
 	e->header_stack->size = 0;
 	e->table_stack->size = 0;
+
+	#ifdef kUseObjectPool
+	// No tokens are in use now, so the next parse can reuse their memory
+	pool_reset(e->token_pool);
+
+	free(e->frozen);
+	e->frozen = NULL;
+	#endif
 }
 
 
@@ -320,14 +541,13 @@ void mmd_engine_free(mmd_engine * e, bool freeDString) {
 
 	mmd_engine_reset(e);
 
-	if (freeDString) {
+	if (freeDString || e->dstr_private) {
 		d_string_free(e->dstr, true);
 	}
 
-	token_pair_engine_free(e->pairings1);
-	token_pair_engine_free(e->pairings2);
-	token_pair_engine_free(e->pairings3);
-	token_pair_engine_free(e->pairings4);
+	// Pairing engines are shared, and are not freed here
+
+	free(e->parse_jobs);
 
 	// Pointers to blocks that are freed elsewhere
 	stack_free(e->definition_stack);
@@ -342,6 +562,17 @@ void mmd_engine_free(mmd_engine * e, bool freeDString) {
 	stack_free(e->link_stack);
 	stack_free(e->metadata_stack);
 
+	#ifdef kUseObjectPool
+	// Release all tokens belonging to this engine
+	pool_free(e->token_pool);
+
+	free(e->export_tokens);
+
+	if (e->export_originals) {
+		stack_free(e->export_originals);
+	}
+	#endif
+
 	free(e);
 }
 
@@ -1110,22 +1341,61 @@ token * mmd_tokenize_string(mmd_engine * e, size_t start, size_t len, bool stop_
 }
 
 
-/// Parse token tree
-void mmd_parse_token_chain(mmd_engine * e, token * chain) {
+/// Work on a block that has to wait until the blocks around it are parsed
+struct parse_job {
+	unsigned short		type;
+	token *				block;
+	token *				marker;			//!< List marker to put back in place
+};
 
-	if (e->recurse_depth == kMaxParseRecursiveDepth) {
-		return;
+enum parse_job_types {
+	PARSE_JOB_CHILDREN,					//!< Parse the lines inside block
+	PARSE_JOB_MARKER,					//!< Put list item marker back in place
+	PARSE_JOB_LIST_LOOSE,				//!< Check whether list is loose
+	PARSE_JOB_STRIP_LINES,				//!< Strip line tokens from block
+};
+
+
+/// Forward declaration
+static void mark_list_loose(token * list);
+
+
+static void parse_job_push(mmd_engine * e, unsigned short type, token * block, token * marker) {
+	if ((type == PARSE_JOB_CHILDREN) && block->child) {
+		// Blocks containing this one are measured before its lines are
+		// parsed, so it has to span all of them already
+		block->len = block->child->tail->start + block->child->tail->len - block->start;
 	}
 
-	e->recurse_depth++;
+	if (e->parse_job_count == e->parse_job_size) {
+		size_t size = (e->parse_job_size) ? e->parse_job_size * 2 : 64;
+		struct parse_job * jobs = realloc(e->parse_jobs, sizeof(struct parse_job) * size);
 
-	void* pParser = ParseAlloc (malloc);		// Create a parser (for lemon)
+		if (jobs == NULL) {
+			return;
+		}
+
+		e->parse_jobs = jobs;
+		e->parse_job_size = size;
+	}
+
+	struct parse_job * job = &e->parse_jobs[e->parse_job_count++];
+
+	job->type = type;
+	job->block = block;
+	job->marker = marker;
+}
+
+
+/// Parse the lines in `chain` into blocks.  Lines inside those blocks (e.g.
+/// blockquotes and list items) are not parsed yet, but added to the end of
+/// e->parse_jobs.
+static void mmd_parse_lines(mmd_engine * e, void * pParser, token * chain) {
 	token * walker = chain->child;				// Walk the existing tree
 	token * remainder;							// Hold unparsed tail of chain
 
-	#ifndef NDEBUG
-	ParseTrace(stderr, "parser >>");
-	#endif
+	size_t first_job = e->parse_job_count;
+	e->parse_job_mark = first_job;
 
 	// Remove existing token tree
 	e->root = NULL;
@@ -1161,141 +1431,315 @@ void mmd_parse_token_chain(mmd_engine * e, token * chain) {
 	token_append_child(chain, e->root);
 	e->root = NULL;
 
-	ParseFree(pParser, free);
-
-	e->recurse_depth--;
+	// Jobs are taken from the end, so reverse them to keep them in order
+	size_t i = first_job;
+	size_t j = e->parse_job_count;
+	struct parse_job temp;
+
+	while (i + 1 < j) {
+		j--;
+		temp = e->parse_jobs[i];
+		e->parse_jobs[i] = e->parse_jobs[j];
+		e->parse_jobs[j] = temp;
+		i++;
+	}
 }
 
 
-void mmd_pair_tokens_in_chain(token * head, token_pair_engine * e, stack * s) {
+typedef struct {
+	token *		block;
+	size_t		order;
+} sort_block;
+
 
-	while (head != NULL) {
-		mmd_pair_tokens_in_block(head, e, s);
+static int sort_block_compare(const void * a, const void * b) {
+	const sort_block * x = a;
+	const sort_block * y = b;
 
-		head = head->next;
+	if (x->block->start != y->block->start) {
+		return (x->block->start < y->block->start) ? -1 : 1;
 	}
+
+	return (x->order < y->order) ? -1 : 1;
 }
 
 
-/// Match token pairs inside block
-void mmd_pair_tokens_in_block(token * block, token_pair_engine * e, stack * s) {
-	if (block == NULL || e == NULL) {
+/// Put blocks on `s` (after index `from`) back in document order
+static void stack_sort_blocks(stack * s, size_t from) {
+	size_t i;
+
+	for (i = from + 1; i < s->size; ++i) {
+		if (((token *) s->element[i])->start < ((token *) s->element[i - 1])->start) {
+			break;
+		}
+	}
+
+	if (i >= s->size) {
+		// Already in order
 		return;
 	}
 
-	switch (block->type) {
-		case BLOCK_BLOCKQUOTE:
-		case BLOCK_DEFLIST:
-		case BLOCK_DEFINITION:
-		case BLOCK_DEF_ABBREVIATION:
-		case BLOCK_DEF_CITATION:
-		case BLOCK_DEF_FOOTNOTE:
-		case BLOCK_DEF_GLOSSARY:
-		case BLOCK_DEF_LINK:
-		case BLOCK_H1:
-		case BLOCK_H2:
-		case BLOCK_H3:
-		case BLOCK_H4:
-		case BLOCK_H5:
-		case BLOCK_H6:
-		case BLOCK_PARA:
-		case BLOCK_SETEXT_1:
-		case BLOCK_SETEXT_2:
-		case BLOCK_TERM:
-			token_pairs_match_pairs_inside_token(block, e, s, 0);
-			break;
+	size_t count = s->size - from;
+	sort_block * blocks = malloc(sizeof(sort_block) * count);
 
-		case DOC_START_TOKEN:
-		case BLOCK_LIST_BULLETED:
-		case BLOCK_LIST_BULLETED_LOOSE:
-		case BLOCK_LIST_ENUMERATED:
-		case BLOCK_LIST_ENUMERATED_LOOSE:
-			mmd_pair_tokens_in_chain(block->child, e, s);
-			break;
+	if (blocks == NULL) {
+		return;
+	}
 
-		case BLOCK_LIST_ITEM:
-		case BLOCK_LIST_ITEM_TIGHT:
-			token_pairs_match_pairs_inside_token(block, e, s, 0);
-			mmd_pair_tokens_in_chain(block->child, e, s);
-			break;
+	for (i = 0; i < count; ++i) {
+		blocks[i].block = s->element[from + i];
+		blocks[i].order = i;
+	}
 
-		case LINE_TABLE:
-		case BLOCK_TABLE:
-			// TODO: Need to parse into cells first
-			token_pairs_match_pairs_inside_token(block, e, s, 0);
-			mmd_pair_tokens_in_chain(block->child, e, s);
-			break;
+	qsort(blocks, count, sizeof(sort_block), sort_block_compare);
 
-		case BLOCK_EMPTY:
-		case BLOCK_CODE_INDENTED:
-		case BLOCK_CODE_FENCED:
-		default:
-			// Nothing to do here
-			return;
+	for (i = 0; i < count; ++i) {
+		s->element[from + i] = blocks[i].block;
 	}
+
+	free(blocks);
 }
 
 
-/// Ambidextrous tokens can open OR close a pair.  This routine gives the opportunity
-/// to change this behavior on case-by-case basis.  For example, in `foo **bar** foo`, the
-/// first set of asterisks can open, but not close a pair.  The second set can close, but not
-/// open a pair.  This allows for complex behavior without having to bog down the tokenizer
-/// with figuring out which type of asterisk we have.  Default behavior is that open and close
-/// are enabled, so we just have to figure out when to turn it off.
-void mmd_assign_ambidextrous_tokens_in_block(mmd_engine * e, token * block, size_t start_offset) {
-	if (block == NULL || block->child == NULL) {
-		return;
-	}
+/// Parse token tree
+///
+/// Blocks nested inside other blocks are parsed one level at a time, in the
+/// same order as calling the parser recursively would, but without nesting
+/// calls to the parser.  This way deeply nested input is parsed completely
+/// without running out of stack.
+void mmd_parse_token_chain(mmd_engine * e, token * chain) {
+	void* pParser = ParseAlloc (malloc);		// Create a parser (for lemon)
 
-	size_t offset;		// Temp variable for use below
-	size_t lead_count, lag_count, pre_count, post_count;
+	#ifndef NDEBUG
+	ParseTrace(stderr, "parser >>");
+	#endif
 
-	token * t = block->child;
+	size_t base = e->parse_job_count;
 
-	char * str = e->dstr->str;
+	stack * stacks[] = { e->definition_stack, e->header_stack, e->table_stack };
+	size_t marks[] = { e->definition_stack->size, e->header_stack->size, e->table_stack->size };
 
-	while (t != NULL) {
-		switch (t->type) {
-			case BLOCK_META:
+	mmd_parse_lines(e, pParser, chain);
 
-				// Do we treat this like metadata?
-				if (!(e->extensions & EXT_COMPATIBILITY) &&
-						!(e->extensions & EXT_NO_METADATA)) {
-					break;
+	struct parse_job job;
+
+	while (e->parse_job_count > base) {
+		job = e->parse_jobs[--e->parse_job_count];
+
+		switch (job.type) {
+			case PARSE_JOB_CHILDREN:
+				if (job.marker) {
+					// After everything inside the item is finished
+					parse_job_push(e, PARSE_JOB_MARKER, job.block, job.marker);
 				}
 
-				// This is not metadata
-				t->type = BLOCK_PARA;
+				// The parser is ready for new input once it has finished
+				mmd_parse_lines(e, pParser, job.block);
+				break;
 
-			case DOC_START_TOKEN:
-			case BLOCK_BLOCKQUOTE:
-			case BLOCK_DEF_ABBREVIATION:
-			case BLOCK_DEFLIST:
-			case BLOCK_DEFINITION:
-			case BLOCK_H1:
-			case BLOCK_H2:
-			case BLOCK_H3:
-			case BLOCK_H4:
-			case BLOCK_H5:
-			case BLOCK_H6:
-			case BLOCK_LIST_BULLETED:
-			case BLOCK_LIST_BULLETED_LOOSE:
-			case BLOCK_LIST_ENUMERATED:
-			case BLOCK_LIST_ENUMERATED_LOOSE:
-			case BLOCK_LIST_ITEM:
-			case BLOCK_LIST_ITEM_TIGHT:
-			case BLOCK_PARA:
-			case BLOCK_SETEXT_1:
-			case BLOCK_SETEXT_2:
-			case BLOCK_TABLE:
-			case BLOCK_TABLE_SECTION:
+			case PARSE_JOB_MARKER:
+				// Insert marker back in place
+				job.marker->next = job.block->child->child;
+
+				if (job.block->child->child) {
+					job.block->child->child->prev = job.marker;
+				}
+
+				job.block->child->child = job.marker;
+				break;
+
+			case PARSE_JOB_LIST_LOOSE:
+				mark_list_loose(job.block);
+				break;
+
+			case PARSE_JOB_STRIP_LINES:
+				strip_line_tokens_from_block(e, job.block);
+				break;
+		}
+	}
+
+	ParseFree(pParser, free);
+
+	// Nested blocks were added to the stacks after the blocks that follow
+	// their parents
+	for (int i = 0; i < sizeof(stacks) / sizeof(stacks[0]); ++i) {
+		stack_sort_blocks(stacks[i], marks[i]);
+	}
+}
+
+
+/// Match token pairs inside block
+void mmd_pair_tokens_in_block(token * block, token_pair_engine * e, stack * s) {
+	if (block == NULL || e == NULL) {
+		return;
+	}
+
+	token * walker = block;
+	token * child;
+	stack * pending = NULL;			// Where to continue after nested blocks
+
+	while (true) {
+		child = NULL;
+
+		switch (walker->type) {
+			case BLOCK_BLOCKQUOTE:
+			case BLOCK_DEFLIST:
+			case BLOCK_DEFINITION:
+			case BLOCK_DEF_ABBREVIATION:
+			case BLOCK_DEF_CITATION:
+			case BLOCK_DEF_FOOTNOTE:
+			case BLOCK_DEF_GLOSSARY:
+			case BLOCK_DEF_LINK:
+			case BLOCK_H1:
+			case BLOCK_H2:
+			case BLOCK_H3:
+			case BLOCK_H4:
+			case BLOCK_H5:
+			case BLOCK_H6:
+			case BLOCK_PARA:
+			case BLOCK_SETEXT_1:
+			case BLOCK_SETEXT_2:
+			case BLOCK_TERM:
+				token_pairs_match_pairs_inside_token(walker, e, s);
+				break;
+
+			case DOC_START_TOKEN:
+			case BLOCK_LIST_BULLETED:
+			case BLOCK_LIST_BULLETED_LOOSE:
+			case BLOCK_LIST_ENUMERATED:
+			case BLOCK_LIST_ENUMERATED_LOOSE:
+				child = walker->child;
+				break;
+
+			case BLOCK_LIST_ITEM:
+			case BLOCK_LIST_ITEM_TIGHT:
+				token_pairs_match_pairs_inside_token(walker, e, s);
+				child = walker->child;
+				break;
+
+			case LINE_TABLE:
+			case BLOCK_TABLE:
+				// TODO: Need to parse into cells first
+				token_pairs_match_pairs_inside_token(walker, e, s);
+				child = walker->child;
+				break;
+
+			case BLOCK_EMPTY:
+			case BLOCK_CODE_INDENTED:
+			case BLOCK_CODE_FENCED:
+			default:
+				// Nothing to do here
+				break;
+		}
+
+		// Blocks that follow this one in its chain (but not those that
+		// follow `block` itself)
+		token * next = (walker == block) ? NULL : walker->next;
+
+		if (child) {
+			if (next) {
+				if (pending == NULL) {
+					pending = stack_new(0);
+				}
+
+				stack_push(pending, next);
+			}
+
+			walker = child;
+		} else if (next) {
+			walker = next;
+		} else if (pending && pending->size) {
+			walker = stack_pop(pending);
+		} else {
+			break;
+		}
+	}
+
+	if (pending) {
+		stack_free(pending);
+	}
+}
+
+
+/// Ambidextrous tokens can open OR close a pair.  This routine gives the opportunity
+/// to change this behavior on case-by-case basis.  For example, in `foo **bar** foo`, the
+/// first set of asterisks can open, but not close a pair.  The second set can close, but not
+/// open a pair.  This allows for complex behavior without having to bog down the tokenizer
+/// with figuring out which type of asterisk we have.  Default behavior is that open and close
+/// are enabled, so we just have to figure out when to turn it off.
+void mmd_assign_ambidextrous_tokens_in_block(mmd_engine * e, token * block, size_t start_offset) {
+	if (block == NULL || block->child == NULL) {
+		return;
+	}
+
+	size_t offset;		// Temp variable for use below
+	size_t lead_count, lag_count, pre_count, post_count;
+
+	token * t = block->child;
+
+	char * str = e->dstr->str;
+
+	// Blocks whose children are being assigned, so we can continue after them
+	stack * parents = stack_new(0);
+
+	while (true) {
+		if (t == NULL) {
+			if (parents->size == 0) {
+				break;
+			}
+
+			// Done with the children of this block
+			t = stack_pop(parents);
+			t = t->next;
+			continue;
+		}
+
+		switch (t->type) {
+			case BLOCK_META:
+
+				// Do we treat this like metadata?
+				if (!(e->extensions & EXT_COMPATIBILITY) &&
+						!(e->extensions & EXT_NO_METADATA)) {
+					break;
+				}
+
+				// This is not metadata
+				t->type = BLOCK_PARA;
+
+			case DOC_START_TOKEN:
+			case BLOCK_BLOCKQUOTE:
+			case BLOCK_DEF_ABBREVIATION:
+			case BLOCK_DEFLIST:
+			case BLOCK_DEFINITION:
+			case BLOCK_H1:
+			case BLOCK_H2:
+			case BLOCK_H3:
+			case BLOCK_H4:
+			case BLOCK_H5:
+			case BLOCK_H6:
+			case BLOCK_LIST_BULLETED:
+			case BLOCK_LIST_BULLETED_LOOSE:
+			case BLOCK_LIST_ENUMERATED:
+			case BLOCK_LIST_ENUMERATED_LOOSE:
+			case BLOCK_LIST_ITEM:
+			case BLOCK_LIST_ITEM_TIGHT:
+			case BLOCK_PARA:
+			case BLOCK_SETEXT_1:
+			case BLOCK_SETEXT_2:
+			case BLOCK_TABLE:
+			case BLOCK_TABLE_SECTION:
 			case TABLE_ROW:
 			case TABLE_CELL:
 			case BLOCK_TERM:
 			case LINE_LIST_BULLETED:
 			case LINE_LIST_ENUMERATED:
 				// Assign child tokens of blocks
-				mmd_assign_ambidextrous_tokens_in_block(e, t, start_offset);
+				if (t->child) {
+					stack_push(parents, t);
+					t = t->child;
+					continue;
+				}
+
 				break;
 
 			case CRITIC_SUB_DIV:
@@ -1648,6 +2092,7 @@ void mmd_assign_ambidextrous_tokens_in_block(mmd_engine * e, token * block, size
 		t = t->next;
 	}
 
+	stack_free(parents);
 }
 
 
@@ -1659,7 +2104,20 @@ void mmd_assign_ambidextrous_tokens_in_block(mmd_engine * e, token * block, size
 void pair_emphasis_tokens(token * t) {
 	token * closer;
 
-	while (t != NULL) {
+	// Tokens whose children are being paired, so we can continue after them
+	stack * parents = stack_new(0);
+
+	while (true) {
+		if (t == NULL) {
+			if (parents->size == 0) {
+				break;
+			}
+
+			t = stack_pop(parents);
+			t = t->next;
+			continue;
+		}
+
 		if (t->mate != NULL) {
 			switch (t->type) {
 				case STAR:
@@ -1705,13 +2163,16 @@ void pair_emphasis_tokens(token * t) {
 					break;
 
 				default:
-					pair_emphasis_tokens(t->child);
-					break;
+					stack_push(parents, t);
+					t = t->child;
+					continue;
 			}
 		}
 
 		t = t->next;
 	}
+
+	stack_free(parents);
 }
 
 
@@ -1724,16 +2185,8 @@ void recursive_parse_list_item(mmd_engine * e, token * block) {
 	// Remove one indent level from all lines to allow recursive parsing
 	deindent_block(e, block);
 
-	mmd_parse_token_chain(e, block);
-
-	// Insert marker back in place
-	marker->next = block->child->child;
-
-	if (block->child->child) {
-		block->child->child->prev = marker;
-	}
-
-	block->child->child = marker;
+	// Marker is put back in place once the item is parsed
+	parse_job_push(e, PARSE_JOB_CHILDREN, block, marker);
 }
 
 
@@ -1752,11 +2205,28 @@ void recursive_parse_indent(mmd_engine * e, token * block) {
 			break;
 	}
 
-	mmd_parse_token_chain(e, block);
+	parse_job_push(e, PARSE_JOB_CHILDREN, block, NULL);
+}
+
+
+/// Strip line tokens from a block once any blocks inside it have been parsed
+void strip_line_tokens_after_children(mmd_engine * e, token * block) {
+	if (e->parse_job_count > e->parse_job_mark) {
+		parse_job_push(e, PARSE_JOB_STRIP_LINES, block, NULL);
+		e->parse_job_mark = e->parse_job_count;
+	} else {
+		strip_line_tokens_from_block(e, block);
+	}
+}
+
+
+/// Check whether list is loose once its items have been parsed
+void is_list_loose(mmd_engine * e, token * list) {
+	parse_job_push(e, PARSE_JOB_LIST_LOOSE, list, NULL);
 }
 
 
-void is_list_loose(token * list) {
+static void mark_list_loose(token * list) {
 	bool loose = false;
 
 	token * walker = list->child;
@@ -1819,7 +2289,7 @@ void recursive_parse_blockquote(mmd_engine * e, token * block) {
 	// Strip blockquote markers (if present)
 	strip_quote_markers_from_block(e, block);
 
-	mmd_parse_token_chain(e, block);
+	parse_job_push(e, PARSE_JOB_CHILDREN, block, NULL);
 }
 
 
@@ -2003,7 +2473,7 @@ void strip_line_tokens_from_block(mmd_engine * e, token * block) {
 	}
 
 	#ifndef NDEBUG
-	fprintf(stderr, "Strip line tokens from %d (%lu:%lu) (child %d)\n", block->type, block->start, block->len, block->child->type);
+	fprintf(stderr, "Strip line tokens from %d (%lu:%lu) (child %d)\n", block->type, (unsigned long) block->start, (unsigned long) block->len, block->child->type);
 	token_tree_describe(block, e->dstr->str);
 	#endif
 
@@ -2177,143 +2647,1161 @@ handle_line:
 }
 
 
-/// Parse part of the string into a token tree
-token * mmd_engine_parse_substring(mmd_engine * e, size_t byte_start, size_t byte_len) {
-	// First, clean up any leftovers from previous parse
-
-	mmd_engine_reset(e);
-
-	// Disable metadata unless we are starting at the beginnging
-	size_t old_ext = e->extensions;
+/// Assign ambidextrous tokens and match pairs inside the blocks of `doc`
+static void mmd_parse_spans(mmd_engine * e, token * doc) {
+	mmd_assign_ambidextrous_tokens_in_block(e, doc, 0);
 
-	if (byte_start != 0) {
-		e->extensions |= EXT_NO_METADATA;
-	}
+	// Prepare stack to be used for token pairing
+	// This avoids allocating/freeing one for each iteration.
+	stack * pair_stack = stack_new(0);
 
 
-	// Tokenize the string
-	token * doc = mmd_tokenize_string(e, byte_start, byte_len, false);
+	mmd_pair_tokens_in_block(doc, e->pairings1, pair_stack);
+	mmd_pair_tokens_in_block(doc, e->pairings2, pair_stack);
+	mmd_pair_tokens_in_block(doc, e->pairings3, pair_stack);
+	mmd_pair_tokens_in_block(doc, e->pairings4, pair_stack);
 
-	// Parse tokens into blocks
-	mmd_parse_token_chain(e, doc);
+	// Free stack
+	stack_free(pair_stack);
 
-	if (doc) {
-		// Parse blocks for pairs
-		mmd_assign_ambidextrous_tokens_in_block(e, doc, 0);
+	pair_emphasis_tokens(doc);
+}
 
-		// Prepare stack to be used for token pairing
-		// This avoids allocating/freeing one for each iteration.
-		stack * pair_stack = stack_new(0);
 
+#ifdef USE_PTHREADS
 
-		mmd_pair_tokens_in_block(doc, e->pairings1, pair_stack);
-		mmd_pair_tokens_in_block(doc, e->pairings2, pair_stack);
-		mmd_pair_tokens_in_block(doc, e->pairings3, pair_stack);
-		mmd_pair_tokens_in_block(doc, e->pairings4, pair_stack);
+#define kMinParseBlocksPerThread 64		//!< Don't give a thread fewer top level blocks than this
 
-		// Free stack
-		stack_free(pair_stack);
 
-		pair_emphasis_tokens(doc);
+/// Span level parsing for a run of top level blocks, done by one thread
+typedef struct {
+	mmd_engine *	e;
+	token			doc;			//!< Stand-in for the document, holding just these blocks
+	token *			last;			//!< Last block in this run
+	token *			after;			//!< Block following this run (NULL at end of document)
 
-		#ifndef NDEBUG
-		token_tree_describe(doc, e->dstr->str);
-		#endif
-	}
+	#ifdef kUseObjectPool
+	struct pool *	pool;			//!< Tokens created by this thread
+	#endif
 
-	// Return original extensions
-	e->extensions = old_ext;
+	#ifdef USE_STATS
+	mmd_stats		stats;			//!< Gathered by this thread
+	#endif
+} span_parse_job;
 
-	return doc;
-}
 
+static void * span_parse_worker(void * arg) {
+	span_parse_job * job = arg;
 
-/// Parse the entire string into a token tree
-void mmd_engine_parse_string(mmd_engine * e) {
-	if (e) {
-		e->root = mmd_engine_parse_substring(e, 0, e->dstr->currentStringLength);
-	}
-}
+	#ifdef kUseObjectPool
+	struct pool * old_pool = token_pool_set_active(job->pool);
+	#endif
 
+	#ifdef USE_STATS
+	stats_scope scope;
+	stats_scope_begin(&scope, &job->stats);
+	#endif
 
-/// Does the text have metadata?
-bool mmd_string_has_metadata(char * source, size_t * end) {
-	bool result;
+	mmd_parse_spans(job->e, &job->doc);
 
-	mmd_engine * e = mmd_engine_create_with_string(source, 0);
-	result = mmd_engine_has_metadata(e, end);
+	#ifdef USE_STATS
+	stats_scope_end(&scope);
+	#endif
 
-	mmd_engine_free(e, true);
+	#ifdef kUseObjectPool
+	token_pool_set_active(old_pool);
+	#endif
 
-	return result;
+	return NULL;
 }
 
 
-/// Does the text have metadata?
-bool mmd_d_string_has_metadata(DString * source, size_t * end) {
-	bool result;
-
-	mmd_engine * e = mmd_engine_create_with_dstring(source, 0);
-	result = mmd_engine_has_metadata(e, end);
-
-	mmd_engine_free(e, false);
-
-	return result;
-}
+/// Span level parsing only looks inside each top level block, so the blocks
+/// can be divided among e->threads threads
+static void mmd_parse_spans_parallel(mmd_engine * e, token * doc) {
+	size_t count = 0;
+	token * walker;
+	token * last = NULL;
 
+	for (walker = doc->child; walker; walker = walker->next) {
+		last = walker;
+		count++;
+	}
 
-/// Does the text have metadata?
-bool mmd_engine_has_metadata(mmd_engine * e, size_t * end) {
-	bool result = false;
-	token * old_root;
+	size_t threads = e->threads;
 
-	if (!e) {
-		return false;
+	if (threads > count / kMinParseBlocksPerThread) {
+		threads = count / kMinParseBlocksPerThread;
 	}
 
-	if (!(scan_meta_line(&e->dstr->str[0]))) {
-		// First line is not metadata, so can't have metadata
-		// Saves the time of an unnecessary parse
-		// TODO:  Need faster confirmation of actual metadata than full tokenizing
-		if (end) {
-			*end = 0;
-		}
+	span_parse_job * jobs = (threads > 1) ? calloc(threads, sizeof(span_parse_job)) : NULL;
+	pthread_t * workers = jobs ? malloc(sizeof(pthread_t) * threads) : NULL;
 
-		return false;
+	if (!workers) {
+		free(jobs);
+		mmd_parse_spans(e, doc);
+		return;
 	}
 
-	// Preserve existing parse tree (if any)
-	old_root = e->root;
+	// Divide blocks into runs of roughly equal length
+	size_t start = doc->child->start;
+	size_t total = last->start + last->len - start;
+	size_t i = 0;
 
-	// Tokenize the string (up until first empty line)
-	token * doc = mmd_tokenize_string(e, 0, e->dstr->currentStringLength, true);
+	walker = doc->child;
 
-	// Parse tokens into blocks
-	mmd_parse_token_chain(e, doc);
+	for (i = 0; i < threads; ++i) {
+		jobs[i].e = e;
+		jobs[i].doc = *doc;
+		jobs[i].doc.child = walker;
+		jobs[i].doc.next = NULL;
 
-	if (doc) {
-		if (doc->child && doc->child->type == BLOCK_META) {
-			result = true;
+		if (i == threads - 1) {
+			jobs[i].last = last;
+		} else {
+			// Stop before the block that crosses the next boundary
+			size_t boundary = start + total / threads * (i + 1);
 
-			if (end) {
-				*end = doc->child->len;
+			while (walker->next && (walker->next->start + walker->next->len <= boundary)) {
+				walker = walker->next;
 			}
+
+			jobs[i].last = walker;
 		}
 
-		token_tree_free(doc);
-	}
+		jobs[i].after = jobs[i].last->next;
+		jobs[i].last->next = NULL;
 
-	// Restore previous parse tree
-	e->root = old_root;
+		#ifdef kUseObjectPool
+		jobs[i].pool = token_pool_new();
+		#endif
 
-	return result;
-}
+		walker = jobs[i].after;
 
+		if (walker == NULL) {
+			// Out of blocks
+			threads = i + 1;
+			break;
+		}
+	}
 
-/// Return metadata keys, one per line
-/// Returned char * must be freed
-char * mmd_string_metadata_keys(char * source) {
-	char * result;
+	// This thread handles the first run, and any that can't be started
+	bool * started = calloc(threads, sizeof(bool));
+
+	for (i = 1; i < threads; ++i) {
+		started[i] = (pthread_create(&workers[i], NULL, span_parse_worker, &jobs[i]) == 0);
+	}
+
+	for (i = 0; i < threads; ++i) {
+		if (!started[i]) {
+			span_parse_worker(&jobs[i]);
+		}
+	}
+
+	for (i = 1; i < threads; ++i) {
+		if (started[i]) {
+			pthread_join(workers[i], NULL);
+		}
+	}
+
+	// Put the document back together
+	for (i = 0; i < threads; ++i) {
+		jobs[i].last->next = jobs[i].after;
+
+		#ifdef kUseObjectPool
+		// Tokens now belong to the engine
+		pool_adopt(e->token_pool, jobs[i].pool);
+		pool_free(jobs[i].pool);
+		#endif
+
+		#ifdef USE_STATS
+		// (Runs on this thread were already counted when their scope ended)
+		if (started[i] && stats_active()) {
+			stats_add(stats_active(), &jobs[i].stats);
+		}
+		#endif
+	}
+
+	free(started);
+	free(workers);
+	free(jobs);
+}
+
+#endif
+
+
+/// Tokenize, parse blocks, and pair tokens for part of the string.  Blocks
+/// are added to the engine's stacks, but the engine is not otherwise reset.
+static token * mmd_parse_range(mmd_engine * e, size_t byte_start, size_t byte_len) {
+	#ifdef USE_COMPACT_TOKENS
+
+	if (byte_start + byte_len > kMaxTokenOffset) {
+		// Offsets would not fit in a token
+		e->too_long = true;
+		return NULL;
+	}
+
+	#endif
+
+	// Disable metadata unless we are starting at the beginnging
+	size_t old_ext = e->extensions;
+
+	if (byte_start != 0) {
+		e->extensions |= EXT_NO_METADATA;
+	}
+
+
+	stats_timer(stage_start);
+
+	// Tokenize the string
+	token * doc = mmd_tokenize_string(e, byte_start, byte_len, false);
+	stats_lap(stage_start, tokenize_time);
+
+	// Parse tokens into blocks
+	mmd_parse_token_chain(e, doc);
+	stats_lap(stage_start, parse_time);
+
+	if (doc) {
+		// Parse blocks for pairs
+		#ifdef USE_PTHREADS
+		mmd_parse_spans_parallel(e, doc);
+		#else
+		mmd_parse_spans(e, doc);
+		#endif
+
+		stats_lap(stage_start, pair_time);
+
+		#ifndef NDEBUG
+		token_tree_describe(doc, e->dstr->str);
+		#endif
+	}
+
+	// Return original extensions
+	e->extensions = old_ext;
+
+	return doc;
+}
+
+
+#define kIncrementalContextBlocks 2		//!< Unchanged blocks to parse again on either side of an edit
+#define kIncrementalSpareBytes (1024 * 1024)	//!< Replaced tokens to allow beyond the size of a full parse
+
+
+#ifdef kUseObjectPool
+
+/// Tokens are marked as copied by replacing `tail` with their index in the
+/// frozen array (tagged with the low bit, which a real pointer never has)
+#define frozen_mark(t, i)	((t)->tail = (token *)(((uintptr_t) (i) << 1) | 1))
+#define frozen_is_marked(t)	((uintptr_t) (t)->tail & 1)
+#define frozen_index(t)		((uintptr_t) (t)->tail >> 1)
+
+
+/// Add `t` and everything below and after it in its chain to the list of
+/// tokens to copy, in preorder
+static void freeze_collect(token * t, stack * order, stack * tails, stack * pending) {
+	while (t) {
+		if (frozen_is_marked(t)) {
+			// Already collected
+			t = stack_pop(pending);
+			continue;
+		}
+
+		stack_push(tails, t->tail);
+		frozen_mark(t, order->size);
+		stack_push(order, t);
+
+		if (t->child) {
+			if (t->next) {
+				stack_push(pending, t->next);
+			}
+
+			t = t->child;
+		} else if (t->next) {
+			t = t->next;
+		} else {
+			t = stack_pop(pending);
+		}
+	}
+}
+
+
+/// Pointer to the copy of `t` in the frozen array
+static inline token * frozen_copy(token * frozen, token * t) {
+	return (t) ? &frozen[frozen_index(t)] : NULL;
+}
+
+
+/// Point entries in `s` at the frozen copies of their tokens
+static void freeze_stack(token * frozen, stack * s) {
+	for (size_t i = 0; i < s->size; ++i) {
+		s->element[i] = frozen_copy(frozen, s->element[i]);
+	}
+}
+
+
+/// Copy `doc` into a single block of memory, in preorder.  Every token that
+/// can be reached from the tree (e.g. through `mate`) is copied, as are the
+/// blocks on the engine's stacks, which are pointed at the copies.  `buffer`
+/// (holding `capacity` tokens) is reused if the copy fits.  `order` receives
+/// the token each copy was made from.  Returns the copies (`doc` is first), or
+/// NULL if out of memory.
+static token * mmd_engine_copy_tree(mmd_engine * e, token * doc, token * buffer, size_t * capacity, stack * order) {
+	stack * tails = stack_new((int) *capacity);
+	stack * pending = stack_new(0);
+
+	order->size = 0;
+
+	// The tree first, then anything it points to, and tokens the engine refers to
+	freeze_collect(doc, order, tails, pending);
+
+	stack * refs[] = { e->definition_stack, e->header_stack, e->table_stack };
+
+	for (int i = 0; i < sizeof(refs) / sizeof(refs[0]); ++i) {
+		for (size_t j = 0; j < refs[i]->size; ++j) {
+			freeze_collect(stack_peek_index(refs[i], j), order, tails, pending);
+		}
+	}
+
+	for (size_t i = 0; i < order->size; ++i) {
+		token * t = order->element[i];
+		token * tail = tails->element[i];
+
+		// Most of these have been collected already
+		if (t->prev && !frozen_is_marked(t->prev)) {
+			freeze_collect(t->prev, order, tails, pending);
+		}
+
+		if (tail && !frozen_is_marked(tail)) {
+			freeze_collect(tail, order, tails, pending);
+		}
+
+		if (t->mate && !frozen_is_marked(t->mate)) {
+			freeze_collect(t->mate, order, tails, pending);
+		}
+	}
+
+	token * frozen = buffer;
+
+	if (order->size > *capacity) {
+		frozen = malloc(order->size * sizeof(token));
+
+		if (frozen) {
+			free(buffer);
+			*capacity = order->size;
+		}
+	}
+
+	if (frozen) {
+		for (size_t i = 0; i < order->size; ++i) {
+			token * t = &frozen[i];
+
+			*t = *(token *) order->element[i];
+
+			t->next = frozen_copy(frozen, t->next);
+			t->prev = frozen_copy(frozen, t->prev);
+			t->child = frozen_copy(frozen, t->child);
+			t->tail = frozen_copy(frozen, tails->element[i]);
+			t->mate = frozen_copy(frozen, t->mate);
+		}
+
+		for (int i = 0; i < sizeof(refs) / sizeof(refs[0]); ++i) {
+			freeze_stack(frozen, refs[i]);
+		}
+	}
+
+	// Leave the original tree as it was
+	for (size_t i = 0; i < order->size; ++i) {
+		((token *) order->element[i])->tail = tails->element[i];
+	}
+
+	stack_free(tails);
+	stack_free(pending);
+
+	return frozen;
+}
+
+
+/// Copy the token tree into a single block of memory, so that walking the
+/// tree during export reads memory in order.  The engine's token pool can
+/// then be emptied.  Returns the new root.
+static token * mmd_engine_freeze_tree(mmd_engine * e, token * doc) {
+	stack * order = stack_new(0);
+	size_t capacity = 0;
+
+	token * frozen = mmd_engine_copy_tree(e, doc, NULL, &capacity, order);
+
+	stack_free(order);
+
+	if (frozen == NULL) {
+		// Leave the tree where it is
+		return doc;
+	}
+
+	// Tokens from an earlier freeze, and everything in the pool, are no longer used
+	free(e->frozen);
+	e->frozen = frozen;
+
+	pool_drain(e->token_pool);
+
+	return frozen;
+}
+
+
+/// Point entries in `s` that are in the copy made for export back at the
+/// tokens they were copied from
+static void export_restore_stack(mmd_engine * e, stack * s) {
+	token * first = e->export_tokens;
+	token * last = first + e->export_originals->size;
+
+	for (size_t i = 0; i < s->size; ++i) {
+		token * t = s->element[i];
+
+		if ((t >= first) && (t < last)) {
+			s->element[i] = stack_peek_index(e->export_originals, t - first);
+		}
+	}
+}
+
+
+/// Export alters the token tree (e.g. definitions are emptied once they have
+/// been processed).  Once the source has been edited, export works on a copy,
+/// so that the tree itself can be updated after the next edit (see
+/// mmd_engine_update_source()).  Engines that are only converted once skip
+/// the copy.
+void mmd_engine_export_begin(mmd_engine * e) {
+	if (e->exported || (e->root == NULL)) {
+		// Nothing left to preserve
+		return;
+	}
+
+	if (!e->edited) {
+		e->exported = true;
+		return;
+	}
+
+	// Links, notes, etc. from the previous export refer to its copy
+	mmd_engine_free_export_results(e);
+
+	if (e->export_originals == NULL) {
+		e->export_originals = stack_new(0);
+	}
+
+	token * copy = mmd_engine_copy_tree(e, e->root, e->export_tokens, &e->export_capacity, e->export_originals);
+
+	if (copy == NULL) {
+		// Export the tree itself
+		e->exported = true;
+		return;
+	}
+
+	e->export_tokens = copy;
+	e->root = copy;
+}
+
+
+/// Point the engine back at the token tree after export.  The copy is kept
+/// until the next export, since links, notes, etc. still refer to it.
+void mmd_engine_export_end(mmd_engine * e) {
+	if ((e->root == NULL) || (e->root != e->export_tokens)) {
+		// Tree was exported in place
+		return;
+	}
+
+	e->root = stack_peek_index(e->export_originals, 0);
+
+	export_restore_stack(e, e->definition_stack);
+	export_restore_stack(e, e->header_stack);
+	export_restore_stack(e, e->table_stack);
+}
+
+#else
+
+void mmd_engine_export_begin(mmd_engine * e) {
+	// Tokens added during export can't be told apart from the tree, so it
+	// can't be copied
+	e->exported = true;
+}
+
+
+void mmd_engine_export_end(mmd_engine * e) {
+}
+
+#endif
+
+
+/// Parse part of the string into a token tree
+token * mmd_engine_parse_substring(mmd_engine * e, size_t byte_start, size_t byte_len) {
+	// First, clean up any leftovers from previous parse
+
+	mmd_engine_reset(e);
+
+	e->exported = false;
+	e->too_long = false;
+
+	#ifdef kUseObjectPool
+	// Allocate tokens from this engine's pool
+	struct pool * old_pool = token_pool_set_active(e->token_pool);
+	#endif
+
+	#ifdef USE_STATS
+	stats_scope scope;
+	stats_scope_begin(&scope, &e->stats);
+	#endif
+
+	token * doc = mmd_parse_range(e, byte_start, byte_len);
+
+	#ifdef USE_STATS
+	stats_scope_end(&scope);
+	#endif
+
+	#ifdef kUseObjectPool
+	token_pool_set_active(old_pool);
+
+	e->parsed_bytes = pool_bytes_in_use(e->token_pool);
+
+	if (e->freeze && doc) {
+		doc = mmd_engine_freeze_tree(e, doc);
+	}
+	#endif
+
+	return doc;
+}
+
+
+/// Set number of threads used to parse (and export to HTML) large documents
+void mmd_engine_set_threads(mmd_engine * e, int threads) {
+	if (e) {
+		e->threads = (threads > 1) ? threads : 1;
+	}
+}
+
+
+/// Did the last parse fail because the source was too long?
+bool mmd_engine_source_too_long(mmd_engine * e) {
+	return e && e->too_long;
+}
+
+
+/// Copy token tree into one block of memory after each parse
+void mmd_engine_set_freeze(mmd_engine * e, bool freeze) {
+	#ifdef kUseObjectPool
+
+	if (e) {
+		e->freeze = freeze;
+	}
+
+	#endif
+}
+
+
+/// Parse the entire string into a token tree
+void mmd_engine_parse_string(mmd_engine * e) {
+	if (e) {
+		e->root = mmd_engine_parse_substring(e, 0, e->dstr->currentStringLength);
+	}
+}
+
+
+/// Shift offsets of token (and its descendants) after the source was edited
+static void token_shift_offsets(token * t, long delta) {
+	token * walker = t;
+	stack * pending = NULL;			// Tokens still to be shifted after those inside
+
+	while (walker) {
+		walker->start += delta;
+
+		// Shift tokens inside this one, then the ones that follow (but not
+		// those that follow `t`)
+		token * next = (walker == t) ? NULL : walker->next;
+
+		if (walker->child) {
+			if (next) {
+				if (pending == NULL) {
+					pending = stack_new(0);
+				}
+
+				stack_push(pending, next);
+			}
+
+			walker = walker->child;
+		} else if (next) {
+			walker = next;
+		} else {
+			walker = (pending && pending->size) ? stack_pop(pending) : NULL;
+		}
+	}
+
+	if (pending) {
+		stack_free(pending);
+	}
+}
+
+
+/// Does the text contain an empty line?  (Metadata ends at the first one.)
+static bool text_has_empty_line(const char * str, size_t len) {
+	bool line_start = true;
+
+	for (size_t i = 0; i < len; ++i) {
+		switch (str[i]) {
+			case '\r':
+				if ((i + 1 < len) && (str[i + 1] == '\n')) {
+					// CR LF
+					break;
+				}
+
+			case '\n':
+				if (line_start) {
+					return true;
+				}
+
+				line_start = true;
+				break;
+
+			case ' ':
+			case '\t':
+				break;
+
+			default:
+				line_start = false;
+				break;
+		}
+	}
+
+	return false;
+}
+
+
+/// Engine stacks keep blocks in document order.  Replace the entries for old
+/// blocks in [start, stop) with the entries pushed since `mark` that precede
+/// `new_stop` (in the edited text).  Returns index of first block after the
+/// edited range.
+static size_t stack_splice_blocks(stack * s, size_t mark, size_t start, size_t stop, size_t new_stop) {
+	size_t count = 0;
+	size_t first = mark;
+	token * t;
+
+	void ** old = malloc(sizeof(void *) * s->size);
+	memcpy(old, s->element, sizeof(void *) * s->size);
+
+	// Keep blocks before the edited range
+	for (size_t i = 0; i < mark; ++i) {
+		t = old[i];
+
+		if (t->start >= start) {
+			first = i;
+			break;
+		}
+
+		count++;
+	}
+
+	// Then newly parsed blocks
+	for (size_t i = mark; i < s->size; ++i) {
+		t = old[i];
+
+		if (t->start < new_stop) {
+			s->element[count++] = t;
+		}
+	}
+
+	size_t result = count;
+
+	// Then blocks after the edited range
+	for (size_t i = first; i < mark; ++i) {
+		t = old[i];
+
+		if (t->start >= stop) {
+			s->element[count++] = t;
+		}
+	}
+
+	s->size = count;
+
+	free(old);
+
+	return result;
+}
+
+
+/// Edit the source text, and update the token tree to match.  Where possible,
+/// only the top level blocks around the edit are parsed again.
+void mmd_engine_update_source(mmd_engine * e, size_t offset, size_t deleted, const char * inserted) {
+	if (e == NULL) {
+		return;
+	}
+
+	size_t old_len = e->dstr->currentStringLength;
+
+	if (offset > old_len) {
+		offset = old_len;
+	}
+
+	if (deleted > old_len - offset) {
+		deleted = old_len - offset;
+	}
+
+	long delta = (inserted ? (long) strlen(inserted) : 0) - (long) deleted;
+
+	if (!mmd_engine_make_source_writable(e, true)) {
+		return;
+	}
+
+	// Further edits are likely, so keep the tree intact when exporting
+	e->edited = true;
+
+	d_string_erase(e->dstr, offset, deleted);
+	d_string_insert(e->dstr, offset, inserted);
+
+	if ((e->root == NULL) || (e->root->child == NULL) || e->exported) {
+		// Nothing we can reuse
+		mmd_engine_parse_string(e);
+		return;
+	}
+
+	#ifdef kUseObjectPool
+
+	if (pool_bytes_in_use(e->token_pool) > 2 * e->parsed_bytes + kIncrementalSpareBytes) {
+		// Tokens replaced by earlier edits can't be freed individually.  Once
+		// they outnumber the live ones, parse everything again so that the
+		// pool can start over.
+		mmd_engine_parse_string(e);
+		return;
+	}
+
+	#endif
+
+	#ifdef USE_COMPACT_TOKENS
+
+	if (e->dstr->currentStringLength > kMaxTokenOffset) {
+		// Too long to parse (see mmd_parse_range())
+		mmd_engine_parse_string(e);
+		return;
+	}
+
+	#endif
+
+	// Find top level blocks touched by the edit
+	stack * blocks = stack_new(0);
+	size_t first = 0;
+	size_t last = 0;
+
+	for (token * walker = e->root->child; walker != NULL; walker = walker->next) {
+		if (walker->start <= offset) {
+			first = blocks->size;
+		}
+
+		if (walker->start <= offset + deleted) {
+			last = blocks->size;
+		}
+
+		stack_push(blocks, walker);
+	}
+
+	// Include neighboring blocks, since they can change based on the edit
+	// (e.g. setext headers, list items, and paragraphs spanning blank lines)
+	size_t a = (first > kIncrementalContextBlocks) ? first - kIncrementalContextBlocks : 0;
+	size_t b = last + kIncrementalContextBlocks;
+
+	if (b >= blocks->size) {
+		b = blocks->size - 1;
+	}
+
+	// A leading space may have been scanned along with the previous newline
+	// (TEXT_NL_SP), so don't start there
+	while ((a > 0) && (e->dstr->str[((token *) stack_peek_index(blocks, a))->start] == ' ')) {
+		a--;
+	}
+
+	if ((a == 0) || !text_has_empty_line(e->dstr->str, ((token *) stack_peek_index(blocks, a))->start)) {
+		// Edits within (or near) metadata, so start over
+		stack_free(blocks);
+		mmd_engine_parse_string(e);
+		return;
+	}
+
+	#ifdef kUseObjectPool
+	struct pool * old_pool = token_pool_set_active(e->token_pool);
+	#endif
+
+	#ifdef USE_STATS
+	stats_scope scope;
+	stats_scope_begin(&scope, &e->stats);
+	#endif
+
+	token * root = e->root;
+	token * doc;
+	token * new_last;
+	token * after;
+	token * t;
+
+	size_t start = ((token *) stack_peek_index(blocks, a))->start;
+	size_t stop;
+
+	size_t definition_mark = e->definition_stack->size;
+	size_t header_mark = e->header_stack->size;
+	size_t table_mark = e->table_stack->size;
+
+	while (true) {
+		stop = (b + 1 < blocks->size) ? ((token *) stack_peek_index(blocks, b + 1))->start : old_len;
+
+		doc = mmd_parse_range(e, start, stop + delta - start);
+
+		if (b + 1 == blocks->size) {
+			// Parsed through the end of the document
+			new_last = (doc->child) ? doc->child->tail : NULL;
+			after = NULL;
+			stop = (size_t) -1;
+			break;
+		}
+
+		// If the last block parsed matches the old one, the blocks that follow
+		// are unchanged.  The old copy is kept, since the new one was parsed
+		// without seeing what follows it.
+		t = stack_peek_index(blocks, b);
+		new_last = (doc->child) ? doc->child->tail : NULL;
+
+		if (new_last && (new_last->type == t->type) &&
+				(new_last->start == t->start + delta) &&
+				(new_last->len == t->len)) {
+			stop = t->start;
+			after = t;
+
+			// Find the block before it (`prev` is not reliable for blocks)
+			token * tail = new_last;
+			new_last = NULL;
+
+			for (token * walker = doc->child; walker != tail; walker = walker->next) {
+				new_last = walker;
+			}
+
+			break;
+		}
+
+		// Try again with a larger range (e.g. unclosed fenced code block)
+		token_tree_free(doc);
+
+		e->definition_stack->size = definition_mark;
+		e->header_stack->size = header_mark;
+		e->table_stack->size = table_mark;
+
+		b += b - a + 1;
+
+		if (b >= blocks->size) {
+			b = blocks->size - 1;
+		}
+	}
+
+	e->root = root;
+
+	size_t new_stop = (after) ? stop + delta : stop;
+
+	stack * stacks[] = { e->definition_stack, e->header_stack, e->table_stack };
+	size_t marks[] = { definition_mark, header_mark, table_mark };
+	size_t from[3];
+	size_t * old_start[3];
+
+	for (int i = 0; i < 3; ++i) {
+		from[i] = stack_splice_blocks(stacks[i], marks[i], start, stop, new_stop);
+
+		// Blocks on the stacks are not always still in the token tree (e.g.
+		// when merged into another block), so remember where they were
+		old_start[i] = malloc(sizeof(size_t) * (stacks[i]->size - from[i] + 1));
+
+		for (size_t j = from[i]; j < stacks[i]->size; ++j) {
+			old_start[i][j - from[i]] = ((token *) stacks[i]->element[j])->start;
+		}
+	}
+
+	// Shift blocks that follow the edit
+	token * before = stack_peek_index(blocks, a - 1);
+
+	for (t = after; t != NULL; t = t->next) {
+		token_shift_offsets(t, delta);
+	}
+
+	for (int i = 0; i < 3; ++i) {
+		for (size_t j = from[i]; j < stacks[i]->size; ++j) {
+			t = stacks[i]->element[j];
+
+			if (t->start == old_start[i][j - from[i]]) {
+				t->start += delta;
+			}
+		}
+
+		free(old_start[i]);
+	}
+
+	// Replace old blocks with new ones
+	token * new_first = (new_last) ? doc->child : NULL;
+
+	if (new_last) {
+		if (new_last->next) {
+			token_tree_free(new_last->next);
+		}
+	} else {
+		token_tree_free(doc->child);
+		new_last = before;
+	}
+
+	if (after) {
+		((token *) stack_peek_index(blocks, b - 1))->next = NULL;
+	}
+
+	token_tree_free(before->next);
+
+	doc->child = NULL;
+	token_free(doc);
+
+	if (new_first) {
+		before->next = new_first;
+		new_first->prev = before;
+	}
+
+	new_last->next = after;
+
+	if (after) {
+		after->prev = new_last;
+	} else {
+		root->child->tail = new_last;
+	}
+
+	root->len = root->child->tail->start + root->child->tail->len - root->start;
+
+	stack_free(blocks);
+
+	#ifdef USE_STATS
+	stats_scope_end(&scope);
+	#endif
+
+	#ifdef kUseObjectPool
+	token_pool_set_active(old_pool);
+	#endif
+}
+
+#ifdef TEST
+/// Edit `e` at the first occurrence of `find`, and check that exporting the
+/// updated tree matches a fresh parse of the edited text
+static void check_update_source(CuTest * tc, mmd_engine * e, const char * find, size_t deleted, const char * inserted) {
+	char * found = strstr(e->dstr->str, find);
+	CuAssertPtrNotNull(tc, found);
+
+	mmd_engine_update_source(e, found - e->dstr->str, deleted, inserted);
+
+	DString * updated = d_string_new("");
+	mmd_engine_export_token_tree(updated, e, FORMAT_HTML);
+
+	// The tree was exported from a copy, so the next edit can reuse it
+	CuAssertTrue(tc, !e->exported);
+
+	mmd_engine * fresh = mmd_engine_create_with_string(e->dstr->str, e->extensions);
+	mmd_engine_parse_string(fresh);
+
+	DString * expected = d_string_new("");
+	mmd_engine_export_token_tree(expected, fresh, FORMAT_HTML);
+
+	CuAssertStrEquals(tc, expected->str, updated->str);
+
+	d_string_free(expected, true);
+	d_string_free(updated, true);
+	mmd_engine_free(fresh, true);
+}
+
+
+void Test_mmd_engine_update_source(CuTest* tc) {
+	mmd_engine * e = mmd_engine_create_with_string(
+		"Title\n=====\n\n"
+		"Some [link] and a note[^n].\n\n"
+		"* one\n* two\n\n"
+		"[link]: http://example.net/\n\n"
+		"[^n]: The note.\n\n"
+		"Last paragraph.\n", EXT_NOTES);
+
+	mmd_engine_parse_string(e);
+
+	// Exporting before the first edit uses up the tree, so it is parsed again
+	DString * out = d_string_new("");
+	mmd_engine_export_token_tree(out, e, FORMAT_HTML);
+	CuAssertTrue(tc, e->exported);
+	d_string_free(out, true);
+
+	check_update_source(tc, e, "Last", 0, "The ");
+
+	// Then only blocks near each edit are parsed again, and the definitions
+	// (emptied by each export) are still found
+	check_update_source(tc, e, "one", 3, "uno");
+	check_update_source(tc, e, "The note", 3, "A");
+	check_update_source(tc, e, "\n\nThe Last", 1, "");
+	check_update_source(tc, e, "* two", 0, "\n\n# Header #\n\n");
+	check_update_source(tc, e, "example.net", 7, "example.org");
+	check_update_source(tc, e, "Title", 0, "A ");
+
+	mmd_engine_free(e, true);
+}
+
+
+void Test_mmd_engine_update_source_frozen(CuTest* tc) {
+	mmd_engine * e = mmd_engine_create_with_string(
+		"Title\n=====\n\n"
+		"Some [link] and a note[^n].\n\n"
+		"* one\n* two\n\n"
+		"[link]: http://example.net/\n\n"
+		"[^n]: The note.\n\n"
+		"Last paragraph.\n", EXT_NOTES);
+
+	mmd_engine_set_freeze(e, true);
+	mmd_engine_parse_string(e);
+
+	#ifdef kUseObjectPool
+	CuAssertPtrEquals(tc, e->frozen, e->root);
+	#endif
+
+	// Blocks parsed again after each edit come from the pool, and are linked
+	// in among the frozen tokens
+
+	check_update_source(tc, e, "Last", 0, "The ");
+	check_update_source(tc, e, "one", 3, "uno");
+	check_update_source(tc, e, "The note", 3, "A");
+	check_update_source(tc, e, "\n\nThe Last", 1, "");
+	check_update_source(tc, e, "* two", 0, "\n\n# Header #\n\n");
+	check_update_source(tc, e, "example.net", 7, "example.org");
+	check_update_source(tc, e, "Title", 0, "A ");
+
+	mmd_engine_free(e, true);
+}
+
+
+void Test_mmd_engine_update_source_read_only(CuTest* tc) {
+	// String constants are read-only, like text from map_file()
+	const char * text = "Some *text*.\n\nMore text.\n";
+	DString source = { (char *) text, 0, strlen(text) };
+
+	CuAssertTrue(tc, !d_string_is_writable(&source));
+
+	mmd_engine * e = mmd_engine_create_with_dstring(&source, 0);
+	mmd_engine_parse_string(e);
+
+	// The first edit is made to a private copy
+	check_update_source(tc, e, "More", 0, "Even ");
+	CuAssertTrue(tc, e->dstr != &source);
+	CuAssertTrue(tc, e->dstr_private);
+	CuAssertStrEquals(tc, "Some *text*.\n\nEven More text.\n", e->dstr->str);
+	CuAssertPtrEquals(tc, (char *) text, source.str);
+
+	check_update_source(tc, e, "text", 4, "words");
+
+	// The copy is freed with the engine, but the caller's DString is not
+	mmd_engine_free(e, false);
+
+	e = mmd_engine_create_with_dstring(&source, 0);
+	mmd_engine_reset_with_string(e, "New text.\n");
+	CuAssertStrEquals(tc, "New text.\n", e->dstr->str);
+	CuAssertStrEquals(tc, "Some *text*.\n\nMore text.\n", source.str);
+
+	mmd_engine_free(e, false);
+}
+#endif
+
+
+/// Does the text have metadata?
+bool mmd_string_has_metadata(char * source, size_t * end) {
+	bool result;
+
+	mmd_engine * e = mmd_engine_create_with_string(source, 0);
+	result = mmd_engine_has_metadata(e, end);
+
+	mmd_engine_free(e, true);
+
+	return result;
+}
+
+
+/// Does the text have metadata?
+bool mmd_d_string_has_metadata(DString * source, size_t * end) {
+	bool result;
+
+	mmd_engine * e = mmd_engine_create_with_dstring(source, 0);
+	result = mmd_engine_has_metadata(e, end);
+
+	mmd_engine_free(e, false);
+
+	return result;
+}
+
+
+/// Does the text have metadata?
+bool mmd_engine_has_metadata(mmd_engine * e, size_t * end) {
+	bool result = false;
+	token * old_root;
+
+	if (!e) {
+		return false;
+	}
+
+	if (!(scan_meta_line(&e->dstr->str[0]))) {
+		// First line is not metadata, so can't have metadata
+		// Saves the time of an unnecessary parse
+		// TODO:  Need faster confirmation of actual metadata than full tokenizing
+		if (end) {
+			*end = 0;
+		}
+
+		return false;
+	}
+
+	// Preserve existing parse tree (if any)
+	old_root = e->root;
+
+	#ifdef kUseObjectPool
+	// Allocate tokens from this engine's pool
+	struct pool * old_pool = token_pool_set_active(e->token_pool);
+	#endif
+
+	#ifdef USE_STATS
+	stats_scope scope;
+	stats_scope_begin(&scope, &e->stats);
+	#endif
+
+	stats_timer(stage_start);
+
+	// Tokenize the string (up until first empty line)
+	token * doc = mmd_tokenize_string(e, 0, e->dstr->currentStringLength, true);
+	stats_lap(stage_start, tokenize_time);
+
+	// Parse tokens into blocks
+	mmd_parse_token_chain(e, doc);
+	stats_lap(stage_start, parse_time);
+
+	if (doc) {
+		if (doc->child && doc->child->type == BLOCK_META) {
+			result = true;
+
+			if (end) {
+				*end = doc->child->len;
+			}
+		}
+
+		token_tree_free(doc);
+	}
+
+	// Restore previous parse tree
+	e->root = old_root;
+
+	#ifdef USE_STATS
+	stats_scope_end(&scope);
+	#endif
+
+	#ifdef kUseObjectPool
+	token_pool_set_active(old_pool);
+	#endif
+
+	return result;
+}
+
+
+/// Return metadata keys, one per line
+/// Returned char * must be freed
+char * mmd_string_metadata_keys(char * source) {
+	char * result;
 
 	mmd_engine * e = mmd_engine_create_with_string(source, 0);
 	result = mmd_engine_metadata_keys(e);
@@ -2480,8 +3968,17 @@ stack * mmd_engine_transclusion_manifest(mmd_engine * e, const char * search_pat
 	// Copy source text for temporary buffer
 	DString * buffer = d_string_new(e->dstr->str);
 
+	#ifdef USE_STATS
+	stats_scope scope;
+	stats_scope_begin(&scope, &e->stats);
+	#endif
+
 	mmd_transclude_source(buffer, search_path, source_path, FORMAT_HTML, NULL, manifest);
 
+	#ifdef USE_STATS
+	stats_scope_end(&scope);
+	#endif
+
 	d_string_free(buffer, true);
 
 	return manifest;
@@ -2518,6 +4015,10 @@ void mmd_engine_update_metavalue_for_key(mmd_engine * e, const char * key, const
 	bool has_meta = true;
 	size_t meta_end = 0;
 
+	if (!mmd_engine_make_source_writable(e, true)) {
+		return;
+	}
+
 	// Check for metadata and character
 	if (!mmd_engine_has_metadata(e, &meta_end)) {
 		has_meta = false;
@@ -2658,6 +4159,14 @@ char * mmd_engine_convert(mmd_engine * e, short format) {
 }
 
 
+/// Convert MMD text to HTML fragments, reusing the output for unchanged blocks
+mmd_fragment_diff mmd_engine_convert_to_fragments(mmd_engine * e, mmd_fragment_cache * c) {
+	mmd_engine_parse_string(e);
+
+	return mmd_engine_export_html_fragments(e, c);
+}
+
+
 /// Convert MMD text and write results to specified file -- used for "complex" output formats requiring
 /// multiple documents (e.g. EPUB)
 void mmd_string_convert_to_file(const char * source, unsigned long extensions, short format, short language, const char * directory, const char * filepath) {
@@ -2809,6 +4318,64 @@ DString * mmd_engine_convert_to_data(mmd_engine * e, short format, const char *
 }
 
 
+int mmd_engine_convert_to_callback(mmd_engine * e, short format, mmd_write_callback write, void * context) {
+	switch (format) {
+		case FORMAT_HTML:
+		case FORMAT_LATEX:
+		case FORMAT_BEAMER:
+		case FORMAT_MEMOIR:
+		case FORMAT_FODT:
+			break;
+
+		default:
+			// These formats need the complete output before they can be packaged
+			return -1;
+	}
+
+	mmd_output_sink sink = { write, context, 0 };
+
+	DString * output = d_string_new("");
+
+	mmd_engine_parse_string(e);
+
+	if (format == FORMAT_FODT) {
+		opendocument_flat_prolog(output, e, format);
+	}
+
+	mmd_engine_export_token_tree_to_sink(output, e, format, &sink);
+
+	if (format == FORMAT_FODT) {
+		opendocument_flat_epilog(output);
+	} else {
+		// Add newline to result
+		d_string_append_c(output, '\n');
+	}
+
+	mmd_output_sink_flush(&sink, output, true);
+
+	d_string_free(output, true);
+
+	return sink.status;
+}
+
+
+static int write_to_stream(const char * data, size_t len, void * context) {
+	// A short write doesn't always set errno, so don't report a stale one
+	errno = 0;
+
+	if (fwrite(data, 1, len, (FILE *) context) == len) {
+		return 0;
+	}
+
+	return errno ? errno : EIO;
+}
+
+
+int mmd_engine_convert_to_stream(mmd_engine * e, short format, FILE * stream) {
+	return mmd_engine_convert_to_callback(e, format, write_to_stream, stream);
+}
+
+
 /// Return string containing engine version.
 char * mmd_version(void) {
 	char * result;
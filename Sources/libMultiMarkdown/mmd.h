@@ -64,16 +64,23 @@
 #include "uthash.h"
 
 
-#define kMaxParseRecursiveDepth 1000		//!< Maximum recursion depth when parsing -- to prevent stack overflow with "pathologic" input
-
-
 struct mmd_engine {
-	DString *				dstr;
+	DString *				dstr;				//!< Source text.  May be read-only (e.g. map_file()) until edited
+	bool					dstr_private;		//!< `dstr` is a copy made by the engine to edit a read-only source, and is always freed with the engine
 	token *					root;
 	unsigned long			extensions;
-	unsigned short			recurse_depth;
+
+	struct parse_job *		parse_jobs;			//!< Blocks nested inside those being parsed (see mmd_parse_token_chain())
+	size_t					parse_job_count;
+	size_t					parse_job_size;
+	size_t					parse_job_mark;		//!< parse_job_count after the last block was finished
 
 	bool					allow_meta;
+	bool					exported;			//!< Token tree has been altered by export
+	bool					edited;				//!< Source has been edited, so export works on a copy of the tree
+	bool					too_long;			//!< Last parse failed because the source was too long (see mmd_parse_range())
+
+	unsigned short			threads;			//!< Threads to use for parsing and HTML export
 
 	token_pair_engine *		pairings1;
 	token_pair_engine *		pairings2;
@@ -94,18 +101,50 @@ struct mmd_engine {
 	short					quotes_lang;
 
 	struct asset *			asset_hash;
+
+	#ifdef kUseObjectPool
+	struct pool *			token_pool;			//!< Tokens for this engine are allocated here (reused by each parse)
+	size_t					parsed_bytes;		//!< Size of token_pool slabs used by the last full parse
+
+	bool					freeze;				//!< Copy token tree into one block after parsing
+	token *					frozen;				//!< Token tree laid out in preorder (see mmd_engine_set_freeze())
+
+	token *					export_tokens;		//!< Copy of the token tree altered by the last export (memory is reused by the next)
+	size_t					export_capacity;	//!< Number of tokens that fit in export_tokens
+	stack *					export_originals;	//!< Token each copy in export_tokens was made from
+	#endif
+
+	#ifdef USE_STATS
+	mmd_stats				stats;				//!< Gathered while parsing and exporting
+	#endif
 };
 
 
+/// Stages of parsing, in the order used by mmd_engine_parse_substring()
+/// (exposed so they can be benchmarked separately)
+token * mmd_tokenize_string(mmd_engine * e, size_t start, size_t len, bool stop_on_empty_line);
+void mmd_parse_token_chain(mmd_engine * e, token * chain);
+void mmd_assign_ambidextrous_tokens_in_block(mmd_engine * e, token * block, size_t start_offset);
+void mmd_pair_tokens_in_block(token * block, token_pair_engine * e, stack * s);
+void pair_emphasis_tokens(token * t);
+
+
+/// Export works on a copy of the token tree, so that the tree can still be
+/// updated incrementally afterwards
+void mmd_engine_export_begin(mmd_engine * e);
+void mmd_engine_export_end(mmd_engine * e);
+
+
 /// Expose routines to lemon parser
 void recursive_parse_indent(mmd_engine * e, token * block);
 void recursive_parse_list_item(mmd_engine * e, token * block);
 void recursive_parse_blockquote(mmd_engine * e, token * block);
-void strip_line_tokens_from_block(mmd_engine * e, token * block);
+void strip_line_tokens_after_children(mmd_engine * e, token * block);
 void is_para_html(mmd_engine * e, token * block);
+void is_list_loose(mmd_engine * e, token * list);
 
 
-void is_list_loose(token * list);
+void strip_line_tokens_from_block(mmd_engine * e, token * block);
 
 
 struct asset {
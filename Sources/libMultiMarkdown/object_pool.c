@@ -54,25 +54,263 @@
 
 */
 
+#include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
+
+#if defined(__linux__)
+	#include <sys/mman.h>
+#endif
+
+#ifdef USE_PTHREADS
+	#include <pthread.h>
+#endif
 
 #include "object_pool.h"
+#include "stats.h"
+
+#ifdef TEST
+	#include "CuTest.h"
+#endif
+
+#define kNumberOfObjects	1024				//!< Size of the first slab of a pool, in objects (including slab header)
+#define kMaxSlabBytes		(8 * 1024 * 1024)	//!< Largest slab with POOL_GROW_SLABS
+#define kMaxRetainedBytes	(256 * 1024 * 1024)	//!< Free any more than this with POOL_RETAIN_SLABS
+#define kHugePageSize		(2 * 1024 * 1024)	//!< Slabs this large are mapped with POOL_HUGE_PAGES
+
+
+/// Each slab starts with a header, followed by the objects
+typedef struct slab {
+	struct slab *	next;			//!< Next retained slab
+	size_t			size;			//!< Bytes in slab, including header
+	bool			mapped;			//!< Allocated with mmap() rather than malloc()
+} slab;
+
+#define kSlabHeaderSize		((sizeof(slab) + 15) & ~((size_t) 15))
+
+
+static unsigned int		pool_mode = 0;			//!< Options set with pool_set_mode()
+static slab *			retained = NULL;		//!< Slabs kept for reuse (POOL_RETAIN_SLABS)
+static pool_counters	counters = {0};
+
+#ifdef USE_PTHREADS
+	static pthread_mutex_t	pool_lock = PTHREAD_MUTEX_INITIALIZER;	//!< Protects retained and counters
+
+	#define pool_lock()		pthread_mutex_lock(&pool_lock)
+	#define pool_unlock()	pthread_mutex_unlock(&pool_lock)
+#else
+	#define pool_lock()
+	#define pool_unlock()
+#endif
+
+
+/// Choose how pools get memory for their slabs
+void pool_set_mode(unsigned int mode) {
+	pool_mode = mode;
+
+	if (!(mode & POOL_RETAIN_SLABS)) {
+		pool_release_retained();
+	}
+}
+
+
+/// Get counters for slabs allocated and reused by all pools
+void pool_get_counters(pool_counters * c) {
+	pool_lock();
+	*c = counters;
+	pool_unlock();
+}
+
+
+/// Give slab memory back to the system
+static void slab_free(slab * s) {
+	#if defined(__linux__)
+
+	if (s->mapped) {
+		munmap(s, s->size);
+		return;
+	}
+
+	#endif
+
+	free(s);
+}
+
+
+/// Get new slab memory from the system
+static slab * slab_new(size_t size) {
+	slab * s = NULL;
+	bool mapped = false;
+
+	#if defined(__linux__)
+
+	if ((pool_mode & POOL_HUGE_PAGES) && (size >= kHugePageSize)) {
+		// Round up to whole huge pages, and align the mapping so that the
+		// kernel can back it with them
+		size = (size + kHugePageSize - 1) & ~((size_t) kHugePageSize - 1);
+
+		char * m = mmap(NULL, size + kHugePageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
 
-#define kNumberOfObjects	1024
+		if (m != MAP_FAILED) {
+			char * aligned = (char *)(((size_t) m + kHugePageSize - 1) & ~((size_t) kHugePageSize - 1));
+
+			if (aligned > m) {
+				munmap(m, aligned - m);
+			}
+
+			munmap(aligned + size, (m + kHugePageSize) - aligned);
+
+			#ifdef MADV_HUGEPAGE
+			madvise(aligned, size, MADV_HUGEPAGE);
+			#endif
+
+			s = (slab *) aligned;
+			mapped = true;
+		}
+	}
+
+	#endif
+
+	if (s == NULL) {
+		s = malloc(size);
+	}
+
+	if (s) {
+		s->next = NULL;
+		s->size = size;
+		s->mapped = mapped;
+	}
+
+	return s;
+}
+
+
+/// Get a slab of at least `size` bytes -- a retained one if possible
+static slab * slab_acquire(size_t size) {
+	slab * s = NULL;
+	slab ** best = NULL;
+
+	pool_lock();
+
+	// Use the smallest retained slab that is large enough
+	for (slab ** walker = &retained; *walker != NULL; walker = &(*walker)->next) {
+		if (((*walker)->size >= size) && ((best == NULL) || ((*walker)->size < (*best)->size))) {
+			best = walker;
+
+			if ((*best)->size == size) {
+				break;
+			}
+		}
+	}
+
+	if (best) {
+		s = *best;
+		*best = s->next;
+		counters.retained_bytes -= s->size;
+		counters.slabs_reused++;
+	}
+
+	pool_unlock();
+
+	if (s) {
+		stats_count(pool_slabs_reused);
+		return s;
+	}
+
+	s = slab_new(size);
+
+	if (s) {
+		stats_count(pool_slabs);
+
+		pool_lock();
+		counters.slabs_allocated++;
+		pool_unlock();
+	}
+
+	return s;
+}
+
+
+/// Free a slab that is no longer needed, or keep it for reuse
+static void slab_release(slab * s) {
+	if (pool_mode & POOL_RETAIN_SLABS) {
+		pool_lock();
+
+		if (counters.retained_bytes + s->size <= kMaxRetainedBytes) {
+			s->next = retained;
+			retained = s;
+			counters.retained_bytes += s->size;
+			s = NULL;
+		}
+
+		pool_unlock();
+	}
+
+	if (s) {
+		slab_free(s);
+	}
+}
+
+
+/// Free all slabs kept for reuse
+void pool_release_retained(void) {
+	pool_lock();
+	slab * s = retained;
+	retained = NULL;
+	counters.retained_bytes = 0;
+	pool_unlock();
+
+	while (s) {
+		slab * next = s->next;
+		slab_free(s);
+		s = next;
+	}
+}
+
+
+/// Start allocating objects from slab `s`
+static void pool_use_slab(pool * p, slab * s) {
+	// Next object will come from beginning of this slab
+	p->next = (char *) s + kSlabHeaderSize;
+
+	// Set warning to trigger need for next slab
+	p->last = p->next + p->object_size * ((s->size - kSlabHeaderSize) / p->object_size);
+
+	p->used += s->size;
+}
 
 
 void pool_add_slab(pool * p) {
-	void * slab = malloc(p->object_size * kNumberOfObjects);
+	slab * s;
+
+	if (p->current + 1 < p->allocated->size) {
+		// Reuse a slab kept by pool_reset()
+		p->current++;
+		s = stack_peek_index(p->allocated, p->current);
 
-	if (slab) {
-		stack_push(p->allocated, slab);
+		stats_count(pool_slabs_reused);
+	} else {
+		size_t size = p->object_size * kNumberOfObjects;
 
-		// Next object will come from beginning of this slab
-		p->next = slab;
+		if (pool_mode & POOL_GROW_SLABS) {
+			// Each slab is twice the size of the one before
+			for (size_t i = 0; (i < p->allocated->size) && (size < kMaxSlabBytes); ++i) {
+				size *= 2;
+			}
+		}
 
-		// Set warning to trigger need for next slab
-		p->last = slab + (p->object_size * (kNumberOfObjects));
+		s = slab_acquire(size);
+
+		if (s == NULL) {
+			return;
+		}
+
+		stack_push(p->allocated, s);
+
+		p->current = p->allocated->size - 1;
 	}
+
+	pool_use_slab(p, s);
 }
 
 
@@ -84,8 +322,12 @@ pool * pool_new(short size) {
 		p->object_size = size;
 
 		p->allocated = stack_new(1024);
+		p->current = 0;
+		p->used = 0;
 
-		pool_add_slab(p);
+		// First slab is added when the first object is allocated
+		p->next = NULL;
+		p->last = NULL;
 	}
 
 	return p;
@@ -104,24 +346,228 @@ void pool_free(pool * p) {
 }
 
 
-/// Drain pool -- free slabs previously allocated
+/// Drain pool -- free slabs previously allocated (or retain them for reuse
+/// with POOL_RETAIN_SLABS)
 void pool_drain(pool * p) {
 	if (p == NULL) {
 		return;
 	}
 
-	void * slab;
-
 	while (p->allocated->size > 0) {
-		slab = stack_pop(p->allocated);
-		free(slab);
+		slab_release(stack_pop(p->allocated));
 	}
 
 	p->next = NULL;
 	p->last = NULL;
+	p->current = 0;
+	p->used = 0;
+}
+
+
+/// Reset pool -- discard all objects, but keep the slabs for reuse
+void pool_reset(pool * p) {
+	if ((p == NULL) || (p->allocated->size == 0)) {
+		return;
+	}
+
+	p->current = 0;
+	p->used = 0;
+
+	pool_use_slab(p, stack_peek_index(p->allocated, 0));
 }
 
 
+#ifdef TEST
+void Test_pool_reset(CuTest* tc) {
+	pool * p = pool_new(16);
+	size_t slab_size = 16 * kNumberOfObjects;
+	pool_counters before, after;
+
+	// Nothing to reset yet
+	pool_reset(p);
+	pool_reset(NULL);
+	CuAssertIntEquals(tc, 0, pool_bytes_in_use(p));
+
+	char * first = pool_allocate_object(p);
+
+	for (int i = 1; i < 1500; ++i) {
+		pool_allocate_object(p);
+	}
+
+	CuAssertIntEquals(tc, 2, p->allocated->size);
+	CuAssertIntEquals(tc, 2 * slab_size, pool_bytes_in_use(p));
+
+	// Objects come from the first slab again
+	pool_reset(p);
+	CuAssertIntEquals(tc, slab_size, pool_bytes_in_use(p));
+	CuAssertPtrEquals(tc, first, pool_allocate_object(p));
+	CuAssertPtrEquals(tc, first + 16, pool_allocate_object(p));
+
+	// ...and then the second, without allocating any more
+	pool_get_counters(&before);
+
+	for (int i = 2; i < 1500; ++i) {
+		pool_allocate_object(p);
+	}
+
+	pool_get_counters(&after);
+	CuAssertIntEquals(tc, before.slabs_allocated, after.slabs_allocated);
+	CuAssertIntEquals(tc, 2, p->allocated->size);
+	CuAssertIntEquals(tc, 2 * slab_size, pool_bytes_in_use(p));
+
+	pool_free(p);
+}
+#endif
+
+
+/// Bytes of slabs holding objects allocated since the last reset
+size_t pool_bytes_in_use(pool * p) {
+	return p->used;
+}
+
+
+/// Take ownership of the slabs allocated by another pool (with the same object
+/// size), e.g. one that was used by a separate thread
+void pool_adopt(pool * p, pool * donor) {
+	while (donor->allocated->size > 0) {
+		if ((p->next != NULL) && (p->current + 1 < p->allocated->size)) {
+			// Give up a free slab in exchange, so that a pool that is reset and
+			// reused doesn't keep growing
+			slab_release(stack_pop(p->allocated));
+		}
+
+		slab * adopted = stack_pop(donor->allocated);
+		stack_push(p->allocated, adopted);
+		p->used += adopted->size;
+
+		if (p->next == NULL) {
+			// Nothing in use here -- we'll start a new slab when needed
+			p->current = p->allocated->size - 1;
+			continue;
+		}
+
+		// Keep slabs in use ahead of the current one, and any free slabs after
+		// it: [in use..., adopted, current, free...]
+		void ** slabs = p->allocated->element;
+		slabs[p->allocated->size - 1] = slabs[p->current + 1];
+		slabs[p->current + 1] = slabs[p->current];
+		slabs[p->current] = adopted;
+		p->current++;
+	}
+
+	donor->next = NULL;
+	donor->last = NULL;
+	donor->current = 0;
+	donor->used = 0;
+}
+
+
+#ifdef TEST
+void Test_pool_adopt(CuTest* tc) {
+	pool * p = pool_new(16);
+	pool * donor = pool_new(16);
+	size_t slab_size = 16 * kNumberOfObjects;
+
+	char * last = NULL;
+
+	for (int i = 0; i < 10; ++i) {
+		last = pool_allocate_object(p);
+	}
+
+	char * adopted = pool_allocate_object(donor);
+	strcpy(adopted, "adopted");
+
+	for (int i = 1; i < 1500; ++i) {
+		pool_allocate_object(donor);
+	}
+
+	pool_adopt(p, donor);
+
+	CuAssertIntEquals(tc, 0, donor->allocated->size);
+	CuAssertIntEquals(tc, 0, pool_bytes_in_use(donor));
+	CuAssertIntEquals(tc, 3, p->allocated->size);
+	CuAssertIntEquals(tc, 3 * slab_size, pool_bytes_in_use(p));
+
+	// Adopted objects are untouched, and allocation continues where it was
+	CuAssertStrEquals(tc, "adopted", adopted);
+	CuAssertPtrEquals(tc, last + 16, pool_allocate_object(p));
+
+	// The donor can still be used
+	CuAssertTrue(tc, pool_allocate_object(donor) != NULL);
+	CuAssertIntEquals(tc, 1, donor->allocated->size);
+
+	// A free slab after the one in use is given up in exchange
+	pool_reset(p);
+	pool_adopt(p, donor);
+	CuAssertIntEquals(tc, 3, p->allocated->size);
+	CuAssertIntEquals(tc, 2 * slab_size, pool_bytes_in_use(p));
+
+	// An empty pool starts a new slab after those adopted
+	pool * empty = pool_new(16);
+	pool_allocate_object(donor);
+	pool_adopt(empty, donor);
+	CuAssertIntEquals(tc, slab_size, pool_bytes_in_use(empty));
+	CuAssertTrue(tc, pool_allocate_object(empty) != NULL);
+	CuAssertIntEquals(tc, 2, empty->allocated->size);
+	CuAssertIntEquals(tc, 2 * slab_size, pool_bytes_in_use(empty));
+
+	pool_free(empty);
+	pool_free(donor);
+	pool_free(p);
+}
+#endif
+
+
+#ifdef TEST
+void Test_pool_retain_slabs(CuTest* tc) {
+	size_t slab_size = 16 * kNumberOfObjects;
+	pool_counters start, c;
+
+	pool_set_mode(POOL_RETAIN_SLABS);
+	pool_get_counters(&start);
+
+	pool * p = pool_new(16);
+	pool_allocate_object(p);
+	pool_get_counters(&c);
+	CuAssertIntEquals(tc, start.slabs_allocated + 1, c.slabs_allocated);
+
+	// Freed slab is kept...
+	pool_free(p);
+	pool_get_counters(&c);
+	CuAssertIntEquals(tc, start.retained_bytes + slab_size, c.retained_bytes);
+
+	// ...and reused by the next pool that needs one
+	p = pool_new(16);
+	pool_allocate_object(p);
+	pool_get_counters(&c);
+	CuAssertIntEquals(tc, start.slabs_allocated + 1, c.slabs_allocated);
+	CuAssertIntEquals(tc, start.slabs_reused + 1, c.slabs_reused);
+	CuAssertIntEquals(tc, start.retained_bytes, c.retained_bytes);
+
+	// Slabs too small for a pool aren't used
+	pool * large = pool_new(32);
+	pool_free(p);
+	pool_allocate_object(large);
+	pool_get_counters(&c);
+	CuAssertIntEquals(tc, start.slabs_allocated + 2, c.slabs_allocated);
+	CuAssertIntEquals(tc, start.retained_bytes + slab_size, c.retained_bytes);
+
+	pool_free(large);
+	pool_release_retained();
+	pool_get_counters(&c);
+	CuAssertIntEquals(tc, 0, c.retained_bytes);
+
+	// Without the mode, slabs are freed at once
+	pool_set_mode(0);
+	p = pool_new(16);
+	pool_allocate_object(p);
+	pool_free(p);
+	pool_get_counters(&c);
+	CuAssertIntEquals(tc, 0, c.retained_bytes);
+}
+#endif
+
+
 /// Request memory for a new object from the pool
 void * pool_allocate_object(pool * p) {
 	void * a = NULL;
@@ -138,4 +584,3 @@ void * pool_allocate_object(pool * p) {
 
 	return a;
 }
-
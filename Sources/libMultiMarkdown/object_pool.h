@@ -61,11 +61,31 @@
 #include "stack.h"
 
 
+/// Options for pool_set_mode(), which apply to all pools
+enum pool_modes {
+	POOL_RETAIN_SLABS	= 1 << 0,	//!< Keep slabs of drained/freed pools for reuse by others
+	POOL_GROW_SLABS		= 1 << 1,	//!< Each new slab in a pool is twice as large as the last
+	POOL_HUGE_PAGES		= 1 << 2,	//!< Map slabs of 2 MB and up directly, and ask for huge pages (Linux)
+};
+
+
+/// Counts of slabs handed out to all pools
+struct pool_counters {
+	unsigned long	slabs_allocated;	//!< Slabs allocated from the system
+	unsigned long	slabs_reused;		//!< Slabs taken from those retained by POOL_RETAIN_SLABS
+	size_t			retained_bytes;		//!< Size of slabs retained now
+};
+
+typedef struct pool_counters pool_counters;
+
+
 /// Structure for an object allocator pool
 struct pool {
 	stack *			allocated;		//!< Stack of pointers to slabs that have been allocated
 	void *			next;			//!< Pointer to next available memory for allocation
 	void *			last;			//!< Pointer to end of available memory
+	size_t			current;		//!< Index of slab in use (later slabs are free for reuse)
+	size_t			used;			//!< Bytes in slabs up to and including current
 	short			object_size;	//!< Size of individual objects to be allocated
 
 	char 			_PADDING[6];	//!< pad struct for alignment
@@ -92,10 +112,48 @@ void pool_drain(
 );
 
 
+/// Reset pool -- all objects are discarded, but slabs are kept and reused for
+/// later allocations
+void pool_reset(
+	pool * p						//!< Pool to be reset
+);
+
+
+/// Bytes of slabs holding objects allocated since the pool was last reset
+size_t pool_bytes_in_use(
+	pool * p						//!< Pool to be measured
+);
+
+
+/// Take ownership of slabs allocated by another pool
+void pool_adopt(
+	pool * p,						//!< Pool to receive slabs
+	pool * donor					//!< Pool to take slabs from (left empty)
+);
+
+
 /// Request memory for a new object from the pool
 void * pool_allocate_object(
 	pool * p						//!< Pool to be used for allocation
 );
 
 
+/// Choose how pools get memory for their slabs (default 0: each pool mallocs
+/// slabs of 1024 objects, and frees them when drained).  Set this before
+/// creating any pools.
+void pool_set_mode(
+	unsigned int mode				//!< Combination of pool_modes
+);
+
+
+/// Free slabs kept for reuse by POOL_RETAIN_SLABS
+void pool_release_retained(void);
+
+
+/// Get counts of slabs handed out so far
+void pool_get_counters(
+	pool_counters * c				//!< Where to store counts
+);
+
+
 #endif
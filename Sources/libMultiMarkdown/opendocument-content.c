@@ -169,9 +169,21 @@ void mmd_print_string_opendocument(DString * out, const char * str) {
 		return;
 	}
 
+	size_t run;
+
 	while (*str != '\0') {
-		mmd_print_char_opendocument(out, *str);
-		str++;
+		// Copy the run of characters that don't need escaping in one step
+		run = strcspn(str, "\"&<>\t");
+
+		if (run) {
+			d_string_append_c_array(out, str, run);
+			str += run;
+		}
+
+		if (*str != '\0') {
+			mmd_print_char_opendocument(out, *str);
+			str++;
+		}
 	}
 }
 
@@ -632,9 +644,11 @@ void mmd_export_toc_opendocument(DString * out, const char * source, scratch_pad
 
 
 
-void mmd_export_token_opendocument(DString * out, const char * source, token * t, scratch_pad * scratch) {
+/// Export the start of `t` -- returns true if its children and then
+/// mmd_export_token_close_opendocument() should follow
+static bool mmd_export_token_open_opendocument(DString * out, const char * source, token * t, scratch_pad * scratch, mmd_export_saved * saved) {
 	if (t == NULL) {
-		return;
+		return false;
 	}
 
 	short	temp_short;
@@ -693,14 +707,10 @@ void mmd_export_token_opendocument(DString * out, const char * source, token * t
 		case BLOCK_BLOCKQUOTE:
 			pad(out, 2, scratch);
 			scratch->padded = 2;
-			temp_short2 = scratch->odf_para_type;
+			saved->odf_para_type = scratch->odf_para_type;
 
 			scratch->odf_para_type = BLOCK_BLOCKQUOTE;
-
-			mmd_export_token_tree_opendocument(out, source, t->child, scratch);
-			scratch->padded = 0;
-			scratch->odf_para_type = temp_short2;
-			break;
+			return true;
 
 		case BLOCK_CODE_FENCED:
 			pad(out, 2, scratch);
@@ -754,10 +764,10 @@ void mmd_export_token_opendocument(DString * out, const char * source, token * t
 
 		case BLOCK_DEFINITION:
 			pad(out, 2, scratch);
-			temp_short2 = scratch->odf_para_type;
+			saved->odf_para_type = scratch->odf_para_type;
 			scratch->odf_para_type = BLOCK_DEFINITION;
 
-			temp_short = scratch->list_is_tight;
+			saved->list_is_tight = scratch->list_is_tight;
 
 			if (!(t->child->next && (t->child->next->type == BLOCK_EMPTY) && t->child->next->next)) {
 				scratch->list_is_tight = true;
@@ -765,17 +775,9 @@ void mmd_export_token_opendocument(DString * out, const char * source, token * t
 
 			if (t->child && t->child->type != BLOCK_PARA) {
 				print_const("<text:p text:style-name=\"Quotations\">");
-				mmd_export_token_tree_opendocument(out, source, t->child, scratch);
-				print_const("</text:p>");
-			} else {
-				mmd_export_token_tree_opendocument(out, source, t->child, scratch);
 			}
 
-			scratch->padded = 0;
-
-			scratch->list_is_tight = temp_short;
-			scratch->odf_para_type = temp_short2;
-			break;
+			return true;
 
 		case BLOCK_DEFLIST:
 			pad(out, 2, scratch);
@@ -787,15 +789,7 @@ void mmd_export_token_opendocument(DString * out, const char * source, token * t
 //				print_const("<dl>\n");
 
 			scratch->padded = 2;
-
-			mmd_export_token_tree_opendocument(out, source, t->child, scratch);
-			pad(out, 1, scratch);
-
-//			if (!(t->next && (t->next->type == BLOCK_DEFLIST)))
-//				print_const("</dl>\n");
-
-			scratch->padded = 1;
-			break;
+			return true;
 
 		case BLOCK_EMPTY:
 			break;
@@ -851,7 +845,7 @@ void mmd_export_token_opendocument(DString * out, const char * source, token * t
 
 		case BLOCK_LIST_BULLETED_LOOSE:
 		case BLOCK_LIST_BULLETED:
-			temp_short = scratch->list_is_tight;
+			saved->list_is_tight = scratch->list_is_tight;
 
 			switch (t->type) {
 				case BLOCK_LIST_BULLETED_LOOSE:
@@ -866,16 +860,11 @@ void mmd_export_token_opendocument(DString * out, const char * source, token * t
 			pad(out, 2, scratch);
 			print_const("<text:list text:style-name=\"L1\">");
 			scratch->padded = 1;
-			mmd_export_token_tree_opendocument(out, source, t->child, scratch);
-			pad(out, 2, scratch);
-			print_const("</text:list>");
-			scratch->padded = 0;
-			scratch->list_is_tight = temp_short;
-			break;
+			return true;
 
 		case BLOCK_LIST_ENUMERATED_LOOSE:
 		case BLOCK_LIST_ENUMERATED:
-			temp_short = scratch->list_is_tight;
+			saved->list_is_tight = scratch->list_is_tight;
 
 			switch (t->type) {
 				case BLOCK_LIST_ENUMERATED_LOOSE:
@@ -890,21 +879,13 @@ void mmd_export_token_opendocument(DString * out, const char * source, token * t
 			pad(out, 2, scratch);
 			print_const("<text:list text:style-name=\"L2\">");
 			scratch->padded = 1;
-			mmd_export_token_tree_opendocument(out, source, t->child, scratch);
-			pad(out, 2, scratch);
-			print_const("</text:list>");
-			scratch->padded = 0;
-			scratch->list_is_tight = temp_short;
-			break;
+			return true;
 
 		case BLOCK_LIST_ITEM:
 			pad(out, 2, scratch);
 			print_const("<text:list-item>\n");
 			scratch->padded = 2;
-			mmd_export_token_tree_opendocument(out, source, t->child, scratch);
-			print_const("</text:list-item>");
-			scratch->padded = 0;
-			break;
+			return true;
 
 		case BLOCK_LIST_ITEM_TIGHT:
 			pad(out, 2, scratch);
@@ -915,15 +896,7 @@ void mmd_export_token_opendocument(DString * out, const char * source, token * t
 			}
 
 			scratch->padded = 2;
-			mmd_export_token_tree_opendocument(out, source, t->child, scratch);
-
-			if (t->child && t->child->type != BLOCK_PARA) {
-				print_const("</text:p>");
-			}
-
-			print_const("</text:list-item>");
-			scratch->padded = 0;
-			break;
+			return true;
 
 		case BLOCK_META:
 			break;
@@ -1051,10 +1024,7 @@ void mmd_export_token_opendocument(DString * out, const char * source, token * t
 		case BLOCK_TERM:
 			pad(out, 2, scratch);
 			print_const("<text:p><text:span text:style-name=\"MMD-Bold\">");
-			mmd_export_token_tree_opendocument(out, source, t->child, scratch);
-			print_const("</text:span></text:p>\n");
-			scratch->padded = 2;
-			break;
+			return true;
 
 		case BRACE_DOUBLE_LEFT:
 			print_const("{{");
@@ -1326,7 +1296,7 @@ void mmd_export_token_opendocument(DString * out, const char * source, token * t
 					d_string_append_c_array(out, &source[t->start + 4], t->len - 4 - 3);
 				}
 			} else {
-				mmd_export_token_tree_opendocument(out, source, t->child, scratch);
+				return true;
 			}
 
 			free(temp_char);
@@ -1390,8 +1360,7 @@ void mmd_export_token_opendocument(DString * out, const char * source, token * t
 
 		case PAIR_BRACE:
 		case PAIR_BRACES:
-			mmd_export_token_tree_opendocument(out, source, t->child, scratch);
-			break;
+			return true;
 
 		case PAIR_BRACKET:
 			if ((scratch->extensions & EXT_NOTES) &&
@@ -1437,12 +1406,11 @@ void mmd_export_token_opendocument(DString * out, const char * source, token * t
 
 				scratch->skip_token = temp_short;
 
-				return;
+				return false;
 			}
 
 			// No links exist, so treat as normal
-			mmd_export_token_tree_opendocument(out, source, t->child, scratch);
-			break;
+			return true;
 
 		case PAIR_BRACKET_CITATION:
 parse_citation:
@@ -1888,8 +1856,7 @@ parse_citation:
 		case PAIR_SUBSCRIPT:
 		case PAIR_SUPERSCRIPT:
 		case PAIR_UL:
-			mmd_export_token_tree_opendocument(out, source, t->child, scratch);
-			break;
+			return true;
 
 		case PAREN_LEFT:
 			print_char('(');
@@ -2070,28 +2037,84 @@ parse_citation:
 			token_describe(t, source);
 			break;
 	}
+	return false;
 }
 
 
-void mmd_export_token_tree_opendocument(DString * out, const char * source, token * t, scratch_pad * scratch) {
+/// Export the end of `t`, after its children
+static void mmd_export_token_close_opendocument(DString * out, const char * source, token * t, scratch_pad * scratch, mmd_export_saved saved) {
+	switch (t->type) {
+		case BLOCK_BLOCKQUOTE:
+			scratch->padded = 0;
+			scratch->odf_para_type = saved.odf_para_type;
+			break;
 
-	// Prevent stack overflow with "dangerous" input causing extreme recursion
-	if (scratch->recurse_depth == kMaxExportRecursiveDepth) {
-		return;
+		case BLOCK_DEFINITION:
+			if (t->child && t->child->type != BLOCK_PARA) {
+				print_const("</text:p>");
+			}
+
+			scratch->padded = 0;
+
+			scratch->list_is_tight = saved.list_is_tight;
+			scratch->odf_para_type = saved.odf_para_type;
+			break;
+
+		case BLOCK_DEFLIST:
+			pad(out, 1, scratch);
+
+//			if (!(t->next && (t->next->type == BLOCK_DEFLIST)))
+//				print_const("</dl>\n");
+
+			scratch->padded = 1;
+			break;
+
+		case BLOCK_LIST_BULLETED_LOOSE:
+		case BLOCK_LIST_BULLETED:
+		case BLOCK_LIST_ENUMERATED_LOOSE:
+		case BLOCK_LIST_ENUMERATED:
+			pad(out, 2, scratch);
+			print_const("</text:list>");
+			scratch->padded = 0;
+			scratch->list_is_tight = saved.list_is_tight;
+			break;
+
+		case BLOCK_LIST_ITEM:
+			print_const("</text:list-item>");
+			scratch->padded = 0;
+			break;
+
+		case BLOCK_LIST_ITEM_TIGHT:
+			if (t->child && t->child->type != BLOCK_PARA) {
+				print_const("</text:p>");
+			}
+
+			print_const("</text:list-item>");
+			scratch->padded = 0;
+			break;
+
+		case BLOCK_TERM:
+			print_const("</text:span></text:p>\n");
+			scratch->padded = 2;
+			break;
+
+		default:
+			break;
 	}
+}
 
-	scratch->recurse_depth++;
 
-	while (t != NULL) {
-		if (scratch->skip_token) {
-			scratch->skip_token--;
-		} else {
-			mmd_export_token_opendocument(out, source, t, scratch);
-		}
+void mmd_export_token_opendocument(DString * out, const char * source, token * t, scratch_pad * scratch) {
+	mmd_export_saved saved;
 
-		t = t->next;
+	if (mmd_export_token_open_opendocument(out, source, t, scratch, &saved)) {
+		mmd_export_token_tree_opendocument(out, source, t->child, scratch);
+		mmd_export_token_close_opendocument(out, source, t, scratch, saved);
 	}
+}
+
 
-	scratch->recurse_depth--;
+void mmd_export_token_tree_opendocument(DString * out, const char * source, token * t, scratch_pad * scratch) {
+	mmd_export_token_tree(out, source, t, scratch, mmd_export_token_open_opendocument, mmd_export_token_close_opendocument);
 }
 
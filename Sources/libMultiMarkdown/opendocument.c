@@ -887,9 +887,8 @@ char * opendocument_content_file(const char * body, int format) {
 }
 
 
-/// Create OpenDocument text file
-DString * opendocument_core_flat_create(const char * body, mmd_engine * e, int format) {
-	DString * out = d_string_new("");
+/// Add everything that precedes the body of a flat OpenDocument file
+void opendocument_flat_prolog(DString * out, mmd_engine * e, int format) {
 	char * text;
 
 	print_const("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
@@ -916,14 +915,29 @@ DString * opendocument_core_flat_create(const char * body, mmd_engine * e, int f
 	free(text);
 
 
-	// Add body
 	print_const("\n<office:body>\n<office:text>\n");
-	d_string_append(out, body);
-	print_const("\n</office:text>\n</office:body>\n</office:document>\n");
-
 
 	// Cleanup
 	scratch_pad_free(scratch);
+}
+
+
+/// Add everything that follows the body of a flat OpenDocument file
+void opendocument_flat_epilog(DString * out) {
+	print_const("\n</office:text>\n</office:body>\n</office:document>\n");
+}
+
+
+/// Create OpenDocument text file
+DString * opendocument_core_flat_create(const char * body, mmd_engine * e, int format) {
+	DString * out = d_string_new("");
+
+	opendocument_flat_prolog(out, e, format);
+
+	// Add body
+	d_string_append(out, body);
+
+	opendocument_flat_epilog(out);
 
 	return out;
 }
@@ -113,6 +113,10 @@ char * opendocument_metadata(mmd_engine * e, scratch_pad * scratch);
 
 
 DString * opendocument_flat_text_create(const char * body, mmd_engine * e, const char * directory);
+
+/// Used to stream flat OpenDocument output -- the body goes in between
+void opendocument_flat_prolog(DString * out, mmd_engine * e, int format);
+void opendocument_flat_epilog(DString * out);
 DString * opendocument_text_create(const char * body, mmd_engine * e, const char * directory);
 
 #endif
@@ -1186,7 +1186,7 @@ static void yy_reduce(
         break;
       case 1: /* blocks ::= blocks block */
 {
-		strip_line_tokens_from_block(engine, yymsp[0].minor.yy0);
+		strip_line_tokens_after_children(engine, yymsp[0].minor.yy0);
 		if (yymsp[-1].minor.yy0 == NULL) { yymsp[-1].minor.yy0 = yymsp[0].minor.yy0; yymsp[0].minor.yy0 = NULL;}
 		yylhsminor.yy0 = yymsp[-1].minor.yy0;
 		token_chain_append(yylhsminor.yy0, yymsp[0].minor.yy0);
@@ -1199,7 +1199,7 @@ static void yy_reduce(
       case 2: /* blocks ::= block */
 {
 		engine->root = yymsp[0].minor.yy0;	// In case the first block is metadata and we just want to know if it exists
-		strip_line_tokens_from_block(engine, yymsp[0].minor.yy0);
+		strip_line_tokens_after_children(engine, yymsp[0].minor.yy0);
 		#ifndef NDEBUG
 		fprintf(stderr, "First block %d\n", yymsp[0].minor.yy0->type);
 		#endif
@@ -1286,11 +1286,11 @@ static void yy_reduce(
   yymsp[0].minor.yy0 = yylhsminor.yy0;
         break;
       case 24: /* block ::= list_bullet */
-{ yylhsminor.yy0 = token_new_parent(yymsp[0].minor.yy0, BLOCK_LIST_BULLETED); is_list_loose(yylhsminor.yy0); }
+{ yylhsminor.yy0 = token_new_parent(yymsp[0].minor.yy0, BLOCK_LIST_BULLETED); is_list_loose(engine, yylhsminor.yy0); }
   yymsp[0].minor.yy0 = yylhsminor.yy0;
         break;
       case 25: /* block ::= list_enum */
-{ yylhsminor.yy0 = token_new_parent(yymsp[0].minor.yy0, BLOCK_LIST_ENUMERATED); is_list_loose(yylhsminor.yy0); }
+{ yylhsminor.yy0 = token_new_parent(yymsp[0].minor.yy0, BLOCK_LIST_ENUMERATED); is_list_loose(engine, yylhsminor.yy0); }
   yymsp[0].minor.yy0 = yylhsminor.yy0;
         break;
       case 26: /* block ::= meta_block */
@@ -80,7 +80,7 @@ doc					::= blocks(B).								{ engine->root = B; }
 
 blocks(A)			::= blocks(B) block(C).
 	{
-		strip_line_tokens_from_block(engine, C);
+		strip_line_tokens_after_children(engine, C);
 		if (B == NULL) { B = C; C = NULL;}
 		A = B;
 		token_chain_append(A, C);
@@ -91,7 +91,7 @@ blocks(A)			::= blocks(B) block(C).
 blocks(A)			::= block(B).
 	{
 		engine->root = B;	// In case the first block is metadata and we just want to know if it exists
-		strip_line_tokens_from_block(engine, B);
+		strip_line_tokens_after_children(engine, B);
 		#ifndef NDEBUG
 		fprintf(stderr, "First block %d\n", B->type);
 		#endif
@@ -130,8 +130,8 @@ block(A)			::= fenced_block(B).		{ A = token_new_parent(B, BLOCK_CODE_FENCED); B
 block(A)			::= html_block(B).			{ A = token_new_parent(B, BLOCK_HTML); }
 block(A)			::= html_com_block(B).		{ A = token_new_parent(B, BLOCK_HTML); }
 block(A)			::= indented_code(B).		{ A = token_new_parent(B, BLOCK_CODE_INDENTED); }
-block(A)			::= list_bullet(B).			{ A = token_new_parent(B, BLOCK_LIST_BULLETED); is_list_loose(A); }
-block(A)			::= list_enum(B).			{ A = token_new_parent(B, BLOCK_LIST_ENUMERATED); is_list_loose(A); }
+block(A)			::= list_bullet(B).			{ A = token_new_parent(B, BLOCK_LIST_BULLETED); is_list_loose(engine, A); }
+block(A)			::= list_enum(B).			{ A = token_new_parent(B, BLOCK_LIST_ENUMERATED); is_list_loose(engine, A); }
 block(A)			::= meta_block(B).			{ A = token_new_parent(B, BLOCK_META); }
 block(A)			::= meta_block(B) LINE_SETEXT_2(C).	{ A = token_new_parent(B, BLOCK_META); token_append_child(A, C); }
 block(A)			::= para(B).				{ A = token_new_parent(B, BLOCK_PARA); is_para_html(engine, A); }
@@ -18,12 +18,18 @@
 /************ see the book for explanations and caveats! *******************/
 /************ in particular, you need two's complement arithmetic **********/
 
+/* Tweaked so that each thread has its own generator state */
+#include <stddef.h>
+
+#include "rng.h"
+#include "thread_local.h"
+
 #define KK 100                     /* the long lag */
 #define LL  37                     /* the short lag */
 #define MM (1L<<30)                 /* the modulus */
 #define mod_diff(x,y) (((x)-(y))&(MM-1)) /* subtraction mod MM */
 
-long ran_x[KK];                    /* the generator state */
+THREAD_LOCAL long ran_x[KK];       /* the generator state */
 
 #ifdef __STDC__
 	void ran_array(long aa[], int n)
@@ -56,9 +62,9 @@ long ran_x[KK];                    /* the generator state */
 /* after calling ran_start, get new randoms by, e.g., "x=ran_arr_next()" */
 
 #define QUALITY 1009 /* recommended quality level for high-res use */
-long ran_arr_buf[QUALITY];
-long ran_arr_dummy = -1, ran_arr_started = -1;
-long *ran_arr_ptr = &ran_arr_dummy; /* the next random number, or -1 */
+THREAD_LOCAL long ran_arr_buf[QUALITY];
+THREAD_LOCAL long ran_arr_started = -1;
+THREAD_LOCAL long *ran_arr_ptr = NULL; /* the next random number, or NULL/-1 */
 
 #define TT  70   /* guaranteed separation between streams */
 #define is_odd(x)  ((x)&1)          /* units bit of x */
@@ -125,9 +131,9 @@ long *ran_arr_ptr = &ran_arr_dummy; /* the next random number, or -1 */
 	ran_arr_ptr = &ran_arr_started;
 }
 
-#define ran_arr_next() (*ran_arr_ptr>=0? *ran_arr_ptr++: ran_arr_cycle())
+#define ran_arr_next() ((ran_arr_ptr && *ran_arr_ptr>=0)? *ran_arr_ptr++: ran_arr_cycle())
 long ran_arr_cycle() {
-	if (ran_arr_ptr == &ran_arr_dummy) {
+	if (ran_arr_ptr == NULL) {
 		ran_start(314159L);    /* the user forgot to initialize */
 	}
 
@@ -0,0 +1,34 @@
+/**
+
+	MultiMarkdown 6 -- Lightweight markup processor to produce HTML, LaTeX, and more.
+
+	@file rng.h
+
+	@brief Knuth's pseudo random number generator (rng.c), used to obfuscate
+	email addresses predictably.  Each thread has its own generator state.
+
+
+	@author	Fletcher T. Penney
+	@bug
+
+**/
+
+/*
+
+	Copyright © 2016 - 2017 Fletcher T. Penney.
+
+
+*/
+
+
+#ifndef RNG_MULTIMARKDOWN_H
+#define RNG_MULTIMARKDOWN_H
+
+/// Restart this thread's random numbers from `seed`
+void ran_start(long seed);
+
+/// Next random number on this thread (started from a fixed seed if
+/// ran_start() was not called)
+long ran_num_next();
+
+#endif
@@ -0,0 +1,192 @@
+/**
+
+	MultiMarkdown 6 -- Lightweight markup processor to produce HTML, LaTeX, and more.
+
+	@file stats.c
+
+	@brief Gather statistics on where the time goes while processing a document.
+	Only compiled in when USE_STATS is defined (`cmake -DSTATS=1`).
+
+
+	@author	Fletcher T. Penney
+	@bug
+
+**/
+
+/*
+
+	Copyright © 2016 - 2017 Fletcher T. Penney.
+
+
+	The `MultiMarkdown 6` project is released under the MIT License..
+
+	GLibFacade.c and GLibFacade.h are from the MultiMarkdown v4 project:
+
+		https://github.com/fletcher/MultiMarkdown-4/
+
+	MMD 4 is released under both the MIT License and GPL.
+
+
+	CuTest is released under the zlib/libpng license. See CuTest.c for the text
+	of the license.
+
+
+	## The MIT License ##
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in
+	all copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+	THE SOFTWARE.
+
+*/
+
+
+#include <string.h>
+#include <time.h>
+
+#include "mmd.h"
+#include "stats.h"
+#include "thread_local.h"
+
+
+#ifdef USE_STATS
+
+/// Collector in use on this thread
+static THREAD_LOCAL mmd_stats * active = NULL;
+
+
+mmd_stats * stats_active(void) {
+	return active;
+}
+
+
+void stats_add(mmd_stats * to, const mmd_stats * from) {
+	to->transclude_time += from->transclude_time;
+	to->tokenize_time += from->tokenize_time;
+	to->parse_time += from->parse_time;
+	to->pair_time += from->pair_time;
+	to->export_time += from->export_time;
+
+	to->tokens += from->tokens;
+	to->pool_slabs += from->pool_slabs;
+	to->pool_slabs_reused += from->pool_slabs_reused;
+	to->string_reallocs += from->string_reallocs;
+	to->string_realloc_bytes += from->string_realloc_bytes;
+
+	to->export_depth_hits += from->export_depth_hits;
+}
+
+
+/// Subtract `from` (an earlier copy of the same statistics) from `to`
+static void stats_subtract(mmd_stats * to, const mmd_stats * from) {
+	to->transclude_time -= from->transclude_time;
+	to->tokenize_time -= from->tokenize_time;
+	to->parse_time -= from->parse_time;
+	to->pair_time -= from->pair_time;
+	to->export_time -= from->export_time;
+
+	to->tokens -= from->tokens;
+	to->pool_slabs -= from->pool_slabs;
+	to->pool_slabs_reused -= from->pool_slabs_reused;
+	to->string_reallocs -= from->string_reallocs;
+	to->string_realloc_bytes -= from->string_realloc_bytes;
+
+	to->export_depth_hits -= from->export_depth_hits;
+}
+
+
+void stats_scope_begin(stats_scope * scope, mmd_stats * s) {
+	scope->stats = s;
+	scope->start = *s;
+	scope->previous = active;
+
+	memset(&scope->strings, 0, sizeof(d_string_stats));
+	scope->previous_strings = d_string_stats_set_active(&scope->strings);
+
+	active = s;
+}
+
+
+void stats_scope_end(stats_scope * scope) {
+	mmd_stats * s = scope->stats;
+
+	s->string_reallocs += scope->strings.reallocs;
+	s->string_realloc_bytes += scope->strings.realloc_bytes;
+
+	d_string_stats_set_active(scope->previous_strings);
+	active = scope->previous;
+
+	if (active && (active != s)) {
+		// Whoever was collecting before also gets what happened in this scope
+		mmd_stats delta = *s;
+		stats_subtract(&delta, &scope->start);
+		stats_add(active, &delta);
+	}
+}
+
+
+double stats_time(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+void stats_add_time(double * start, size_t offset) {
+	double now = stats_time();
+
+	if (active) {
+		*(double *)((char *) active + offset) += now - *start;
+	}
+
+	*start = now;
+}
+
+#endif
+
+
+/// Copy statistics gathered by engine since it was created
+bool mmd_engine_get_stats(mmd_engine * e, mmd_stats * result) {
+	#ifdef USE_STATS
+
+	if (e && result) {
+		*result = e->stats;
+		return true;
+	}
+
+	#endif
+
+	if (result) {
+		memset(result, 0, sizeof(mmd_stats));
+	}
+
+	return false;
+}
+
+
+/// Also gather statistics for work done on this thread into `s`
+mmd_stats * mmd_stats_set_active(mmd_stats * s) {
+	#ifdef USE_STATS
+	mmd_stats * previous = active;
+
+	active = s;
+
+	return previous;
+	#else
+	return NULL;
+	#endif
+}
@@ -0,0 +1,130 @@
+/**
+
+	MultiMarkdown 6 -- Lightweight markup processor to produce HTML, LaTeX, and more.
+
+	@file stats.h
+
+	@brief Gather statistics on where the time goes while processing a document.
+	Only compiled in when USE_STATS is defined (`cmake -DSTATS=1`).
+
+
+	@author	Fletcher T. Penney
+	@bug
+
+**/
+
+/*
+
+	Copyright © 2016 - 2017 Fletcher T. Penney.
+
+
+	The `MultiMarkdown 6` project is released under the MIT License..
+
+	GLibFacade.c and GLibFacade.h are from the MultiMarkdown v4 project:
+
+		https://github.com/fletcher/MultiMarkdown-4/
+
+	MMD 4 is released under both the MIT License and GPL.
+
+
+	CuTest is released under the zlib/libpng license. See CuTest.c for the text
+	of the license.
+
+
+	## The MIT License ##
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in
+	all copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+	THE SOFTWARE.
+
+*/
+
+
+
+#ifndef STATS_MULTIMARKDOWN_H
+#define STATS_MULTIMARKDOWN_H
+
+#include <stddef.h>
+
+#include "libMultiMarkdown.h"
+
+#ifdef USE_STATS
+
+#include "d_string.h"
+
+
+/// While a scope is open, statistics gathered on this thread go to `stats`.
+/// When it is closed, they are also added to the collector that was active
+/// before (e.g. the one set with mmd_stats_set_active()).
+typedef struct {
+	mmd_stats *			stats;
+	mmd_stats *			previous;			//!< Collector to restore
+	mmd_stats			start;				//!< Copy of `stats` when the scope was opened
+	d_string_stats		strings;			//!< DString buffers resized within the scope
+	d_string_stats *	previous_strings;
+} stats_scope;
+
+
+/// Send statistics on this thread to `s`
+void stats_scope_begin(
+	stats_scope * scope,
+	mmd_stats * s
+);
+
+
+/// Restore the previous collector
+void stats_scope_end(
+	stats_scope * scope
+);
+
+
+/// Collector in use on this thread (NULL if none)
+mmd_stats * stats_active(void);
+
+
+/// Add statistics from `from` (e.g. gathered by another thread) to `to`
+void stats_add(
+	mmd_stats * to,
+	const mmd_stats * from
+);
+
+
+/// Current time in seconds
+double stats_time(void);
+
+
+/// Add the time since `*start` to the field at `offset` of the active
+/// collector, then restart the timer
+void stats_add_time(
+	double * start,
+	size_t offset
+);
+
+
+#define stats_count(field)		do { mmd_stats * active_ = stats_active(); if (active_) { active_->field++; } } while (0)
+#define stats_timer(t)			double t = stats_time()
+#define stats_lap(t, field)		stats_add_time(&t, offsetof(mmd_stats, field))
+
+#else
+
+#define stats_count(field)
+#define stats_timer(t)
+#define stats_lap(t, field)
+
+#endif
+
+#endif
@@ -0,0 +1,32 @@
+/**
+
+	MultiMarkdown 6 -- Lightweight markup processor to produce HTML, LaTeX, and more.
+
+	@file thread_local.h
+
+	@brief Declare variables that have a separate copy on each thread.
+
+
+	@author	Fletcher T. Penney
+	@bug
+
+**/
+
+/*
+
+	Copyright © 2016 - 2017 Fletcher T. Penney.
+
+
+*/
+
+
+#ifndef THREAD_LOCAL_MULTIMARKDOWN_H
+#define THREAD_LOCAL_MULTIMARKDOWN_H
+
+#if defined(_MSC_VER)
+	#define THREAD_LOCAL __declspec(thread)
+#else
+	#define THREAD_LOCAL __thread
+#endif
+
+#endif
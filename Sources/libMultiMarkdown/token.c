@@ -59,7 +59,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#ifdef USE_PTHREADS
+	#include <pthread.h>
+#endif
+
 #include "char.h"
+#include "stats.h"
+#include "thread_local.h"
 #include "token.h"
 
 
@@ -69,17 +75,54 @@
 
 #include "object_pool.h"
 
-static pool * token_pool = NULL;		//!< Pointer to our object pool
+/// Each thread has its own default pool, so that separate threads never share
+/// (unsynchronized) pool state
+static THREAD_LOCAL pool * token_pool = NULL;		//!< Pointer to our object pool
 
 /// Count number of uses of this pool to allow us know
 /// when it's safe to drain the pool
-static short token_pool_count = 0;
+static THREAD_LOCAL short token_pool_count = 0;
+
+/// Pool that `token_new()` allocates from on this thread (e.g. the pool owned
+/// by the mmd_engine currently being processed). If NULL, the thread's default
+/// pool is used instead.
+static THREAD_LOCAL pool * token_pool_active = NULL;
+
+
+#ifdef USE_PTHREADS
+/// Frees a thread's default pool when the thread exits, in case
+/// token_pool_free() was never called on it
+static pthread_key_t token_pool_key;
+static pthread_once_t token_pool_key_once = PTHREAD_ONCE_INIT;
+
+
+static void token_pool_thread_exit(void * p) {
+	pool_free(p);
+}
+
+
+static void token_pool_key_create(void) {
+	pthread_key_create(&token_pool_key, token_pool_thread_exit);
+}
+#endif
+
+
+/// Create the default pool for this thread
+static void token_pool_create(void) {
+	token_pool = pool_new(sizeof(token));
+
+	#ifdef USE_PTHREADS
+	pthread_once(&token_pool_key_once, token_pool_key_create);
+	pthread_setspecific(token_pool_key, token_pool);
+	#endif
+}
+
 
 /// Intialize object pool for token allocation
 void token_pool_init(void) {
 	if (token_pool == NULL) {
 		// No pool exists
-		token_pool = pool_new(sizeof(token));
+		token_pool_create();
 	}
 
 	// Increment counter
@@ -101,6 +144,14 @@ void token_pool_drain(void) {
 /// Free token allocator pool
 void token_pool_free(void) {
 	if (token_pool_count == 0) {
+		#ifdef USE_PTHREADS
+
+		if (token_pool) {
+			pthread_setspecific(token_pool_key, NULL);
+		}
+
+		#endif
+
 		pool_free(token_pool);
 		token_pool = NULL;
 	} else {
@@ -108,6 +159,48 @@ void token_pool_free(void) {
 	}
 }
 
+
+/// Create a new, independent pool for token allocation (e.g. one per mmd_engine)
+pool * token_pool_new(void) {
+	return pool_new(sizeof(token));
+}
+
+
+/// Direct token allocation on the current thread to the specified pool.
+/// Returns the previously active pool so that it can be restored.
+pool * token_pool_set_active(pool * p) {
+	pool * previous = token_pool_active;
+
+	token_pool_active = p;
+
+	return previous;
+}
+
+
+/// Determine which pool to allocate from on the current thread
+static pool * token_pool_current(void) {
+	if (token_pool_active) {
+		return token_pool_active;
+	}
+
+	if (token_pool == NULL) {
+		// Nobody called token_pool_init() on this thread -- create default pool
+		// so that we don't crash.  It will be freed by token_pool_free(), or
+		// when the thread exits.
+		token_pool_create();
+	}
+
+	return token_pool;
+}
+
+
+/// Tokens created by another thread (e.g. while exporting part of the document)
+/// become the responsibility of the pool in use on this thread
+void token_pool_adopt(pool * donor) {
+	pool_adopt(token_pool_current(), donor);
+	pool_free(donor);
+}
+
 #endif
 
 
@@ -116,12 +209,14 @@ token * token_new(unsigned short type, size_t start, size_t len) {
 
 
 	#ifdef kUseObjectPool
-	token * t = pool_allocate_object(token_pool);
+	token * t = pool_allocate_object(token_pool_current());
 	#else
 	token * t = malloc(sizeof(token));
 	#endif
 
 	if (t) {
+		stats_count(tokens);
+
 		t->type = type;
 		t->start = start;
 		t->len = len;
@@ -146,7 +241,7 @@ token * token_new(unsigned short type, size_t start, size_t len) {
 /// Duplicate an existing token
 token * token_copy(token * original) {
 	#ifdef kUseObjectPool
-	token * t = pool_allocate_object(token_pool);
+	token * t = pool_allocate_object(token_pool_current());
 	#else
 	token * t = malloc(sizeof(token));
 	#endif
@@ -432,9 +527,9 @@ void print_token(token * t, unsigned short depth, const char * string) {
 		}
 
 		if (string == NULL) {
-			fprintf(stderr, "* (%d) %lu:%lu\n", t->type, t->start, t->len);
+			fprintf(stderr, "* (%d) %lu:%lu\n", t->type, (unsigned long) t->start, (unsigned long) t->len);
 		} else {
-			fprintf(stderr, "* (%d) %lu:%lu\t'%.*s'\n", t->type, t->start, t->len, (int)t->len, &string[t->start]);
+			fprintf(stderr, "* (%d) %lu:%lu\t'%.*s'\n", t->type, (unsigned long) t->start, (unsigned long) t->len, (int)t->len, &string[t->start]);
 		}
 
 		if (t->child != NULL) {
@@ -65,21 +65,8 @@
 
 /// Create a new token pair engine
 token_pair_engine * token_pair_engine_new(void) {
-	token_pair_engine * e = malloc(sizeof(token_pair_engine));
-
-	if (e) {
-		unsigned short empty[kMaxTokenTypes] = {0};
-		unsigned short empty2[kMaxTokenTypes][kMaxTokenTypes] = {{0}};
-
-		memcpy(e->can_open_pair, empty, sizeof(unsigned short) * kMaxTokenTypes);
-		memcpy(e->can_close_pair, empty, sizeof(unsigned short) * kMaxTokenTypes);
-
-		memcpy(e->pair_type, empty2, sizeof(unsigned short) * kMaxTokenTypes * kMaxTokenTypes);
-
-		memcpy(e->empty_allowed, empty, sizeof(unsigned short) * kMaxTokenTypes);
-		memcpy(e->match_len, empty, sizeof(unsigned short) * kMaxTokenTypes);
-		memcpy(e->should_prune, empty, sizeof(unsigned short) * kMaxTokenTypes);
-	}
+	// Start with all pairings disabled
+	token_pair_engine * e = calloc(1, sizeof(token_pair_engine));
 
 	return e;
 }
@@ -98,26 +85,99 @@ void token_pair_engine_free(token_pair_engine * e) {
 /// Add a new pairing configuration to a token pair engine
 void token_pair_engine_add_pairing(token_pair_engine * e, unsigned short open_type, unsigned short close_type,
 								   unsigned short pair_type, int options) {
-	// \todo: This needs to be more sophisticated
-	e->can_open_pair[open_type] = 1;
-	e->can_close_pair[close_type] = 1;
-	(e->pair_type)[open_type][close_type] = pair_type;
+	size_t i;
 
-	if (options & PAIRING_ALLOW_EMPTY) {
-		e->empty_allowed[pair_type] = true;
+	// Replace existing pairing for this opener/closer?
+	for (i = e->first_pairing[open_type]; i < e->first_pairing[open_type + 1]; ++i) {
+		if (e->pairings[i].closer == close_type) {
+			e->pairings[i].pair_type = pair_type;
+			goto options;
+		}
+	}
+
+	if (e->pairing_count == kMaxPairings) {
+		fprintf(stderr, "ERROR: Too many pairings added to token pair engine.\n");
+		return;
 	}
 
-	if (options & PAIRING_MATCH_LENGTH) {
-		e->match_len[pair_type] = true;
+	// Insert new pairing after any others with the same opener (keep sorted)
+	i = e->first_pairing[open_type + 1];
+
+	memmove(&e->pairings[i + 1], &e->pairings[i], sizeof(struct token_pairing) * (e->pairing_count - i));
+
+	e->pairings[i].opener = open_type;
+	e->pairings[i].closer = close_type;
+	e->pairings[i].pair_type = pair_type;
+
+	e->pairing_count++;
+
+	// Shift index for subsequent opener types
+	for (i = open_type + 1; i <= kMaxTokenTypes; ++i) {
+		e->first_pairing[i]++;
 	}
 
-	if (options & PAIRING_PRUNE_MATCH) {
-		e->should_prune[pair_type] = true;
+options:
+	e->flags[open_type] |= PAIRING_CAN_OPEN;
+	e->flags[close_type] |= PAIRING_CAN_CLOSE;
+
+	e->flags[pair_type] |= options & (PAIRING_ALLOW_EMPTY | PAIRING_MATCH_LENGTH | PAIRING_PRUNE_MATCH);
+}
+
+
+/// Which pair type (if any) is formed by this opener and closer?
+static inline unsigned short token_pair_type(const token_pair_engine * e, unsigned short open_type, unsigned short close_type) {
+	for (size_t i = e->first_pairing[open_type]; i < e->first_pairing[open_type + 1]; ++i) {
+		if (e->pairings[i].closer == close_type) {
+			return e->pairings[i].pair_type;
+		}
 	}
 
+	return 0;
 }
 
 
+#ifdef TEST
+void Test_token_pair_engine(CuTest* tc) {
+	token_pair_engine * e = token_pair_engine_new();
+
+	token_pair_engine_add_pairing(e, 5, 6, 100, PAIRING_ALLOW_EMPTY);
+	token_pair_engine_add_pairing(e, 3, 6, 101, PAIRING_PRUNE_MATCH);
+	token_pair_engine_add_pairing(e, 5, 5, 102, 0);
+	token_pair_engine_add_pairing(e, 9, 6, 103, PAIRING_MATCH_LENGTH);
+
+	CuAssertIntEquals(tc, 4, e->pairing_count);
+
+	CuAssertIntEquals(tc, 100, token_pair_type(e, 5, 6));
+	CuAssertIntEquals(tc, 101, token_pair_type(e, 3, 6));
+	CuAssertIntEquals(tc, 102, token_pair_type(e, 5, 5));
+	CuAssertIntEquals(tc, 103, token_pair_type(e, 9, 6));
+	CuAssertIntEquals(tc, 0, token_pair_type(e, 6, 5));
+	CuAssertIntEquals(tc, 0, token_pair_type(e, 3, 5));
+
+	// Pairings are sorted by opener
+	CuAssertIntEquals(tc, 3, e->pairings[0].opener);
+	CuAssertIntEquals(tc, 9, e->pairings[3].opener);
+
+	CuAssertTrue(tc, e->flags[5] & PAIRING_CAN_OPEN);
+	CuAssertTrue(tc, e->flags[5] & PAIRING_CAN_CLOSE);
+	CuAssertTrue(tc, !(e->flags[6] & PAIRING_CAN_OPEN));
+	CuAssertTrue(tc, e->flags[6] & PAIRING_CAN_CLOSE);
+
+	CuAssertTrue(tc, e->flags[100] & PAIRING_ALLOW_EMPTY);
+	CuAssertTrue(tc, e->flags[101] & PAIRING_PRUNE_MATCH);
+	CuAssertTrue(tc, e->flags[103] & PAIRING_MATCH_LENGTH);
+	CuAssertTrue(tc, !(e->flags[102] & PAIRING_ALLOW_EMPTY));
+
+	// Replace existing pairing
+	token_pair_engine_add_pairing(e, 3, 6, 104, 0);
+	CuAssertIntEquals(tc, 4, e->pairing_count);
+	CuAssertIntEquals(tc, 104, token_pair_type(e, 3, 6));
+
+	token_pair_engine_free(e);
+}
+#endif
+
+
 /// Mate opener and closer together
 void token_pair_mate(token * a, token * b) {
 	if (a == NULL | b  == NULL) {
@@ -132,44 +192,126 @@ void token_pair_mate(token * a, token * b) {
 }
 
 
-/// Search a token's childen for matching pairs
-void token_pairs_match_pairs_inside_token(token * parent, token_pair_engine * e, stack * s, unsigned short depth) {
+/// Pairing state for one token whose children are being searched
+typedef struct {
+	token *			parent;
+	token *			walker;				//!< Next child to check
+	bool			descended;			//!< Children of `walker` have been searched
+	size_t			start_counter;		//!< Openers below this belong to a parent
+	unsigned int *	opener_count;		//!< Which token types are on the stack (counted once the stack is large)
+} pair_frame;
 
-	// Avoid stack overflow in "pathologic" input
-	if (depth == kMaxPairRecursiveDepth) {
-		return;
+#define kPairFramesOnStack 32			//!< Frames kept on the C stack before moving to the heap
+
+
+/// Start searching the children of `parent` -- returns false if out of memory
+static bool pair_frame_push(pair_frame ** frames, size_t * depth, size_t * allocated, pair_frame * local, token * parent, stack * s) {
+	if (*depth == *allocated) {
+		pair_frame * grown = malloc(sizeof(pair_frame) * *allocated * 2);
+
+		if (grown == NULL) {
+			return false;
+		}
+
+		memcpy(grown, *frames, sizeof(pair_frame) * *depth);
+
+		if (*frames != local) {
+			free(*frames);
+		}
+
+		*frames = grown;
+		*allocated *= 2;
 	}
 
-	// Walk the child chain
-	token * walker = parent->child;
+	pair_frame * f = &(*frames)[(*depth)++];
+
+	f->parent = parent;
+	f->walker = parent->child;
+	f->descended = false;
+	f->start_counter = s->size;
+	f->opener_count = NULL;
+
+	return true;
+}
+
+
+/// Count token types of the openers on the stack that belong to frame `f`
+static void pair_frame_count_openers(pair_frame * f, stack * s) {
+	f->opener_count = calloc(kMaxTokenTypes, sizeof(unsigned int));
+
+	if (f->opener_count) {
+		for (size_t i = f->start_counter; i < s->size; ++i) {
+			f->opener_count[((token *) stack_peek_index(s, i))->type]++;
+		}
+	}
+}
+
+
+/// Search a token's childen for matching pairs
+///
+/// Children are searched before their parent continues, as if recursing, but
+/// the state for each level is kept in `frames` so that deeply nested tokens
+/// don't use up the C stack.
+void token_pairs_match_pairs_inside_token(token * parent, token_pair_engine * e, stack * s) {
+	pair_frame local[kPairFramesOnStack];
+	pair_frame * frames = local;
+	size_t allocated = kPairFramesOnStack;
+	size_t depth = 0;
+
+	pair_frame * f;
+	token * walker;
 
-	// Counter
-	size_t start_counter = s->size;
 	size_t i;				// We're sharing one stack, so any opener earlier than this belongs to a parent
 
 	token * peek;
 	unsigned short pair_type;
 
-	unsigned int opener_count[kMaxTokenTypes] = {0};	// Keep track of which token types are on the stack
+	pair_frame_push(&frames, &depth, &allocated, local, parent, s);
+
+	while (depth > 0) {
+		f = &frames[depth - 1];
+		walker = f->walker;
 
-	while (walker != NULL) {
+		if (walker == NULL) {
+			#ifndef NDEBUG
+			fprintf(stderr, "token stack has %lu elements (of %lu)\n", s->size, s->capacity);
+			#endif
 
-		if (walker->child) {
-			token_pairs_match_pairs_inside_token(walker, e, s, depth + 1);
+			// Remove unused tokens from stack and return to parent
+			s->size = f->start_counter;
+			free(f->opener_count);
+			depth--;
+			continue;
+		}
+
+		if (walker->child && !f->descended) {
+			// Search children first, then come back to this token
+			if (pair_frame_push(&frames, &depth, &allocated, local, walker, s)) {
+				frames[depth - 2].descended = true;
+				continue;
+			}
 		}
 
+		f->descended = false;
+
 		// Is this a closer?
-		if (walker->can_close && e->can_close_pair[walker->type] && walker->unmatched ) {
+		if (walker->can_close && (e->flags[walker->type] & PAIRING_CAN_CLOSE) && walker->unmatched ) {
 			i = s->size;
 
 			// Do we even have a valid opener in the stack?
 			// It's only worth checking if the stack is beyond a certain size
-			if (i > start_counter + kLargeStackThreshold) {
-				for (int j = 0; j < kMaxTokenTypes; ++j) {
-					if (opener_count[j]) {
-						if (e->pair_type[j][walker->type]) {
-							goto close;
-						}
+			if (i > f->start_counter + kLargeStackThreshold) {
+				if (f->opener_count == NULL) {
+					pair_frame_count_openers(f, s);
+				}
+
+				if (f->opener_count == NULL) {
+					goto close;
+				}
+
+				for (int j = 0; j < e->pairing_count; ++j) {
+					if ((e->pairings[j].closer == walker->type) && f->opener_count[e->pairings[j].opener]) {
+						goto close;
 					}
 				}
 
@@ -180,23 +322,23 @@ void token_pairs_match_pairs_inside_token(token * parent, token_pair_engine * e,
 close:
 
 			// Find matching opener for this closer
-			while (i > start_counter) {
+			while (i > f->start_counter) {
 				peek = stack_peek_index(s, i - 1);
 
-				pair_type = e->pair_type[peek->type][walker->type];
+				pair_type = token_pair_type(e, peek->type, walker->type);
 
 				if (pair_type) {
-					if (!e->empty_allowed[pair_type]) {
+					if (!(e->flags[pair_type] & PAIRING_ALLOW_EMPTY)) {
 						// Make sure they aren't consecutive tokens
 						if ((peek->next == walker) &&
 								(peek->start + peek->len == walker->start)) {
 							// i--;
-							i = start_counter;	// In this situation, we can't use this token as a closer
+							i = f->start_counter;	// In this situation, we can't use this token as a closer
 							continue;
 						}
 					}
 
-					if (e->match_len[pair_type]) {
+					if (e->flags[pair_type] & PAIRING_MATCH_LENGTH) {
 						// Lengths must match
 						if (peek->len != walker->len) {
 							i--;
@@ -210,7 +352,10 @@ close:
 					// Clear portion of stack between opener and closer as they are now unavailable for mating
 					while (s->size > (i - 1)) {
 						peek = stack_pop(s);
-						opener_count[peek->type]--;
+
+						if (f->opener_count) {
+							f->opener_count[peek->type]--;
+						}
 					}
 
 					#ifndef NDEBUG
@@ -218,12 +363,12 @@ close:
 					#endif
 					// Prune matched section
 
-					if (e->should_prune[pair_type]) {
+					if (e->flags[pair_type] & PAIRING_PRUNE_MATCH) {
 						if (peek->prev == NULL) {
-							walker = token_prune_graft(peek, walker, e->pair_type[peek->type][walker->type]);
-							parent->child = walker;
+							walker = token_prune_graft(peek, walker, pair_type);
+							f->parent->child = walker;
 						} else {
-							walker = token_prune_graft(peek, walker, e->pair_type[peek->type][walker->type]);
+							walker = token_prune_graft(peek, walker, pair_type);
 						}
 					}
 
@@ -243,21 +388,21 @@ close:
 open:
 
 		// Is this an opener?
-		if (walker->can_open && e->can_open_pair[walker->type] && walker->unmatched) {
+		if (walker->can_open && (e->flags[walker->type] & PAIRING_CAN_OPEN) && walker->unmatched) {
 			stack_push(s, walker);
-			opener_count[walker->type]++;
+
+			if (f->opener_count) {
+				f->opener_count[walker->type]++;
+			}
 			#ifndef NDEBUG
 			fprintf(stderr, "push token type %d to stack (%lu elements)\n", walker->type, s->size);
 			#endif
 		}
 
-		walker = walker->next;
+		f->walker = walker->next;
 	}
 
-	#ifndef NDEBUG
-	fprintf(stderr, "token stack has %lu elements (of %lu)\n", s->size, s->capacity);
-	#endif
-
-	// Remove unused tokens from stack and return to parent
-	s->size = start_counter;
+	if (frames != local) {
+		free(frames);
+	}
 }
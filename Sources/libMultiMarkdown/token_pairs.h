@@ -67,20 +67,32 @@
 
 #define kMaxTokenTypes	230				//!< This needs to be larger than the largest token type being used
 #define kLargeStackThreshold 1000		//!< Avoid unnecessary searches of large stacks
-#define kMaxPairRecursiveDepth 1000		//!< Maximum recursion depth to traverse when pairing tokens -- to prevent stack overflow with "pathologic" input
+
+
+#define kMaxPairings 64					//!< Maximum number of pairings that can be added to one engine
+
+
+/// A single opener/closer combination
+struct token_pairing {
+	unsigned short		opener;			//!< Token type for opener
+	unsigned short		closer;			//!< Token type for closer
+	unsigned short		pair_type;		//!< Which pair are we forming?
+};
 
 
 /// Store information about which tokens can be paired, and what actions to take when
 /// pairing them.
+///
+/// Only a few dozen combinations are ever registered, so rather than a dense
+/// opener x closer matrix we keep a short list of pairings sorted by opener,
+/// plus an index to the first pairing for each opener type.  The whole engine
+/// fits in well under 1 KB.
 struct token_pair_engine {
-	unsigned short		can_open_pair[kMaxTokenTypes];				//!< Can token type open a pair?
-	unsigned short		can_close_pair[kMaxTokenTypes];				//!< Can token type close a pair?
-
-	unsigned short		pair_type[kMaxTokenTypes][kMaxTokenTypes];	//!< Which pair are we forming?
+	unsigned char		flags[kMaxTokenTypes];				//!< PAIRING_CAN_OPEN/PAIRING_CAN_CLOSE for token types, pairing options for pair types
+	unsigned char		first_pairing[kMaxTokenTypes + 1];	//!< Index of first entry in `pairings` for each opener type
 
-	unsigned short		empty_allowed[kMaxTokenTypes];				//!< Is this pair type allowed to be empty?
-	unsigned short		match_len[kMaxTokenTypes];					//!< Does this pair type require matched lengths of openers/closers?
-	unsigned short		should_prune[kMaxTokenTypes];				//!< Does this pair type need to be pruned to a child token chain?
+	unsigned short		pairing_count;						//!< Number of pairings in use
+	struct token_pairing	pairings[kMaxPairings];			//!< Pairings, sorted by opener type
 };
 
 typedef struct token_pair_engine token_pair_engine;
@@ -91,6 +103,9 @@ enum pairings_options {
 	PAIRING_ALLOW_EMPTY		= 1 << 0,		//!< Allow consecutive tokens to match with each other
 	PAIRING_MATCH_LENGTH	= 1 << 1,		//!< Require that opening/closing tokens be same length
 	PAIRING_PRUNE_MATCH		= 1 << 2,		//!< Move the matched sub-chain into a child chain
+
+	PAIRING_CAN_OPEN		= 1 << 3,		//!< Token type can open a pair (internal use)
+	PAIRING_CAN_CLOSE		= 1 << 4,		//!< Token type can close a pair (internal use)
 };
 
 
@@ -115,8 +130,7 @@ void token_pair_engine_add_pairing(
 void token_pairs_match_pairs_inside_token(
 	token * parent,							//!< Which tokens should we search for pairs
 	token_pair_engine * e,					//!< Token pair engine to be used for matching
-	stack * s,								//!< Pointer to a stack to use for pairing tokens
-	unsigned short depth					//!< Keep track of recursion depth
+	stack * s								//!< Pointer to a stack to use for pairing tokens
 );
 
 
@@ -54,11 +54,27 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <sys/stat.h>
+
+#ifdef USE_PTHREADS
+	#include <pthread.h>
+#endif
 
 #include "d_string.h"
 #include "file.h"
 #include "libMultiMarkdown.h"
+#include "stats.h"
+#include "thread_local.h"
 #include "transclude.h"
+#include "uthash.h"
+
+#if defined(__APPLE__)
+	#define mtime_nsec(st) ((st).st_mtimespec.tv_nsec)
+#elif defined(_WIN32)
+	#define mtime_nsec(st) 0
+#else
+	#define mtime_nsec(st) ((st).st_mtim.tv_nsec)
+#endif
 
 
 /// strdup() not available on all platforms
@@ -73,6 +89,171 @@ static char * my_strdup(const char * source) {
 }
 
 
+/// A file read during transclusion
+typedef struct cached_file {
+	char *				path;			//!< Absolute path (hash key)
+	time_t				mtime;
+	long				mtime_nsec;
+	long long			size;
+	char *				text;
+	size_t				len;
+	UT_hash_handle		hh;
+} cached_file;
+
+
+struct mmd_transclusion_cache {
+	cached_file *		files;
+
+	#ifdef USE_PTHREADS
+	pthread_mutex_t		lock;
+	#endif
+};
+
+
+/// Cache used by mmd_transclude_source() on this thread
+static THREAD_LOCAL mmd_transclusion_cache * cache_active = NULL;
+
+
+mmd_transclusion_cache * mmd_transclusion_cache_new(void) {
+	mmd_transclusion_cache * c = malloc(sizeof(mmd_transclusion_cache));
+
+	if (c) {
+		c->files = NULL;
+
+		#ifdef USE_PTHREADS
+		pthread_mutex_init(&c->lock, NULL);
+		#endif
+	}
+
+	return c;
+}
+
+
+static void cached_file_free(cached_file * f) {
+	free(f->path);
+	free(f->text);
+	free(f);
+}
+
+
+void mmd_transclusion_cache_free(mmd_transclusion_cache * c) {
+	if (c == NULL) {
+		return;
+	}
+
+	cached_file * f, * tmp;
+
+	HASH_ITER(hh, c->files, f, tmp) {
+		HASH_DEL(c->files, f);
+		cached_file_free(f);
+	}
+
+	#ifdef USE_PTHREADS
+	pthread_mutex_destroy(&c->lock);
+	#endif
+
+	free(c);
+}
+
+
+mmd_transclusion_cache * mmd_transclusion_cache_set_active(mmd_transclusion_cache * c) {
+	mmd_transclusion_cache * previous = cache_active;
+
+	cache_active = c;
+
+	return previous;
+}
+
+
+/// Read file to be transcluded, from the active cache if it hasn't changed
+static DString * transclusion_read_file(const char * fname) {
+	mmd_transclusion_cache * c = cache_active;
+	struct stat st;
+
+	if ((c == NULL) || (stat(fname, &st) != 0)) {
+		return scan_file(fname);
+	}
+
+	char * path = realpath(fname, NULL);
+
+	if (path == NULL) {
+		return scan_file(fname);
+	}
+
+	DString * result = NULL;
+	cached_file * f;
+
+	#ifdef USE_PTHREADS
+	pthread_mutex_lock(&c->lock);
+	#endif
+
+	HASH_FIND_STR(c->files, path, f);
+
+	if (f && (f->mtime == st.st_mtime) && (f->mtime_nsec == mtime_nsec(st)) && (f->size == st.st_size)) {
+		result = d_string_new("");
+		d_string_append_c_array(result, f->text, f->len);
+	}
+
+	#ifdef USE_PTHREADS
+	pthread_mutex_unlock(&c->lock);
+	#endif
+
+	if (result) {
+		free(path);
+		return result;
+	}
+
+	// Not cached (or changed), so read it and keep a copy
+	result = scan_file(fname);
+
+	if (result == NULL) {
+		free(path);
+		return NULL;
+	}
+
+	cached_file * fresh = malloc(sizeof(cached_file));
+
+	if (fresh) {
+		fresh->path = path;
+		fresh->mtime = st.st_mtime;
+		fresh->mtime_nsec = mtime_nsec(st);
+		fresh->size = st.st_size;
+		fresh->len = result->currentStringLength;
+		fresh->text = malloc(fresh->len + 1);
+
+		if (fresh->text == NULL) {
+			free(fresh);
+			free(path);
+			return result;
+		}
+
+		memcpy(fresh->text, result->str, fresh->len + 1);
+
+		#ifdef USE_PTHREADS
+		pthread_mutex_lock(&c->lock);
+		#endif
+
+		// Another thread may have read it in the meantime
+		HASH_FIND_STR(c->files, path, f);
+
+		if (f) {
+			HASH_DEL(c->files, f);
+			cached_file_free(f);
+		}
+
+		HASH_ADD_KEYPTR(hh, c->files, fresh->path, strlen(fresh->path), fresh);
+
+		#ifdef USE_PTHREADS
+		pthread_mutex_unlock(&c->lock);
+		#endif
+	} else {
+		free(path);
+	}
+
+	return result;
+}
+
+
 /// Recursively transclude source text, given a search directory.
 /// Track files to prevent infinite recursive loops
 void mmd_transclude_source(DString * source, const char * search_path, const char * source_path, short format, stack * parsed, stack * manifest) {
@@ -94,6 +275,23 @@ void mmd_transclude_source(DString * source, const char * search_path, const cha
 	size_t offset = 0;
 	size_t last_match;
 
+	// Expanded text is assembled here in a single pass, rather than shifting
+	// the rest of the source for every file inserted (NULL until needed)
+	DString * result = NULL;
+	size_t copied = 0;				//!< Source up to here has been added to result
+
+	#ifdef USE_STATS
+	// Count the outermost call (nested ones are included in its time)
+	stats_scope scope;
+	mmd_stats * stats = (parsed == NULL) ? stats_active() : NULL;
+
+	if (stats) {
+		stats_scope_begin(&scope, stats);
+	}
+	#endif
+
+	stats_timer(transclude_start);
+
 	mmd_engine * e = mmd_engine_create_with_dstring(source, EXT_TRANSCLUDE);
 
 	if (mmd_engine_has_metadata(e, &offset)) {
@@ -232,31 +430,35 @@ void mmd_transclude_source(DString * source, const char * search_path, const cha
 			}
 
 			// Read the file
-			buffer = scan_file(file_path->str);
+			buffer = transclusion_read_file(file_path->str);
 
 			// Substitue buffer for transclusion token
 			if (buffer) {
-				// Erase transclusion token from current source
-				d_string_erase(source, start - source->str, 2 + stop - start);
+				if (result == NULL) {
+					result = d_string_new("");
+					d_string_reserve(result, source->currentStringLength);
+				}
+
+				// Copy source text preceding the transclusion token
+				d_string_append_c_array(result, &source->str[copied], last_match - copied);
 
 				// Recursively check this file for transclusions
 				mmd_transclude_source(buffer, search_folder, file_path->str, format, parse_stack, manifest);
 
-				// Strip metadata from buffer now that we have parsed it
+				// Skip metadata in buffer now that we have parsed it
 				e = mmd_engine_create_with_dstring(buffer, EXT_TRANSCLUDE);
 
-				if (mmd_engine_has_metadata(e, &offset)) {
-					d_string_erase(buffer, 0, offset);
+				if (!mmd_engine_has_metadata(e, &offset)) {
+					offset = 0;
 				}
 
 				mmd_engine_free(e, false);
 
-				// Insert file text -- this may cause d_string to reallocate the
-				// character buffer, meaning start/stop are no longer valid
-				d_string_insert(source, start - source->str, buffer->str);
+				d_string_append_c_array(result, &buffer->str[offset], buffer->currentStringLength - offset);
 
-				// Shift search point
-				last_match += buffer->currentStringLength;
+				// Continue after the transclusion token
+				copied = stop + 2 - source->str;
+				last_match = copied;
 
 				d_string_free(buffer, true);
 			} else {
@@ -279,6 +481,17 @@ finish_file:
 		start = strstr(source->str + last_match, "{{");
 	}
 
+	if (result) {
+		// Add remaining source text, then replace source with the result
+		d_string_append_c_array(result, &source->str[copied], source->currentStringLength - copied);
+
+		DString swap = *source;
+		*source = *result;
+		*result = swap;
+
+		d_string_free(result, true);
+	}
+
 exit:
 
 	if (parsed == NULL) {
@@ -290,6 +503,13 @@ exit:
 	}
 
 	free(search_folder);
+
+	#ifdef USE_STATS
+	if (stats) {
+		stats_lap(transclude_start, transclude_time);
+		stats_scope_end(&scope);
+	}
+	#endif
 }
 
 
@@ -53,10 +53,15 @@
 */
 
 #include <ctype.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef USE_PTHREADS
+	#include <pthread.h>
+#endif
+
 #include "libMultiMarkdown.h"
 
 #include "aho-corasick.h"
@@ -71,10 +76,15 @@
 #include "opendocument-content.h"
 #include "parser.h"
 #include "scanners.h"
+#include "stats.h"
 #include "token.h"
 #include "uuid.h"
 #include "writer.h"
 
+#ifdef TEST
+	#include "CuTest.h"
+#endif
+
 
 void store_citation(scratch_pad * scratch, footnote * f);
 
@@ -135,6 +145,36 @@ static char * my_strdup(const char * source) {
 }
 
 
+#ifdef USE_PTHREADS
+static pthread_mutex_t random_lock = PTHREAD_MUTEX_INITIALIZER;	//!< rand() isn't thread safe everywhere
+#endif
+
+
+/// Choose the arrangement of footnote anchors for a document (EXT_RANDOM_FOOT)
+static int random_seed_base_new(void) {
+	#ifdef USE_PTHREADS
+	pthread_mutex_lock(&random_lock);
+	#endif
+
+	int base = rand() % 32000;
+
+	#ifdef USE_PTHREADS
+	pthread_mutex_unlock(&random_lock);
+	#endif
+
+	return base;
+}
+
+
+/// Number used in anchors for footnote `note` with EXT_RANDOM_FOOT.  Depends
+/// only on the scratch pad, so notes in one document never share an anchor,
+/// and documents exported on separate threads don't affect each other.
+int random_footnote_id(scratch_pad * scratch, int note) {
+	// Multiplying by an odd number rearranges 0 to 32767
+	return (((note * 23505) + scratch->random_seed_base) & 0x7fff) + 1;
+}
+
+
 /// Temporary storage while exporting parse tree to output format
 scratch_pad * scratch_pad_new(mmd_engine * e, short format) {
 	scratch_pad * p = malloc(sizeof(scratch_pad));
@@ -147,6 +187,9 @@ scratch_pad * scratch_pad_new(mmd_engine * e, short format) {
 
 		p->extensions = e->extensions;
 		p->output_format = format;
+
+		p->sink = NULL;
+		p->threads = e->threads;
 		p->quotes_lang = e->quotes_lang;
 		p->language = e->language;
 
@@ -155,13 +198,16 @@ scratch_pad * scratch_pad_new(mmd_engine * e, short format) {
 		p->outline_stack = stack_new(0);
 
 		p->recurse_depth = 0;
+		p->stack_depth = 0;
+		p->root = e->root;
+		p->tree_depth = 0;
 
 		p->base_header_level = 1;
 
 		p->odf_para_type = BLOCK_PARA;
 
 		if (e->extensions & EXT_RANDOM_FOOT) {
-			p->random_seed_base = rand() % 32000;
+			p->random_seed_base = random_seed_base_new();
 		} else {
 			p->random_seed_base = 0;
 		}
@@ -1697,8 +1743,22 @@ void process_metadata_stack(mmd_engine * e, scratch_pad * scratch) {
 }
 
 
-void automatic_search_text(mmd_engine * e, token * t, trie * ac) {
-	match * m = ac_trie_leftmost_longest_search(ac, e->dstr->str, t->start, t->len);
+/// Abbreviations and glossary terms to search for -- the compact automaton, or
+/// the trie it is built from if there wasn't memory for the automaton
+typedef struct {
+	ac_automaton *		automaton;
+	trie *				trie;
+} search_terms;
+
+
+void automatic_search_text(mmd_engine * e, token * t, search_terms * terms) {
+	match * m;
+
+	if (terms->automaton) {
+		m = ac_automaton_leftmost_longest_search(terms->automaton, e->dstr->str, t->start, t->len);
+	} else {
+		m = ac_trie_leftmost_longest_search(terms->trie, e->dstr->str, t->start, t->len);
+	}
 
 	match * walker;
 
@@ -1725,64 +1785,110 @@ void automatic_search_text(mmd_engine * e, token * t, trie * ac) {
 
 
 /// Determine which nodes to descend into to search for abbreviations
-void automatic_search(mmd_engine * e, token * t, trie * ac) {
-	while (t) {
-		switch (t->type) {
-			case TEXT_PLAIN:
-				automatic_search_text(e, t, ac);
-				break;
+static bool automatic_search_descends(token * t) {
+	switch (t->type) {
+		case DOC_START_TOKEN:
+		case BLOCK_BLOCKQUOTE:
+		case BLOCK_DEFINITION:
+		case BLOCK_DEFLIST:
+		case BLOCK_LIST_BULLETED:
+		case BLOCK_LIST_BULLETED_LOOSE:
+		case BLOCK_LIST_ENUMERATED:
+		case BLOCK_LIST_ENUMERATED_LOOSE:
+		case BLOCK_LIST_ITEM_TIGHT:
+		case BLOCK_LIST_ITEM:
+		case BLOCK_PARA:
+		case BLOCK_TABLE:
+		case BLOCK_TABLE_HEADER:
+		case BLOCK_TABLE_SECTION:
+		case BLOCK_TERM:
+		case LINE_LIST_BULLETED:
+		case LINE_LIST_ENUMERATED:
+		case PAIR_BRACKET:
+		case PAIR_BRACKET_FOOTNOTE:
+		case PAIR_BRACKET_GLOSSARY:
+		case PAIR_BRACKET_IMAGE:
+		case PAIR_QUOTE_DOUBLE:
+		case PAIR_QUOTE_SINGLE:
+		case PAIR_STAR:
+		case PAIR_UL:
+		case TABLE_CELL:
+		case TABLE_ROW:
+			return true;
 
-			case DOC_START_TOKEN:
-			case BLOCK_BLOCKQUOTE:
-			case BLOCK_DEFINITION:
-			case BLOCK_DEFLIST:
-			case BLOCK_LIST_BULLETED:
-			case BLOCK_LIST_BULLETED_LOOSE:
-			case BLOCK_LIST_ENUMERATED:
-			case BLOCK_LIST_ENUMERATED_LOOSE:
-			case BLOCK_LIST_ITEM_TIGHT:
-			case BLOCK_LIST_ITEM:
-			case BLOCK_PARA:
-			case BLOCK_TABLE:
-			case BLOCK_TABLE_HEADER:
-			case BLOCK_TABLE_SECTION:
-			case BLOCK_TERM:
-			case LINE_LIST_BULLETED:
-			case LINE_LIST_ENUMERATED:
-			case PAIR_BRACKET:
-			case PAIR_BRACKET_FOOTNOTE:
-			case PAIR_BRACKET_GLOSSARY:
-			case PAIR_BRACKET_IMAGE:
-			case PAIR_QUOTE_DOUBLE:
-			case PAIR_QUOTE_SINGLE:
-			case PAIR_STAR:
-			case PAIR_UL:
-			case TABLE_CELL:
-			case TABLE_ROW:
-				automatic_search(e, t->child, ac);
-				break;
+//		case PAIR_PAREN:
+		default:
+			return false;
+	}
+}
 
-//			case PAIR_PAREN:
-			default:
+
+/// Search a chain of tokens, and the tokens inside them
+void automatic_search(mmd_engine * e, token * t, search_terms * terms) {
+	stack * parents = NULL;			// Tokens whose children are being searched
+
+	while (true) {
+		if (t == NULL) {
+			if ((parents == NULL) || (parents->size == 0)) {
 				break;
+			}
+
+			t = stack_pop(parents);
+			t = t->next;
+			continue;
+		}
+
+		if (t->type == TEXT_PLAIN) {
+			automatic_search_text(e, t, terms);
+		} else if (t->child && automatic_search_descends(t)) {
+			if (parents == NULL) {
+				parents = stack_new(0);
+			}
+
+			stack_push(parents, t);
+			t = t->child;
+			continue;
 		}
 
 		t = t->next;
 	}
+
+	if (parents) {
+		stack_free(parents);
+	}
 }
 
 
-void identify_global_search_terms(mmd_engine * e, scratch_pad * scratch) {
+/// Search a single token
+static void automatic_search_token(mmd_engine * e, token * t, search_terms * terms) {
+	if (t->type == TEXT_PLAIN) {
+		automatic_search_text(e, t, terms);
+	} else if (automatic_search_descends(t)) {
+		automatic_search(e, t->child, terms);
+	}
+}
+
+
+/// Prepare to search for abbreviations and glossary terms.  Returns false if
+/// there are none (or there's no memory to search for them).
+static bool global_search_terms(mmd_engine * e, search_terms * terms) {
+	terms->automaton = NULL;
+	terms->trie = NULL;
+
 	// Only search if we have a target
 	size_t count = e->abbreviation_stack->size + e->glossary_stack->size;
 
 	if (count == 0) {
-		return;
+		return false;
 	}
 
 	trie * ac = trie_new(0);
 	footnote * f;
 
+	if (ac == NULL) {
+		return false;
+	}
+
 	// Add abbreviations to search trie
 	for (int i = 0; i < e->abbreviation_stack->size; ++i) {
 		f = stack_peek_index(e->abbreviation_stack, i);
@@ -1795,13 +1901,269 @@ void identify_global_search_terms(mmd_engine * e, scratch_pad * scratch) {
 		trie_insert(ac, f->clean_text, PAIR_BRACKET_GLOSSARY);
 	}
 
-	ac_trie_prepare(ac);
-	automatic_search(e, e->root, ac);
-	trie_free(ac);
+	// The trie has 2 KiB per node -- search with compact version instead (which
+	// doesn't need ac_trie_prepare())
+	terms->automaton = ac_automaton_new(ac);
+
+	if (terms->automaton) {
+		trie_free(ac);
+	} else {
+		ac_trie_prepare(ac);
+		terms->trie = ac;
+	}
+
+	return true;
+}
+
+
+static void global_search_terms_free(search_terms * terms) {
+	if (terms->automaton) {
+		ac_automaton_free(terms->automaton);
+	}
+
+	if (terms->trie) {
+		trie_free(terms->trie);
+	}
+}
+
+
+void identify_global_search_terms(mmd_engine * e, scratch_pad * scratch) {
+	search_terms terms;
+
+	if (global_search_terms(e, &terms)) {
+		automatic_search(e, e->root, &terms);
+		global_search_terms_free(&terms);
+	}
+}
+
+
+void mmd_output_sink_flush(mmd_output_sink * sink, DString * out, bool force) {
+	if (!force && (out->currentStringLength < kOutputSinkBufferSize)) {
+		return;
+	}
+
+	if ((sink->status == 0) && out->currentStringLength) {
+		sink->status = sink->write(out->str, out->currentStringLength, sink->context);
+	}
+
+	d_string_erase(out, 0, -1);
+}
+
+
+/// Number of levels in token tree
+static size_t token_tree_depth(token * t) {
+	stack * parents = stack_new(0);			// Tokens whose children are being measured
+	size_t depth = 0;
+
+	while (t) {
+		if (parents->size + 1 > depth) {
+			depth = parents->size + 1;
+		}
+
+		if (t->child) {
+			stack_push(parents, t);
+			t = t->child;
+			continue;
+		}
+
+		// Resume after the nearest token that has more following it
+		while (t && (t->next == NULL)) {
+			t = (parents->size) ? stack_pop(parents) : NULL;
+		}
+
+		if (t) {
+			t = t->next;
+		}
+	}
+
+	stack_free(parents);
+
+	return depth;
+}
+
+
+/// Is export at `recurse_depth` deeper than the token tree itself?  That can
+/// only happen when notes refer to each other in a cycle.
+static bool mmd_export_in_cycle(scratch_pad * scratch) {
+	if (scratch->recurse_depth < kMaxExportRecursiveDepth) {
+		return false;
+	}
+
+	if (scratch->tree_depth == 0) {
+		scratch->tree_depth = token_tree_depth(scratch->root);
+	}
+
+	return (scratch->recurse_depth > scratch->tree_depth + kExportBlockDepth);
+}
+
+
+bool mmd_export_tree_begin(scratch_pad * scratch) {
+	// Prevent stack overflow with "dangerous" input causing extreme recursion
+	if ((scratch->stack_depth == kMaxExportRecursiveDepth) || mmd_export_in_cycle(scratch)) {
+		stats_count(export_depth_hits);
+		return false;
+	}
+
+	scratch->stack_depth++;
+	scratch->recurse_depth++;
+
+	return true;
+}
+
+
+void mmd_export_tree_end(scratch_pad * scratch) {
+	scratch->recurse_depth--;
+	scratch->stack_depth--;
+}
+
+
+/// Token whose children are being exported by mmd_export_token_tree()
+typedef struct {
+	token *				t;
+	mmd_export_saved	saved;			//!< Settings for `close` to restore
+} export_frame;
+
+#define kExportFramesOnStack 16			//!< Frames kept on the C stack before moving to the heap
+
+
+/// Start exporting the children of `t` -- returns false if out of memory
+static bool export_frame_push(export_frame ** frames, size_t * depth, size_t * allocated, export_frame * local, token * t, mmd_export_saved saved) {
+	if (*depth == *allocated) {
+		export_frame * grown = malloc(sizeof(export_frame) * *allocated * 2);
+
+		if (grown == NULL) {
+			return false;
+		}
+
+		memcpy(grown, *frames, sizeof(export_frame) * *depth);
+
+		if (*frames != local) {
+			free(*frames);
+		}
+
+		*frames = grown;
+		*allocated *= 2;
+	}
+
+	export_frame * f = &(*frames)[(*depth)++];
+
+	f->t = t;
+	f->saved = saved;
+
+	return true;
+}
+
+
+void mmd_export_token_tree(DString * out, const char * source, token * t, scratch_pad * scratch, mmd_export_open_function open, mmd_export_close_function close) {
+	if (!mmd_export_tree_begin(scratch)) {
+		return;
+	}
+
+	export_frame local[kExportFramesOnStack];
+	export_frame * frames = local;
+	size_t allocated = kExportFramesOnStack;
+	size_t depth = 0;
+
+	mmd_export_saved saved;
+
+	while (t != NULL) {
+		if (scratch->skip_token) {
+			scratch->skip_token--;
+		} else if (open(out, source, t, scratch, &saved)) {
+			if (t->child) {
+				// Export children first, then come back to close this token
+				if (mmd_export_in_cycle(scratch)) {
+					stats_count(export_depth_hits);
+				} else if (export_frame_push(&frames, &depth, &allocated, local, t, saved)) {
+					scratch->recurse_depth++;
+					t = t->child;
+					continue;
+				} else {
+					mmd_export_token_tree(out, source, t->child, scratch, open, close);
+				}
+			}
+
+			close(out, source, t, scratch, saved);
+		}
+
+		mmd_export_block_done(out, scratch);
+
+		t = t->next;
+
+		// Return to the parents of any finished chains
+		while ((t == NULL) && depth) {
+			export_frame * f = &frames[--depth];
+
+			scratch->recurse_depth--;
+			close(out, source, f->t, scratch, f->saved);
+			mmd_export_block_done(out, scratch);
+
+			t = f->t->next;
+		}
+	}
+
+	if (frames != local) {
+		free(frames);
+	}
+
+	mmd_export_tree_end(scratch);
+}
+
+
+size_t mmd_engine_estimate_output_size(mmd_engine * e, short format) {
+	size_t len = e->dstr->currentStringLength;
+	size_t blocks = 0;
+
+	if (e->root) {
+		for (token * t = e->root->child; t; t = t->next) {
+			blocks++;
+		}
+	}
+
+	// Markup added per byte of source and per top level block, taken from
+	// typical documents (e.g. `<p>...</p>` or `<text:p ...>...</text:p>`)
+	switch (format) {
+		case FORMAT_HTML:
+		case FORMAT_EPUB:
+		case FORMAT_TEXTBUNDLE:
+		case FORMAT_TEXTBUNDLE_COMPRESSED:
+			return len + len / 4 + blocks * 16;
+
+		case FORMAT_LATEX:
+		case FORMAT_BEAMER:
+		case FORMAT_MEMOIR:
+			return len + len / 4 + blocks * 8;
+
+		case FORMAT_FODT:
+		case FORMAT_ODT:
+			return len * 2 + blocks * 64;
+
+		default:
+			return len;
+	}
 }
 
 
 void mmd_engine_export_token_tree(DString * out, mmd_engine * e, short format) {
+	mmd_engine_export_token_tree_to_sink(out, e, format, NULL);
+}
+
+
+void mmd_engine_export_token_tree_to_sink(DString * out, mmd_engine * e, short format, mmd_output_sink * sink) {
+	#ifdef kUseObjectPool
+	// Any tokens created during export belong to this engine
+	struct pool * old_pool = token_pool_set_active(e->token_pool);
+	#endif
+
+	#ifdef USE_STATS
+	stats_scope scope;
+	stats_scope_begin(&scope, &e->stats);
+	#endif
+
+	stats_timer(export_start);
+
+	// Exporting alters the token tree, so work on a copy
+	mmd_engine_export_begin(e);
 
 	// Process potential reference definitions
 	process_definition_stack(e);
@@ -1812,6 +2174,14 @@ void mmd_engine_export_token_tree(DString * out, mmd_engine * e, short format) {
 	// Process tables for potential cross-reference targets
 	process_table_stack(e);
 
+	// Size the output buffer up front -- when streaming it is emptied after
+	// each kOutputSinkBufferSize bytes or so
+	if (sink) {
+		d_string_reserve(out, out->currentStringLength + kOutputSinkBufferSize * 2);
+	} else {
+		d_string_reserve(out, out->currentStringLength + mmd_engine_estimate_output_size(e, format));
+	}
+
 	// Create scratch pad
 	scratch_pad * scratch = scratch_pad_new(e, format);
 
@@ -1830,7 +2200,10 @@ void mmd_engine_export_token_tree(DString * out, mmd_engine * e, short format) {
 				mmd_start_complete_latex(out, e->dstr->str, scratch);
 			}
 
+			scratch->sink = sink;
 			mmd_export_token_tree_beamer(out, e->dstr->str, e->root, scratch);
+			scratch->sink = NULL;
+
 
 			mmd_outline_add_beamer(out, NULL, scratch);
 
@@ -1849,7 +2222,10 @@ void mmd_engine_export_token_tree(DString * out, mmd_engine * e, short format) {
 
 			mmd_start_complete_html(out, e->dstr->str, scratch);
 
+			scratch->sink = sink;
 			mmd_export_token_tree_html(out, e->dstr->str, e->root, scratch);
+			scratch->sink = NULL;
+
 			mmd_export_footnote_list_html(out, e->dstr->str, scratch);
 			mmd_export_glossary_list_html(out, e->dstr->str, scratch);
 			mmd_export_citation_list_html(out, e->dstr->str, scratch);
@@ -1863,7 +2239,10 @@ void mmd_engine_export_token_tree(DString * out, mmd_engine * e, short format) {
 				mmd_start_complete_html(out, e->dstr->str, scratch);
 			}
 
+			scratch->sink = sink;
 			mmd_export_token_tree_html(out, e->dstr->str, e->root, scratch);
+			scratch->sink = NULL;
+
 			mmd_export_footnote_list_html(out, e->dstr->str, scratch);
 			mmd_export_glossary_list_html(out, e->dstr->str, scratch);
 			mmd_export_citation_list_html(out, e->dstr->str, scratch);
@@ -1879,7 +2258,10 @@ void mmd_engine_export_token_tree(DString * out, mmd_engine * e, short format) {
 				mmd_start_complete_latex(out, e->dstr->str, scratch);
 			}
 
+			scratch->sink = sink;
 			mmd_export_token_tree_latex(out, e->dstr->str, e->root, scratch);
+			scratch->sink = NULL;
+
 			mmd_export_citation_list_latex(out, e->dstr->str, scratch);
 
 			if (scratch->extensions & EXT_COMPLETE) {
@@ -1893,7 +2275,10 @@ void mmd_engine_export_token_tree(DString * out, mmd_engine * e, short format) {
 				mmd_start_complete_latex(out, e->dstr->str, scratch);
 			}
 
+			scratch->sink = sink;
 			mmd_export_token_tree_memoir(out, e->dstr->str, e->root, scratch);
+			scratch->sink = NULL;
+
 			mmd_export_citation_list_latex(out, e->dstr->str, scratch);
 
 			if (scratch->extensions & EXT_COMPLETE) {
@@ -1908,7 +2293,10 @@ void mmd_engine_export_token_tree(DString * out, mmd_engine * e, short format) {
 		case FORMAT_FODT:
 //			mmd_start_complete_odf(out, e->dstr->str, scratch);
 
+			scratch->sink = sink;
 			mmd_export_token_tree_opendocument(out, e->dstr->str, e->root, scratch);
+			scratch->sink = NULL;
+
 
 //			mmd_end_complete_odf(out, e->dstr->str, scratch);
 			break;
@@ -1918,9 +2306,596 @@ void mmd_engine_export_token_tree(DString * out, mmd_engine * e, short format) {
 	e->asset_hash = scratch->asset_hash;
 
 	scratch_pad_free(scratch);
+
+	mmd_engine_export_end(e);
+
+	#ifdef USE_STATS
+	stats_lap(export_start, export_time);
+	stats_scope_end(&scope);
+	#endif
+
+	#ifdef kUseObjectPool
+	token_pool_set_active(old_pool);
+	#endif
+}
+
+
+/// HTML output for one top level block
+struct fragment {
+	uint64_t			key;			//!< Hash of block source and everything else that affects its output
+	char *				html;
+	size_t				len;
+	short				skip;			//!< Number of following blocks consumed by this one (e.g. table caption)
+	bool				cacheable;		//!< Output doesn't depend on earlier blocks (e.g. footnote numbers)
+	UT_hash_handle		hh;
+};
+
+typedef struct fragment fragment;
+
+struct mmd_fragment_cache {
+	stack *				fragments;		//!< Fragments from the last export, in document order
+	fragment *			hash;			//!< Cacheable fragments from the last export, by key
+	size_t				rendered;		//!< Number of blocks rendered (rather than reused) by the last export
+};
+
+
+static fragment * fragment_new(uint64_t key, const char * html, size_t len, short skip, bool cacheable) {
+	fragment * f = malloc(sizeof(fragment));
+
+	if (f) {
+		f->html = malloc(len + 1);
+
+		if (f->html == NULL) {
+			free(f);
+			return NULL;
+		}
+
+		f->key = key;
+		memcpy(f->html, html, len);
+		f->html[len] = '\0';
+		f->len = len;
+		f->skip = skip;
+		f->cacheable = cacheable;
+	}
+
+	return f;
+}
+
+
+static void fragment_free(fragment * f) {
+	free(f->html);
+	free(f);
 }
 
 
+static bool fragment_equal(fragment * a, fragment * b) {
+	return (a->len == b->len) && (memcmp(a->html, b->html, a->len) == 0);
+}
+
+
+static void fragment_cache_clear(mmd_fragment_cache * c) {
+	fragment * f, * tmp;
+
+	HASH_ITER(hh, c->hash, f, tmp) {
+		HASH_DEL(c->hash, f);
+	}
+
+	while (c->fragments->size) {
+		fragment_free(stack_pop(c->fragments));
+	}
+}
+
+
+mmd_fragment_cache * mmd_fragment_cache_new(void) {
+	mmd_fragment_cache * c = malloc(sizeof(mmd_fragment_cache));
+
+	if (c) {
+		c->fragments = stack_new(0);
+		c->hash = NULL;
+		c->rendered = 0;
+	}
+
+	return c;
+}
+
+
+void mmd_fragment_cache_free(mmd_fragment_cache * c) {
+	if (c) {
+		fragment_cache_clear(c);
+		stack_free(c->fragments);
+		free(c);
+	}
+}
+
+
+size_t mmd_fragment_cache_count(mmd_fragment_cache * c) {
+	return c->fragments->size;
+}
+
+
+const char * mmd_fragment_cache_html(mmd_fragment_cache * c, size_t index, size_t * len) {
+	if (index >= c->fragments->size) {
+		return NULL;
+	}
+
+	fragment * f = stack_peek_index(c->fragments, index);
+
+	if (len) {
+		*len = f->len;
+	}
+
+	return f->html;
+}
+
+
+size_t mmd_fragment_cache_rendered(mmd_fragment_cache * c) {
+	return c->rendered;
+}
+
+
+/// FNV-1a hash
+static uint64_t hash_bytes(uint64_t h, const char * str, size_t len) {
+	for (size_t i = 0; i < len; ++i) {
+		h ^= (unsigned char) str[i];
+		h *= 0x100000001b3ULL;
+	}
+
+	return h;
+}
+
+
+static uint64_t hash_value(uint64_t h, uint64_t value) {
+	return hash_bytes(h, (const char *) &value, sizeof(value));
+}
+
+
+static uint64_t hash_token_source(uint64_t h, const char * source, token * t) {
+	h = hash_value(h, t->len);
+	return hash_bytes(h, &source[t->start], t->len);
+}
+
+
+/// Hash everything that can change the output of any block -- settings,
+/// metadata, and the targets of references (definitions, headers, tables)
+static uint64_t fragment_context_hash(mmd_engine * e) {
+	const char * source = e->dstr->str;
+	uint64_t h = 0xcbf29ce484222325ULL;
+	token * t;
+	meta * m;
+
+	h = hash_value(h, e->extensions);
+	h = hash_value(h, e->language);
+	h = hash_value(h, e->quotes_lang);
+
+	for (int i = 0; i < e->metadata_stack->size; ++i) {
+		m = stack_peek_index(e->metadata_stack, i);
+		h = hash_bytes(h, m->key, strlen(m->key) + 1);
+		h = hash_bytes(h, m->value, strlen(m->value) + 1);
+	}
+
+	for (int i = 0; i < e->definition_stack->size; ++i) {
+		h = hash_token_source(h, source, stack_peek_index(e->definition_stack, i));
+	}
+
+	for (int i = 0; i < e->header_stack->size; ++i) {
+		h = hash_token_source(h, source, stack_peek_index(e->header_stack, i));
+	}
+
+	for (int i = 0; i < e->table_stack->size; ++i) {
+		t = stack_peek_index(e->table_stack, i);
+		h = hash_token_source(h, source, t);
+
+		// Caption
+		if (t->next) {
+			h = hash_token_source(h, source, t->next);
+		}
+	}
+
+	return h;
+}
+
+
+/// Hash block source, along with the neighbors that can affect its output
+static uint64_t fragment_block_key(uint64_t context, const char * source, token * t) {
+	uint64_t h = hash_token_source(context, source, t);
+
+	h = hash_value(h, t->type);
+	h = hash_value(h, t->prev ? t->prev->type : 0);
+	h = hash_value(h, t->next ? t->next->type : 0);
+
+	if ((t->type == BLOCK_TABLE) && t->next) {
+		// Table captions are in the following block
+		h = hash_token_source(h, source, t->next);
+	}
+
+	return h;
+}
+
+
+/// Does output depend on notes used by earlier blocks (numbering, first use, etc.)?
+static bool token_uses_notes(token * t) {
+	token * walker = t;
+	stack * pending = NULL;			// Tokens still to be checked after those inside
+	bool uses = false;
+
+	while (walker && !uses) {
+		switch (walker->type) {
+			case BLOCK_TOC:
+			case TOC:
+				// Header text can include notes
+			case PAIR_BRACKET_ABBREVIATION:
+			case PAIR_BRACKET_CITATION:
+			case PAIR_BRACKET_FOOTNOTE:
+			case PAIR_BRACKET_GLOSSARY:
+				uses = true;
+				continue;
+		}
+
+		// Check tokens inside this one, then the ones that follow (but not
+		// those that follow `t`)
+		token * next = (walker == t) ? NULL : walker->next;
+
+		if (walker->child) {
+			if (next) {
+				if (pending == NULL) {
+					pending = stack_new(0);
+				}
+
+				stack_push(pending, next);
+			}
+
+			walker = walker->child;
+		} else if (next) {
+			walker = next;
+		} else {
+			walker = (pending && pending->size) ? stack_pop(pending) : NULL;
+		}
+	}
+
+	if (pending) {
+		stack_free(pending);
+	}
+
+	return uses;
+}
+
+
+mmd_fragment_diff mmd_engine_export_html_fragments(mmd_engine * e, mmd_fragment_cache * c) {
+	const char * source = e->dstr->str;
+	mmd_fragment_diff diff = { 0, 0, 0 };
+	fragment * f;
+	fragment * cached;
+	token * t;
+	token * caption;
+	bool cacheable;
+	short skip;
+	size_t count = 0;
+
+	if (e->root == NULL) {
+		mmd_engine_parse_string(e);
+	}
+
+	if (e->root == NULL) {
+		// Nothing could be parsed, so there are no fragments
+		diff.removed = c->fragments->size;
+		fragment_cache_clear(c);
+		c->rendered = 0;
+		return diff;
+	}
+
+	// Keys have to be calculated before definitions are processed (which
+	// changes their block types)
+	uint64_t context = fragment_context_hash(e);
+
+	for (t = e->root->child; t; t = t->next) {
+		count++;
+	}
+
+	uint64_t * keys = malloc(sizeof(uint64_t) * (count + 1));
+
+	if (keys == NULL) {
+		// Leave the previous fragments in place
+		return diff;
+	}
+
+	count = 0;
+
+	for (t = e->root->child; t; t = t->next) {
+		keys[count++] = fragment_block_key(context, source, t);
+	}
+
+	stack * fragments = stack_new(0);
+
+	#ifdef kUseObjectPool
+	// Any tokens created during export belong to this engine
+	struct pool * old_pool = token_pool_set_active(e->token_pool);
+	#endif
+
+	#ifdef USE_STATS
+	stats_scope scope;
+	stats_scope_begin(&scope, &e->stats);
+	#endif
+
+	stats_timer(export_start);
+
+	// Exporting alters the token tree, so work on a copy
+	mmd_engine_export_begin(e);
+
+	process_definition_stack(e);
+	process_header_stack(e);
+	process_table_stack(e);
+
+	scratch_pad * scratch = scratch_pad_new(e, FORMAT_HTML);
+
+	process_metadata_stack(e, scratch);
+
+	strip_dimension_px_from_links_html(scratch);
+
+	// Abbreviations and glossary terms are only searched for in blocks that
+	// are rendered
+	search_terms terms;
+	bool searching = false;
+
+	if (!(e->extensions & EXT_COMPATIBILITY)) {
+		searching = global_search_terms(e, &terms);
+	}
+
+	DString * out = d_string_new("");
+
+	c->rendered = 0;
+	scratch->recurse_depth = kExportBlockDepth;
+
+	count = 0;
+
+	for (t = e->root->child; t; t = t->next, count++) {
+		if (scratch->skip_token) {
+			scratch->skip_token--;
+			continue;
+		}
+
+		if (t->type == BLOCK_EMPTY) {
+			// No output (includes definitions, once processed)
+			continue;
+		}
+
+		HASH_FIND(hh, c->hash, &keys[count], sizeof(uint64_t), cached);
+
+		if (cached) {
+			// Reuse cached output
+			skip = cached->skip;
+			f = fragment_new(cached->key, cached->html, cached->len, skip, true);
+		} else {
+			// Table captions are in the following block
+			caption = ((t->type == BLOCK_TABLE) && t->next) ? t->next : NULL;
+
+			if (searching) {
+				automatic_search_token(e, t, &terms);
+
+				if (caption) {
+					automatic_search_token(e, caption, &terms);
+				}
+			}
+
+			cacheable = !token_uses_notes(t) && !(caption && token_uses_notes(caption));
+
+			// Output of each fragment begins without padding
+			scratch->padded = 2;
+			d_string_erase(out, 0, -1);
+
+			mmd_export_token_html(out, source, t, scratch);
+			c->rendered++;
+
+			skip = scratch->skip_token;
+			f = fragment_new(keys[count], out->str, out->currentStringLength, skip, cacheable);
+		}
+
+		scratch->skip_token = skip;
+
+		if (f == NULL) {
+			// Out of memory, so the block is left out
+			continue;
+		}
+
+		if (f->len) {
+			stack_push(fragments, f);
+		} else {
+			fragment_free(f);
+		}
+	}
+
+	// Notes are collected in a final fragment
+	scratch->recurse_depth = 0;
+	scratch->padded = 2;
+	d_string_erase(out, 0, -1);
+
+	mmd_export_footnote_list_html(out, source, scratch);
+	mmd_export_glossary_list_html(out, source, scratch);
+	mmd_export_citation_list_html(out, source, scratch);
+
+	if (out->currentStringLength) {
+		f = fragment_new(0, out->str, out->currentStringLength, 0, false);
+
+		if (f) {
+			stack_push(fragments, f);
+		}
+	}
+
+	// Compare with previous fragments -- only the range between the
+	// unchanged beginning and end needs to be replaced
+	size_t old_count = c->fragments->size;
+	size_t new_count = fragments->size;
+	size_t prefix = 0;
+	size_t suffix = 0;
+
+	while ((prefix < old_count) && (prefix < new_count) &&
+			fragment_equal(stack_peek_index(c->fragments, prefix), stack_peek_index(fragments, prefix))) {
+		prefix++;
+	}
+
+	while ((suffix < old_count - prefix) && (suffix < new_count - prefix) &&
+			fragment_equal(stack_peek_index(c->fragments, old_count - suffix - 1), stack_peek_index(fragments, new_count - suffix - 1))) {
+		suffix++;
+	}
+
+	diff.start = prefix;
+	diff.removed = old_count - prefix - suffix;
+	diff.inserted = new_count - prefix - suffix;
+
+	// Replace cache contents
+	fragment_cache_clear(c);
+	stack_free(c->fragments);
+	c->fragments = fragments;
+
+	for (size_t i = 0; i < fragments->size; ++i) {
+		f = stack_peek_index(fragments, i);
+
+		if (f->cacheable) {
+			fragment * existing;
+			HASH_FIND(hh, c->hash, &f->key, sizeof(uint64_t), existing);
+
+			if (!existing) {
+				HASH_ADD(hh, c->hash, key, sizeof(uint64_t), f);
+			}
+		}
+	}
+
+	if (searching) {
+		global_search_terms_free(&terms);
+	}
+
+	d_string_free(out, true);
+	free(keys);
+
+	// Preserve asset_hash for possible use in export
+	e->asset_hash = scratch->asset_hash;
+
+	scratch_pad_free(scratch);
+
+	mmd_engine_export_end(e);
+
+	#ifdef USE_STATS
+	stats_lap(export_start, export_time);
+	stats_scope_end(&scope);
+	#endif
+
+	#ifdef kUseObjectPool
+	token_pool_set_active(old_pool);
+	#endif
+
+	return diff;
+}
+
+
+#ifdef TEST
+/// Replace the first occurrence of `find` in the engine's source with `replace`
+static void fragment_test_edit(CuTest * tc, mmd_engine * e, const char * find, const char * replace) {
+	char * found = strstr(e->dstr->str, find);
+	CuAssertPtrNotNull(tc, found);
+
+	mmd_engine_update_source(e, found - e->dstr->str, strlen(find), replace);
+}
+
+
+#define CuAssertDiffEquals(tc, s, r, i, d) \
+	do { \
+		CuAssertIntEquals(tc, s, (int) (d).start); \
+		CuAssertIntEquals(tc, r, (int) (d).removed); \
+		CuAssertIntEquals(tc, i, (int) (d).inserted); \
+	} while (0)
+
+
+void Test_mmd_engine_export_html_fragments(CuTest* tc) {
+	mmd_fragment_cache * c = mmd_fragment_cache_new();
+	mmd_engine * e = mmd_engine_create_with_string("First.\n\nSecond.\n\nThird.\n", 0);
+	mmd_fragment_diff d;
+
+	d = mmd_engine_convert_to_fragments(e, c);
+	CuAssertDiffEquals(tc, 0, 0, 3, d);
+	CuAssertIntEquals(tc, 3, (int) mmd_fragment_cache_rendered(c));
+
+	// Only the edited block is rendered and replaced
+	fragment_test_edit(tc, e, "Second", "2nd");
+	d = mmd_engine_export_html_fragments(e, c);
+	CuAssertDiffEquals(tc, 1, 1, 1, d);
+	CuAssertIntEquals(tc, 1, (int) mmd_fragment_cache_rendered(c));
+	CuAssertStrEquals(tc, "<p>2nd.</p>", mmd_fragment_cache_html(c, 1, NULL));
+
+	// New block
+	fragment_test_edit(tc, e, "Third", "New.\n\nThird");
+	d = mmd_engine_export_html_fragments(e, c);
+	CuAssertDiffEquals(tc, 2, 0, 1, d);
+	CuAssertIntEquals(tc, 4, (int) mmd_fragment_cache_count(c));
+
+	// Removed block -- the block that followed it is rendered again (its
+	// neighbors changed), but its output is the same
+	fragment_test_edit(tc, e, "First.\n\n", "");
+	d = mmd_engine_export_html_fragments(e, c);
+	CuAssertDiffEquals(tc, 0, 1, 0, d);
+	CuAssertIntEquals(tc, 1, (int) mmd_fragment_cache_rendered(c));
+
+	// No change
+	d = mmd_engine_export_html_fragments(e, c);
+	CuAssertDiffEquals(tc, 3, 0, 0, d);
+
+	mmd_engine_free(e, true);
+	mmd_fragment_cache_free(c);
+}
+
+
+void Test_mmd_engine_export_html_fragments_notes(CuTest* tc) {
+	mmd_fragment_cache * c = mmd_fragment_cache_new();
+	mmd_engine * e = mmd_engine_create_with_string("A[^a].\n\nB[^b].\n\nC.\n\n[^a]: Note A.\n\n[^b]: Note B.\n", EXT_NOTES);
+	mmd_fragment_diff d;
+
+	d = mmd_engine_convert_to_fragments(e, c);
+	CuAssertDiffEquals(tc, 0, 0, 4, d);
+
+	// Blocks that use notes are always rendered, since numbering depends on
+	// earlier blocks -- here `b` becomes the first note, so the second block
+	// and the list of notes change too
+	fragment_test_edit(tc, e, "A[^a]", "A[^b][^a]");
+	d = mmd_engine_export_html_fragments(e, c);
+	CuAssertIntEquals(tc, 2, (int) mmd_fragment_cache_rendered(c));
+	CuAssertIntEquals(tc, 4, (int) mmd_fragment_cache_count(c));
+	CuAssertDiffEquals(tc, 0, 4, 4, d);
+
+	// Editing a note's text changes only the list of notes
+	fragment_test_edit(tc, e, "Note B", "Note b");
+	d = mmd_engine_export_html_fragments(e, c);
+	CuAssertDiffEquals(tc, 3, 1, 1, d);
+
+	mmd_engine_free(e, true);
+	mmd_fragment_cache_free(c);
+}
+
+
+void Test_mmd_engine_export_html_fragments_links(CuTest* tc) {
+	mmd_fragment_cache * c = mmd_fragment_cache_new();
+	mmd_engine * e = mmd_engine_create_with_string("See [foo].\n\nOther.\n\n[foo]: http://a.example/\n", 0);
+	mmd_fragment_diff d;
+
+	d = mmd_engine_convert_to_fragments(e, c);
+	CuAssertDiffEquals(tc, 0, 0, 2, d);
+
+	// Changing a link definition renders every block again, but only the
+	// block that uses it changes
+	fragment_test_edit(tc, e, "a.example", "b.example");
+	d = mmd_engine_export_html_fragments(e, c);
+	CuAssertIntEquals(tc, 2, (int) mmd_fragment_cache_rendered(c));
+	CuAssertDiffEquals(tc, 0, 1, 1, d);
+	CuAssertStrEquals(tc, "<p>See <a href=\"http://b.example/\">foo</a>.</p>", mmd_fragment_cache_html(c, 0, NULL));
+
+	// Then cached output is used again
+	fragment_test_edit(tc, e, "Other", "More");
+	d = mmd_engine_export_html_fragments(e, c);
+	CuAssertIntEquals(tc, 1, (int) mmd_fragment_cache_rendered(c));
+	CuAssertDiffEquals(tc, 1, 1, 1, d);
+
+	mmd_engine_free(e, true);
+	mmd_fragment_cache_free(c);
+}
+#endif
+
 void parse_brackets(const char * source, scratch_pad * scratch, token * bracket, link ** final_link, short * skip_token, bool * free_link) {
 	link * temp_link = NULL;
 	char * temp_char = NULL;
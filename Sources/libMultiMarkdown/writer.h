@@ -67,10 +67,21 @@
 #include "uthash.h"
 
 
-#define kMaxExportRecursiveDepth 1000		//!< Maximum recursion depth when exporting token tree -- to prevent stack overflow with "pathologic" input
+#define kMaxExportRecursiveDepth 1000		//!< Maximum number of token tree walkers nested on the C stack -- to prevent stack overflow with "pathologic" input
 
 #define kMaxTableColumns 48					//!< Maximum number of table columns for specifying alignment
 
+#define kOutputSinkBufferSize 65536			//!< Hand streamed output to sink once this much is waiting
+
+#define kExportBlockDepth 2					//!< recurse_depth while exporting top level blocks
+
+/// Destination for output that is streamed as it is generated
+typedef struct {
+	mmd_write_callback	write;
+	void *				context;
+	int					status;			//!< Non-zero once a write has failed
+} mmd_output_sink;
+
 typedef struct {
 	struct link *		link_hash;
 	struct meta *		meta_hash;
@@ -114,7 +125,10 @@ typedef struct {
 
 	stack *				outline_stack;
 
-	short				recurse_depth;
+	size_t				recurse_depth;
+	size_t				stack_depth;	//!< Token tree walkers nested on the C stack
+	token *				root;			//!< Token tree being exported
+	size_t				tree_depth;		//!< Levels in token tree (0 until export gets kMaxExportRecursiveDepth deep)
 
 	short				in_table_header;
 	short				table_column_count;
@@ -126,6 +140,10 @@ typedef struct {
 	struct asset *		asset_hash;
 	short				store_assets;
 	short				remember_assets;
+
+	mmd_output_sink *	sink;			//!< Stream top level blocks here (if not NULL)
+
+	unsigned short		threads;		//!< Threads available for exporting top level blocks
 } scratch_pad;
 
 
@@ -202,10 +220,81 @@ scratch_pad * scratch_pad_new(mmd_engine * e, short format);
 
 void scratch_pad_free(scratch_pad * scratch);
 
+/// Number used in anchors for footnote `note` with EXT_RANDOM_FOOT
+int random_footnote_id(scratch_pad * scratch, int note);
+
 
 /// Ensure at least num newlines at end of output buffer
 void pad(DString * d, short num, scratch_pad * scratch);
 
+
+/// Pass output on to sink and empty the buffer.  Unless `force` is true, this
+/// waits until kOutputSinkBufferSize bytes are available.
+void mmd_output_sink_flush(mmd_output_sink * sink, DString * out, bool force);
+
+
+/// When streaming, output can be handed off after each top level block is
+/// finished (exporters may still revise the text of the current block)
+#define mmd_export_block_done(out, scratch) \
+	do { \
+		if ((scratch)->sink && ((scratch)->recurse_depth == kExportBlockDepth)) { \
+			mmd_output_sink_flush((scratch)->sink, out, false); \
+		} \
+	} while (0)
+
+
+/// Scratch pad settings that an open function changes for the children of a
+/// token, and its close function restores
+typedef struct {
+	short				list_is_tight;
+	short				odf_para_type;
+} mmd_export_saved;
+
+
+/// Export the start of token `t` (e.g. `<blockquote>`).  Returns true if
+/// `t->child` should be exported next, followed by the matching close
+/// function.
+typedef bool (*mmd_export_open_function)(DString * out, const char * source, token * t, scratch_pad * scratch, mmd_export_saved * saved);
+
+
+/// Export the end of token `t` (e.g. `</blockquote>`), after its children
+typedef void (*mmd_export_close_function)(DString * out, const char * source, token * t, scratch_pad * scratch, mmd_export_saved saved);
+
+
+/// Export a chain of tokens and their children
+///
+/// Children are exported before the parent is closed, as if recursing, but
+/// the parents are kept on a stack of frames so that deeply nested blocks
+/// and spans don't use up the C stack.
+void mmd_export_token_tree(DString * out, const char * source, token * t, scratch_pad * scratch, mmd_export_open_function open, mmd_export_close_function close);
+
+
+/// Start a token tree walker that recurses on the C stack.  Returns false,
+/// and the chain should not be exported, once kMaxExportRecursiveDepth walkers
+/// are nested or export is deeper than the token tree (notes that refer to
+/// each other in a cycle).  Otherwise finish with mmd_export_tree_end().
+bool mmd_export_tree_begin(scratch_pad * scratch);
+void mmd_export_tree_end(scratch_pad * scratch);
+
+
+/// Prepare parsed document for export (run by
+/// mmd_engine_export_token_tree() before exporting)
+void process_definition_stack(mmd_engine * e);
+void process_header_stack(mmd_engine * e);
+void process_table_stack(mmd_engine * e);
+void process_metadata_stack(mmd_engine * e, scratch_pad * scratch);
+void identify_global_search_terms(mmd_engine * e, scratch_pad * scratch);
+
+
+/// Estimate the length of the output for a parsed document, so that the
+/// output buffer can be allocated once instead of grown repeatedly
+size_t mmd_engine_estimate_output_size(mmd_engine * e, short format);
+
+
+/// Export parsed token tree, streaming blocks to `sink` (if not NULL)
+void mmd_engine_export_token_tree_to_sink(DString * out, mmd_engine * e, short format, mmd_output_sink * sink);
+
+
 link * explicit_link(scratch_pad * scratch, token * label, token * url, const char * source);
 
 /// Find link based on label
@@ -54,18 +54,27 @@
 */
 
 #include <ctype.h>
+#include <errno.h>
 #include <libgen.h>
 #include <limits.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef USE_PTHREADS
+	#include <pthread.h>
+	#include <unistd.h>
+#endif
+
 
 #include "argtable3.h"
 #include "d_string.h"
 #include "file.h"
 #include "i18n.h"
 #include "libMultiMarkdown.h"
+#include "object_pool.h"
+#include "rng.h"
 #include "token.h"
 #include "uuid.h"
 #include "version.h"
@@ -76,8 +85,9 @@
 // argtable structs
 struct arg_lit *a_help, *a_version, *a_compatibility, *a_nolabels, *a_batch,
 		   *a_accept, *a_reject, *a_full, *a_snippet, *a_random, *a_meta,
-		   *a_notransclude, *a_nosmart;
+		   *a_notransclude, *a_nosmart, *a_stats;
 struct arg_str *a_format, *a_lang, *a_extract;
+struct arg_int *a_jobs;
 struct arg_file *a_file, *a_o;
 struct arg_end *a_end;
 struct arg_rem *a_rem1, *a_rem2, *a_rem3, *a_rem4, *a_rem5, *a_rem6;
@@ -129,11 +139,446 @@ char * filename_with_extension(const char * original, const char * new_extension
 }
 
 
+/// Settings shared by every file converted in batch mode
+typedef struct {
+	unsigned long		extensions;
+	short				format;
+	short				language;
+	bool				list_meta;		//!< List metadata keys instead of converting
+	const char *		extract;		//!< Extract this metadata key instead of converting
+	bool				stats;			//!< Gather statistics for each file
+	mmd_transclusion_cache *	cache;	//!< Files transcluded by more than one document are read once
+} batch_settings;
+
+
+/// A single file to be converted in batch mode
+typedef struct {
+	char *				filename;		//!< Input file
+	char *				folder;			//!< Directory used to resolve transclusion and assets
+	char *				output_filename;
+	DString *			report;			//!< Text destined for stdout (metadata queries)
+	bool				read_failed;
+	bool				too_long;		//!< Source was too long to convert
+	int					write_errno;	//!< errno if output file could not be opened or written
+	mmd_stats			stats;			//!< Where the time went (with --stats)
+} batch_job;
+
+
+/// Will the source text need to be modified before it is converted?  (MMD
+/// Header/Footer metadata, transclusion, or block level CriticMarkup)
+static bool source_needs_editing(DString * source, unsigned long extensions) {
+	if (extensions & (EXT_CRITIC_ACCEPT | EXT_CRITIC_REJECT)) {
+		return true;
+	}
+
+	if ((extensions & EXT_TRANSCLUDE) && strstr(source->str, "{{")) {
+		return true;
+	}
+
+	if (!(extensions & EXT_COMPATIBILITY)) {
+		char * meta = mmd_d_string_metavalue_for_key(source, "mmdheader");
+
+		if (meta == NULL) {
+			meta = mmd_d_string_metavalue_for_key(source, "mmdfooter");
+		}
+
+		if (meta) {
+			free(meta);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+/// Read source file.  If the text can be converted as is, the file is mapped
+/// into memory rather than copied, and `mapped` is set to true.
+static DString * read_source_file(const char * fname, unsigned long extensions, bool * mapped) {
+	DString * buffer = map_file(fname);
+
+	*mapped = false;
+
+	if (buffer) {
+		if (!source_needs_editing(buffer, extensions)) {
+			*mapped = true;
+			return buffer;
+		}
+
+		// Make a copy that we are allowed to change
+		DString * copy = d_string_new("");
+		d_string_append_c_array(copy, buffer->str, buffer->currentStringLength);
+		unmap_file(buffer);
+
+		return copy;
+	}
+
+	return scan_file(fname);
+}
+
+
+/// Release source from read_source_file()
+static void free_source(DString * buffer, bool mapped) {
+	if (mapped) {
+		unmap_file(buffer);
+	} else {
+		d_string_free(buffer, true);
+	}
+}
+
+
+/// Convert source and write results to stream.  Text formats are written as
+/// they are generated, rather than building the entire document in memory.
+/// Returns 0 on success, or the errno of a failed write.  `too_long` is set if
+/// the source could not be parsed (and nothing was written).
+static int convert_to_stream(DString * source, unsigned long extensions, short format, short language, int threads, const char * directory, FILE * stream, bool * too_long) {
+	DString * result;
+	int status = 0;
+	mmd_engine * e = mmd_engine_create_with_dstring(source, extensions);
+
+	mmd_engine_set_language(e, language);
+	mmd_engine_set_threads(e, threads);
+
+	switch (format) {
+		case FORMAT_HTML:
+		case FORMAT_LATEX:
+		case FORMAT_BEAMER:
+		case FORMAT_MEMOIR:
+		case FORMAT_FODT:
+			status = mmd_engine_convert_to_stream(e, format, stream);
+			break;
+
+		default:
+			result = mmd_engine_convert_to_data(e, format, directory);
+
+			// A short write doesn't always set errno, so don't report a stale one
+			errno = 0;
+
+			if (fwrite(result->str, 1, result->currentStringLength, stream) != result->currentStringLength) {
+				status = errno ? errno : EIO;
+			}
+
+			d_string_free(result, true);
+			break;
+	}
+
+	*too_long = mmd_engine_source_too_long(e);
+
+	mmd_engine_free(e, false);			// The engine doesn't own the DString, so don't free it.
+
+	errno = 0;
+
+	if ((status == 0) && fflush(stream)) {
+		status = errno ? errno : EIO;
+	}
+
+	return status;
+}
+
+
+/// Determine output filename for a file in batch mode
+static char * batch_output_filename(const char * filename, short format) {
+	switch (format) {
+		case FORMAT_LATEX:
+		case FORMAT_BEAMER:
+		case FORMAT_MEMOIR:
+			return filename_with_extension(filename, ".tex");
+
+		case FORMAT_FODT:
+			return filename_with_extension(filename, ".fodt");
+
+		case FORMAT_ODT:
+			return filename_with_extension(filename, ".odt");
+
+		case FORMAT_MMD:
+			return filename_with_extension(filename, ".mmdtext");
+
+		case FORMAT_EPUB:
+			return filename_with_extension(filename, ".epub");
+
+		case FORMAT_TEXTBUNDLE:
+			return filename_with_extension(filename, ".textbundle");
+
+		case FORMAT_TEXTBUNDLE_COMPRESSED:
+			return filename_with_extension(filename, ".textpack");
+
+		case FORMAT_HTML:
+		default:
+			return filename_with_extension(filename, ".html");
+	}
+}
+
+
+/// Prepare a batch job.  `dirname()` is not thread-safe (and may modify its
+/// argument), so this must be done on the main thread.
+static void batch_job_prepare(batch_job * job, const char * filename, short format) {
+	job->filename = my_strdup(filename);
+	job->output_filename = batch_output_filename(filename, format);
+
+	char * temp = my_strdup(filename);
+	job->folder = my_strdup(dirname(temp));
+	free(temp);
+
+	job->report = NULL;
+	job->read_failed = false;
+	job->too_long = false;
+	job->write_errno = 0;
+
+	memset(&job->stats, 0, sizeof(mmd_stats));
+}
+
+
+/// Free memory used by a batch job
+static void batch_job_free(batch_job * job) {
+	free(job->filename);
+	free(job->folder);
+	free(job->output_filename);
+
+	if (job->report) {
+		d_string_free(job->report, true);
+	}
+}
+
+
+/// Convert a single file in batch mode.  Nothing is printed here -- results
+/// are stored in the job so that they can be reported in a predictable order.
+static void batch_job_convert(batch_job * job, const batch_settings * s) {
+	bool mapped;
+	DString * buffer = read_source_file(job->filename, s->extensions, &mapped);
+	DString * result;
+	char * char_result;
+	FILE * output_stream;
+
+	if (buffer == NULL) {
+		job->read_failed = true;
+		return;
+	}
+
+	mmd_stats * old_stats = NULL;
+
+	if (s->stats) {
+		old_stats = mmd_stats_set_active(&job->stats);
+	}
+
+	mmd_transclusion_cache * old_cache = mmd_transclusion_cache_set_active(s->cache);
+
+	// Each file gets the same random numbers (e.g. for obfuscating email
+	// addresses) whether it is converted alone, serially, or on any thread
+	ran_start(314159L);
+
+	// Perform transclusion(s)
+	if (!(s->extensions & EXT_COMPATIBILITY)) {
+		mmd_prepend_mmd_header(buffer);
+		mmd_append_mmd_footer(buffer);
+	}
+
+	if (s->extensions & EXT_TRANSCLUDE) {
+		mmd_transclude_source(buffer, job->folder, job->filename, s->format, NULL, NULL);
+	}
+
+	// Perform block level CriticMarkup?
+	if (s->extensions & EXT_CRITIC_ACCEPT) {
+		mmd_critic_markup_accept(buffer);
+	}
+
+	if (s->extensions & EXT_CRITIC_REJECT) {
+		mmd_critic_markup_reject(buffer);
+	}
+
+	if (s->list_meta) {
+		// List metadata keys
+		char_result = mmd_string_metadata_keys(buffer->str);
+
+		if (char_result) {
+			job->report = d_string_new(char_result);
+
+			free(char_result);
+		}
+	} else if (s->extract) {
+		// Extract metadata key
+		char_result = mmd_string_metavalue_for_key(buffer->str, s->extract);
+
+		if (char_result) {
+			job->report = d_string_new(char_result);
+			d_string_append_c(job->report, '\n');
+
+			free(char_result);
+		}
+	} else {
+		// Regular processing
+		if (FORMAT_TEXTBUNDLE == s->format) {
+			mmd_engine * e = mmd_engine_create_with_dstring(buffer, s->extensions);
+
+			mmd_engine_set_language(e, s->language);
+			result = mmd_engine_convert_to_data(e, s->format, job->folder);
+			job->too_long = mmd_engine_source_too_long(e);
+			mmd_engine_free(e, false);
+
+			if (!job->too_long) {
+				unzip_data_to_path(result->str, result->currentStringLength, job->output_filename);
+			}
+
+			d_string_free(result, true);
+		} else {
+			if (!(output_stream = fopen(job->output_filename, "wb"))) {
+				// Failed to open file
+				job->write_errno = errno;
+			} else {
+				job->write_errno = convert_to_stream(buffer, s->extensions, s->format, s->language, 1, job->folder, output_stream, &job->too_long);
+
+				if (fclose(output_stream) && !job->write_errno) {
+					job->write_errno = errno;
+				}
+			}
+		}
+	}
+
+	mmd_transclusion_cache_set_active(old_cache);
+
+	if (s->stats) {
+		mmd_stats_set_active(old_stats);
+	}
+
+	free_source(buffer, mapped);
+}
+
+
+/// Print statistics gathered with --stats
+static void print_stats(const char * name, const mmd_stats * s) {
+	if (name) {
+		fprintf(stderr, "Statistics for %s:\n", name);
+	} else {
+		fprintf(stderr, "Statistics:\n");
+	}
+
+	fprintf(stderr, "\t%-18s %12.3f ms\n", "transclusion", s->transclude_time * 1000);
+	fprintf(stderr, "\t%-18s %12.3f ms\n", "tokenize", s->tokenize_time * 1000);
+	fprintf(stderr, "\t%-18s %12.3f ms\n", "block parser", s->parse_time * 1000);
+	fprintf(stderr, "\t%-18s %12.3f ms\n", "token pairing", s->pair_time * 1000);
+	fprintf(stderr, "\t%-18s %12.3f ms\n", "export", s->export_time * 1000);
+	fprintf(stderr, "\t%-18s %12lu\n", "tokens", s->tokens);
+	fprintf(stderr, "\t%-18s %12lu (%lu reused)\n", "pool slabs", s->pool_slabs, s->pool_slabs_reused);
+	fprintf(stderr, "\t%-18s %12lu (%lu bytes)\n", "string reallocs", s->string_reallocs, s->string_realloc_bytes);
+	fprintf(stderr, "\t%-18s %12lu\n", "export depth hits", s->export_depth_hits);
+}
+
+
+/// Report results of a batch job.  Returns false if the file could not be read.
+static bool batch_job_report(batch_job * job) {
+	if (job->read_failed) {
+		fprintf(stderr, "Error reading file '%s'\n", job->filename);
+		return false;
+	}
+
+	if (job->too_long) {
+		fprintf(stderr, "Error converting file '%s': too long\n", job->filename);
+	}
+
+	if (job->write_errno) {
+		errno = job->write_errno;
+		perror(job->output_filename);
+	}
+
+	if (job->report) {
+		fputs(job->report->str, stdout);
+	}
+
+	return true;
+}
+
+
+#ifdef USE_PTHREADS
+
+/// Queue of batch jobs shared by worker threads
+typedef struct {
+	batch_job *				jobs;
+	int						count;
+	int						next;		//!< Index of next job to be claimed
+	pthread_mutex_t			lock;
+	const batch_settings *	settings;
+} batch_queue;
+
+
+/// Worker thread -- claim and convert jobs until none are left
+static void * batch_worker(void * arg) {
+	batch_queue * q = arg;
+	int i;
+
+	while (true) {
+		pthread_mutex_lock(&q->lock);
+		i = q->next++;
+		pthread_mutex_unlock(&q->lock);
+
+		if (i >= q->count) {
+			break;
+		}
+
+		batch_job_convert(&q->jobs[i], q->settings);
+	}
+
+	return NULL;
+}
+
+#endif
+
+
+/// How many CPU's are available?
+static int number_of_cpus(void) {
+	#ifdef USE_PTHREADS
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (count > 0) {
+		return (int) count;
+	}
+
+	#endif
+
+	return 1;
+}
+
+
+/// Convert batch jobs using a pool of worker threads.  Returns false if no
+/// threads could be started (jobs need to be converted serially instead).
+static bool batch_run_parallel(batch_job * jobs, int count, const batch_settings * settings, int threads) {
+	#ifdef USE_PTHREADS
+	batch_queue q = { jobs, count, 0, PTHREAD_MUTEX_INITIALIZER, settings };
+
+	if (threads > count) {
+		threads = count;
+	}
+
+	pthread_t * workers = malloc(sizeof(pthread_t) * threads);
+	int started = 0;
+
+	if (workers) {
+		for (int i = 0; i < threads; ++i) {
+			if (pthread_create(&workers[started], NULL, batch_worker, &q) == 0) {
+				started++;
+			}
+		}
+
+		for (int i = 0; i < started; ++i) {
+			pthread_join(workers[i], NULL);
+		}
+
+		free(workers);
+	}
+
+	pthread_mutex_destroy(&q.lock);
+
+	return (started > 0);
+	#else
+	return false;
+	#endif
+}
+
+
 int main(int argc, char** argv) {
 	int exitcode = EXIT_SUCCESS;
 	char * binname = "multimarkdown";
 	short format = FORMAT_HTML;
 	short language = LC_EN;
+	mmd_transclusion_cache * cache = NULL;
 
 	// Initialize argtable structs
 	void *argtable[] = {
@@ -143,6 +588,7 @@ int main(int argc, char** argv) {
 		a_rem1			= arg_rem("", ""),
 
 		a_batch			= arg_lit0("b", "batch", "process each file separately"),
+		a_jobs			= arg_int0("j", "jobs", "N", "with --batch, convert N files at a time, otherwise parse and export with N threads (0 = one per CPU)"),
 		a_full			= arg_lit0("f", "full", "force a complete document"),
 		a_snippet		= arg_lit0("s", "snippet", "force a snippet"),
 		a_compatibility	= arg_lit0("c", "compatibility", "Markdown compatibility mode"),
@@ -150,6 +596,7 @@ int main(int argc, char** argv) {
 		a_nosmart		= arg_lit0(NULL, "nosmart", "Disable smart typography"),
 		a_nolabels		= arg_lit0(NULL, "nolabels", "Disable id attributes for headers"),
 		a_notransclude	= arg_lit0(NULL, "notransclude", "Disable file transclusion"),
+		a_stats			= arg_lit0(NULL, "stats", "print where the time went (and other statistics) to stderr"),
 
 		a_rem2			= arg_rem("", ""),
 
@@ -306,147 +753,115 @@ int main(int argc, char** argv) {
 	}
 
 	DString * buffer = NULL;
-	DString * result = NULL;
+	bool mapped = false;
 	char * char_result = NULL;
 	FILE * output_stream;
-	char * output_filename;
-
-	// Increment counter and prepare token pool
-	#ifdef kUseObjectPool
-	token_pool_init();
-	#endif
 
 	// Seed random numbers
 	custom_seed_rand();
 
-	// Determine processing mode -- batch/stdin/files??
+	// How many threads?
+	int jobs = (a_jobs->count > 0) ? a_jobs->ival[0] : 1;
 
-	if ((a_batch->count) && (a_file->count)) {
-		// Batch process 1 or more files
-		for (int i = 0; i < a_file->count; ++i) {
+	if (jobs == 0) {
+		jobs = number_of_cpus();
+	}
 
-			buffer = scan_file(a_file->filename[i]);
+	if (jobs < 1) {
+		fprintf(stderr, "%s: Invalid number of jobs '%d'\n", binname, jobs);
+		exitcode = 1;
+		goto exit2;
+	}
 
-			if (buffer == NULL) {
-				fprintf(stderr, "Error reading file '%s'\n", a_file->filename[i]);
-				exitcode = 1;
-				goto exit2;
-			}
+	#ifdef kUseObjectPool
+	// Reuse token memory from one file to the next, and use larger slabs (on
+	// huge pages where available) for large documents
+	pool_set_mode(POOL_RETAIN_SLABS | POOL_GROW_SLABS | POOL_HUGE_PAGES);
+	#endif
 
-			// Append output file extension
-			switch (format) {
-				case FORMAT_HTML:
-					output_filename = filename_with_extension(a_file->filename[i], ".html");
-					break;
+	// Gather statistics?
+	bool gather_stats = (a_stats->count > 0);
+	mmd_stats stats;
+	memset(&stats, 0, sizeof(mmd_stats));
 
-				case FORMAT_LATEX:
-				case FORMAT_BEAMER:
-				case FORMAT_MEMOIR:
-					output_filename = filename_with_extension(a_file->filename[i], ".tex");
-					break;
+	#ifndef USE_STATS
 
-				case FORMAT_FODT:
-					output_filename = filename_with_extension(a_file->filename[i], ".fodt");
-					break;
+	if (gather_stats) {
+		fprintf(stderr, "%s: --stats is only available when built with `cmake -DSTATS=1`\n", binname);
+		gather_stats = false;
+	}
 
-				case FORMAT_ODT:
-					output_filename = filename_with_extension(a_file->filename[i], ".odt");
-					break;
+	#endif
 
-				case FORMAT_MMD:
-					output_filename = filename_with_extension(a_file->filename[i], ".mmdtext");
-					break;
+	// Determine processing mode -- batch/stdin/files??
 
-				case FORMAT_EPUB:
-					output_filename = filename_with_extension(a_file->filename[i], ".epub");
-					break;
+	if ((a_batch->count) && (a_file->count)) {
+		// Batch process 1 or more files, reading files they share only once
+		cache = mmd_transclusion_cache_new();
 
-				case FORMAT_TEXTBUNDLE:
-					output_filename = filename_with_extension(a_file->filename[i], ".textbundle");
-					break;
+		batch_settings settings = {
+			extensions, format, language, (a_meta->count > 0),
+			(a_extract->count > 0) ? a_extract->sval[0] : NULL, gather_stats, cache
+		};
 
-				case FORMAT_TEXTBUNDLE_COMPRESSED:
-					output_filename = filename_with_extension(a_file->filename[i], ".textpack");
-					break;
-			}
+		batch_job * queue = calloc(a_file->count, sizeof(batch_job));
 
-			// Perform transclusion(s)
-			char * folder = dirname((char *) a_file->filename[i]);
+		for (int i = 0; i < a_file->count; ++i) {
+			batch_job_prepare(&queue[i], a_file->filename[i], format);
+		}
 
-			if (!(extensions & EXT_COMPATIBILITY)) {
-				mmd_prepend_mmd_header(buffer);
-				mmd_append_mmd_footer(buffer);
-			}
+		bool converted = false;
 
-			if (extensions & EXT_TRANSCLUDE) {
-				mmd_transclude_source(buffer, folder, a_file->filename[i], format, NULL, NULL);
+		if ((jobs > 1) && (a_file->count > 1)) {
+			// Convert files in parallel (falls back to serial if threads unavailable)
+			converted = batch_run_parallel(queue, a_file->count, &settings, jobs);
+		}
 
-				// Don't free folder -- owned by dirname
+		for (int i = 0; i < a_file->count; ++i) {
+			if (!converted) {
+				batch_job_convert(&queue[i], &settings);
 			}
 
-			// Perform block level CriticMarkup?
-			if (extensions & EXT_CRITIC_ACCEPT) {
-				mmd_critic_markup_accept(buffer);
-			}
+			// Report results in order
+			if (!batch_job_report(&queue[i])) {
+				exitcode = 1;
 
-			if (extensions & EXT_CRITIC_REJECT) {
-				mmd_critic_markup_reject(buffer);
+				if (!converted) {
+					// Stop at first unreadable file
+					break;
+				}
+			} else if (settings.stats) {
+				print_stats(queue[i].filename, &queue[i].stats);
 			}
 
-			// Increment counter and prepare token pool
-			#ifdef kUseObjectPool
-			token_pool_init();
-			#endif
-
-			if (a_meta->count > 0) {
-				// List metadata keys
-				char_result = mmd_string_metadata_keys(buffer->str);
-
-				if (char_result) {
-					fputs(char_result, stdout);
+			if (queue[i].write_errno || queue[i].too_long) {
+				exitcode = 1;
+			}
+		}
 
-					free(char_result);
-				}
-			} else if (a_extract->count > 0) {
-				// Extract metadata key
-				const char * query = a_extract->sval[0];
+		for (int i = 0; i < a_file->count; ++i) {
+			batch_job_free(&queue[i]);
+		}
 
-				char_result = mmd_string_metavalue_for_key(buffer->str, query);
+		free(queue);
+	} else {
+		if (gather_stats) {
+			mmd_stats_set_active(&stats);
+		}
 
-				if (char_result) {
-					fputs(char_result, stdout);
-					fputc('\n', stdout);
+		// Serve files included more than once from memory
+		cache = mmd_transclusion_cache_new();
+		mmd_transclusion_cache_set_active(cache);
 
-					free(char_result);
-				}
-			} else {
-				// Regular processing
-
-				result = mmd_d_string_convert_to_data(buffer, extensions, format, language, folder);
-
-				if (FORMAT_TEXTBUNDLE == format) {
-					unzip_data_to_path(result->str, result->currentStringLength, output_filename);
-				} else {
-					if (!(output_stream = fopen(output_filename, "wb"))) {
-						// Failed to open file
-						perror(output_filename);
-					} else {
-						fwrite(result->str, result->currentStringLength, 1, output_stream);
-						fclose(output_stream);
-					}
-				}
+		if (a_file->count == 1) {
+			buffer = read_source_file(a_file->filename[0], extensions, &mapped);
 
-				d_string_free(result, true);
+			if (buffer == NULL) {
+				fprintf(stderr, "Error reading file '%s'\n", a_file->filename[0]);
+				exitcode = 1;
+				goto exit2;
 			}
-
-			d_string_free(buffer, true);
-			free(output_filename);
-
-			// Decrement counter and drain
-			token_pool_drain();
-		}
-	} else {
-		if (a_file->count) {
+		} else if (a_file->count) {
 			// We have files to process
 			buffer = d_string_new("");
 			DString * file_buffer;
@@ -458,7 +873,7 @@ int main(int argc, char** argv) {
 				if (file_buffer == NULL) {
 					fprintf(stderr, "Error reading file '%s'\n", a_file->filename[i]);
 					exitcode = 1;
-					goto exit;
+					goto exit2;
 				}
 
 				d_string_append_c_array(buffer, file_buffer->str, file_buffer->currentStringLength);
@@ -536,45 +951,54 @@ int main(int argc, char** argv) {
 		} else {
 			// Regular processing
 
-			result = mmd_d_string_convert_to_data(buffer, extensions, format, language, folder);
-
 			// Where does output go?
 			if (strcmp(a_o->filename[0], "-") == 0) {
 				// direct to stdout
 				output_stream = stdout;
 			} else if (!(output_stream = fopen(a_o->filename[0], "wb"))) {
 				perror(a_o->filename[0]);
-				free(result);
-				d_string_free(buffer, true);
+				free_source(buffer, mapped);
 
 				exitcode = 1;
-				goto exit;
+				goto exit2;
 			}
 
-			fwrite(result->str, result->currentStringLength, 1, output_stream);
+			bool too_long;
+			int write_errno = convert_to_stream(buffer, extensions, format, language, jobs, folder, output_stream, &too_long);
 
-			if (output_stream != stdout) {
-				fclose(output_stream);
+			if ((output_stream != stdout) && fclose(output_stream) && !write_errno) {
+				write_errno = errno;
 			}
 
-			d_string_free(result, true);
+			if (too_long) {
+				fprintf(stderr, "Error converting source: too long\n");
+				exitcode = 1;
+			}
+
+			if (write_errno) {
+				errno = write_errno;
+				perror(a_o->filename[0]);
+				exitcode = 1;
+			}
 		}
 
-		d_string_free(buffer, true);
-	}
+		free_source(buffer, mapped);
 
+		if (gather_stats) {
+			mmd_stats_set_active(NULL);
+			print_stats(NULL, &stats);
+		}
+	}
 
-exit:
 
-	// Decrement counter and clean up token pool
-	token_pool_drain();
+exit2:
+	mmd_transclusion_cache_set_active(NULL);
+	mmd_transclusion_cache_free(cache);
 
 	#ifdef kUseObjectPool
-	token_pool_free();
+	pool_release_retained();
 	#endif
 
-exit2:
-
 	// Clean up after argtable
 	arg_freetable(argtable, sizeof(argtable) / sizeof(argtable[0]));
 	return exitcode;
@@ -0,0 +1,479 @@
+/**
+
+	MultiMarkdown 6 -- Lightweight markup processor to produce HTML, LaTeX, and more.
+
+	@file benchmark.c
+
+	@brief Measure throughput and memory use of each stage of libMultiMarkdown.
+
+	Usage:	mmd_benchmark [-n repetitions] [file ...]
+
+	Without files, the corpus is the documents in the MMD6Tests suite
+	(once, then repeated to several MB), plus a synthetic large document.
+	The documents are parsed separately, and the times added up.
+
+	Each stage is timed on its own (best of `repetitions` runs), with the
+	stages before it run untimed to prepare its input.  Spans are paired on
+	a single thread here, even when the library is built with threads.
+
+	The last group compares searching for abbreviations and glossary terms
+	with the trie and with the compact automaton built from it.
+
+	Memory is the growth in heap in use from the start to the end of the
+	stage (i.e. what the stage allocated and kept, such as tokens, or the
+	exported text), for the document that needs the most.  Memory that a stage allocates
+	and frees again before it ends isn't counted.  Each group of stages runs
+	in its own child process, so that it starts with a fresh heap.
+
+
+	@author	Fletcher T. Penney
+	@bug
+
+**/
+
+/*
+
+	Copyright © 2016 - 2017 Fletcher T. Penney.
+
+
+	The `MultiMarkdown 6` project is released under the MIT License..
+
+	GLibFacade.c and GLibFacade.h are from the MultiMarkdown v4 project:
+
+		https://github.com/fletcher/MultiMarkdown-4/
+
+	MMD 4 is released under both the MIT License and GPL.
+
+
+	CuTest is released under the zlib/libpng license. See CuTest.c for the text
+	of the license.
+
+
+	## The MIT License ##
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in
+	all copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+	THE SOFTWARE.
+
+*/
+
+#include <dirent.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "benchmark.h"
+#include "d_string.h"
+#include "libMultiMarkdown.h"
+#include "stack.h"
+
+#ifndef BENCHMARK_CORPUS
+	#define BENCHMARK_CORPUS "tests/MMD6Tests"
+#endif
+
+#define kDefaultRepetitions	5							//!< Runs of each stage (best is reported)
+#define kRepeatedCorpusSize	(8 * 1024 * 1024)			//!< Repeat the test suite to at least this many bytes
+#define kSyntheticSections	2000						//!< Sections in the synthetic document
+#define kExtensions			(EXT_SMART | EXT_NOTES | EXT_CRITIC)
+
+
+static const char * stage_names[] = {
+	"mmd_tokenize_string",
+	"mmd_parse_token_chain",
+	"ambidextrous tokens",
+	"pairings1",
+	"pairings2",
+	"pairings3",
+	"pairings4",
+	"pair_emphasis_tokens",
+	"identify_global_search_terms",
+};
+
+
+/// Export formats that are measured
+static const struct {
+	short			format;
+	const char *	name;
+} export_formats[] = {
+	{FORMAT_HTML,	"export html"},
+	{FORMAT_LATEX,	"export latex"},
+	{FORMAT_BEAMER,	"export beamer"},
+	{FORMAT_MEMOIR,	"export memoir"},
+	{FORMAT_FODT,	"export fodt"},
+};
+
+#define kExportFormatCount	(sizeof(export_formats) / sizeof(export_formats[0]))
+#define kSearchGroup		(kExportFormatCount + 1)		//!< Group that compares trie and automaton search
+
+
+static void print_result(const char * name, size_t len, stage_result * r) {
+	double rate = (r->seconds > 0) ? len / r->seconds / 1e6 : 0;
+
+	fprintf(stdout, "  %-30s %10.2f MB/s %10.3f ms %10ld KB\n", name, rate, r->seconds * 1000, r->heap);
+}
+
+
+/// Keep the best (total) time over repetitions, and the largest heap growth
+static void keep_best(stage_result * best, stage_result * run, int rep) {
+	if ((rep == 0) || (run->seconds < best->seconds)) {
+		best->seconds = run->seconds;
+	}
+
+	if (run->heap > best->heap) {
+		best->heap = run->heap;
+	}
+}
+
+
+static const char * words[] = {
+	"the", "of", "and", "a", "to", "in", "is", "was", "for", "on", "that",
+	"with", "as", "by", "at", "from", "it", "an", "be", "this", "which",
+	"markdown", "document", "parser", "token", "export", "format", "block",
+};
+
+
+/// Pick a word (the same sequence every run)
+static const char * next_word(unsigned long * seed) {
+	*seed = *seed * 1103515245 + 12345;
+
+	return words[(*seed >> 16) % (sizeof(words) / sizeof(words[0]))];
+}
+
+
+/// Terms for the search group -- the longer words, and every pair of words
+/// (the strings are not freed, as the group's process exits)
+static stack * search_terms(void) {
+	size_t count = sizeof(words) / sizeof(words[0]);
+	stack * terms = stack_new(0);
+
+	for (size_t i = 0; i < count; ++i) {
+		if (strlen(words[i]) > 3) {
+			stack_push(terms, (void *)words[i]);
+		}
+
+		for (size_t j = 0; j < count; ++j) {
+			DString * pair = d_string_new(words[i]);
+			d_string_append_printf(pair, " %s", words[j]);
+			stack_push(terms, pair->str);
+			d_string_free(pair, false);
+		}
+	}
+
+	return terms;
+}
+
+
+/// Run a group of stages over each document in a child process, so that it
+/// starts with a fresh heap
+static void run_group(stack * documents, size_t len, int group, int reps) {
+	fflush(stdout);
+
+	pid_t pid = fork();
+
+	if (pid < 0) {
+		perror("fork");
+		exit(EXIT_FAILURE);
+	}
+
+	if (pid > 0) {
+		int status;
+		waitpid(pid, &status, 0);
+
+		if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+			fprintf(stderr, "Benchmark group %d failed\n", group);
+		}
+
+		return;
+	}
+
+	stage_result best[STAGE_COUNT] = {{0}};
+	stack * terms = (group == kSearchGroup) ? search_terms() : NULL;
+
+	for (int rep = 0; rep < reps; ++rep) {
+		stage_result run[STAGE_COUNT] = {{0}};
+
+		for (size_t i = 0; i < documents->size; ++i) {
+			DString * text = stack_peek_index(documents, i);
+
+			if (group == 0) {
+				benchmark_parse_stages(text->str, kExtensions, run);
+			} else if (group == kSearchGroup) {
+				benchmark_search(text->str, (const char **)terms->element, terms->size, &run[0], &run[1]);
+			} else {
+				benchmark_export(text->str, kExtensions, export_formats[group - 1].format, &run[0]);
+			}
+		}
+
+		for (int i = 0; i < STAGE_COUNT; ++i) {
+			keep_best(&best[i], &run[i], rep);
+		}
+	}
+
+	if (group == 0) {
+		for (int i = 0; i < STAGE_COUNT; ++i) {
+			print_result(stage_names[i], len, &best[i]);
+		}
+	} else if (group == kSearchGroup) {
+		print_result("search trie", len, &best[0]);
+		print_result("search automaton", len, &best[1]);
+	} else {
+		print_result(export_formats[group - 1].name, len, &best[0]);
+	}
+
+	fflush(stdout);
+	_exit(EXIT_SUCCESS);
+}
+
+
+/// Benchmark each stage over a set of documents (parsed separately)
+static void benchmark(const char * name, stack * documents, int reps) {
+	size_t len = 0;
+
+	for (size_t i = 0; i < documents->size; ++i) {
+		len += ((DString *)stack_peek_index(documents, i))->currentStringLength;
+	}
+
+	fprintf(stdout, "%s (%lu documents, %lu bytes)\n", name, documents->size, len);
+	fprintf(stdout, "  %-30s %15s %13s %13s\n", "stage", "throughput", "best", "heap");
+
+	for (int group = 0; group <= kSearchGroup; ++group) {
+		run_group(documents, len, group, reps);
+	}
+
+	fprintf(stdout, "\n");
+}
+
+
+static void free_documents(stack * documents) {
+	for (size_t i = 0; i < documents->size; ++i) {
+		d_string_free(stack_peek_index(documents, i), true);
+	}
+
+	stack_free(documents);
+}
+
+
+static DString * load_file(const char * path) {
+	FILE * f = fopen(path, "rb");
+	char buffer[4096];
+	size_t count;
+
+	if (f == NULL) {
+		return NULL;
+	}
+
+	DString * text = d_string_new("");
+
+	while ((count = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+		d_string_append_c_array(text, buffer, count);
+	}
+
+	fclose(f);
+
+	return text;
+}
+
+
+static int compare_names(const void * a, const void * b) {
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+
+/// Load the *.text files in the test suite (sorted, so that the corpus is
+/// the same on every run)
+static stack * load_test_suite(const char * dir) {
+	stack * documents = stack_new(0);
+	DIR * d = opendir(dir);
+
+	if (d == NULL) {
+		return documents;
+	}
+
+	stack * names = stack_new(0);
+	struct dirent * entry;
+
+	while ((entry = readdir(d)) != NULL) {
+		size_t len = strlen(entry->d_name);
+
+		if ((len > 5) && (strcmp(entry->d_name + len - 5, ".text") == 0)) {
+			DString * path = d_string_new(dir);
+			d_string_append_printf(path, "/%s", entry->d_name);
+			stack_push(names, path->str);
+			d_string_free(path, false);
+		}
+	}
+
+	closedir(d);
+
+	qsort(names->element, names->size, sizeof(void *), compare_names);
+
+	for (size_t i = 0; i < names->size; ++i) {
+		DString * text = load_file(stack_peek_index(names, i));
+
+		if (text) {
+			stack_push(documents, text);
+		}
+
+		free(stack_peek_index(names, i));
+	}
+
+	stack_free(names);
+
+	return documents;
+}
+
+
+/// Build a large document that uses most of the syntax, with a realistic
+/// mix of prose and markup
+static DString * synthetic_document(int sections) {
+	DString * d = d_string_new("Title:\tSynthetic Benchmark\nAuthor:\tmmd_benchmark\n\n");
+
+	// Give identify_global_search_terms() something to find
+	d_string_append(d, "*[HTML]: Hyper Text Markup Language\n\n");
+	d_string_append(d, "[?token]: The smallest piece of text the parser deals with.\n\n");
+	unsigned long seed = 42;
+
+	for (int s = 0; s < sections; ++s) {
+		d_string_append_printf(d, "## Section %d ##\n\n", s);
+
+		// Paragraphs with span level markup
+		for (int p = 0; p < 4; ++p) {
+			for (int w = 0; w < 60; ++w) {
+				switch (w % 12) {
+					case 3:
+						d_string_append_printf(d, "*%s* ", next_word(&seed));
+						break;
+
+					case 7:
+						d_string_append_printf(d, "**%s %s** ", next_word(&seed), next_word(&seed));
+						break;
+
+					case 9:
+						d_string_append_printf(d, "`%s()` ", next_word(&seed));
+						break;
+
+					case 11:
+						d_string_append_printf(d, "[%s](http://example.net/%d \"%s\") ", next_word(&seed), w, next_word(&seed));
+						break;
+
+					default:
+						d_string_append_printf(d, "%s ", next_word(&seed));
+						break;
+				}
+			}
+
+			if (p == 0) {
+				d_string_append_printf(d, "\"quoted\" and it's done.[^fn%d]", s);
+			}
+
+			d_string_append(d, "\n\n");
+		}
+
+		// List
+		for (int i = 0; i < 5; ++i) {
+			d_string_append_printf(d, "*\t%s %s {++%s++}\n", next_word(&seed), next_word(&seed), next_word(&seed));
+		}
+
+		d_string_append(d, "\n> A quote about HTML with _emphasis_ and a cross-reference to [Section 1].\n\n");
+
+		// Table
+		d_string_append(d, "| Left | Center | Right |\n|:--|:-:|--:|\n");
+
+		for (int i = 0; i < 4; ++i) {
+			d_string_append_printf(d, "| %s | *%s* | %d |\n", next_word(&seed), next_word(&seed), i);
+		}
+
+		d_string_append(d, "\n\tindented code block\n\tsecond line\n\n");
+
+		d_string_append_printf(d, "[^fn%d]: Footnote for section %d.\n\n", s, s);
+	}
+
+	return d;
+}
+
+
+int main(int argc, char * argv[]) {
+	int reps = kDefaultRepetitions;
+	int first_file = 1;
+
+	if ((argc > 2) && (strcmp(argv[1], "-n") == 0)) {
+		reps = atoi(argv[2]);
+		first_file = 3;
+
+		if (reps < 1) {
+			reps = 1;
+		}
+	}
+
+	stack * documents;
+
+	if (first_file < argc) {
+		for (int i = first_file; i < argc; ++i) {
+			DString * text = load_file(argv[i]);
+
+			if (text == NULL) {
+				fprintf(stderr, "Unable to open '%s'\n", argv[i]);
+				return EXIT_FAILURE;
+			}
+
+			documents = stack_new(0);
+			stack_push(documents, text);
+			benchmark(argv[i], documents, reps);
+			free_documents(documents);
+		}
+
+		return EXIT_SUCCESS;
+	}
+
+	documents = load_test_suite(BENCHMARK_CORPUS);
+
+	if (documents->size == 0) {
+		fprintf(stderr, "No test files found in '%s'\n", BENCHMARK_CORPUS);
+		free_documents(documents);
+		return EXIT_FAILURE;
+	}
+
+	benchmark("MMD6Tests", documents, reps);
+
+	// The suite again, enough times to run for a measurable time
+	size_t count = documents->size;
+	size_t len = 0;
+
+	while (len < kRepeatedCorpusSize) {
+		for (size_t i = 0; i < count; ++i) {
+			DString * text = stack_peek_index(documents, i);
+			stack_push(documents, d_string_new(text->str));
+			len += text->currentStringLength;
+		}
+	}
+
+	char name[64];
+	snprintf(name, sizeof(name), "MMD6Tests x %lu", documents->size / count);
+	benchmark(name, documents, reps);
+
+	free_documents(documents);
+
+	documents = stack_new(0);
+	stack_push(documents, synthetic_document(kSyntheticSections));
+	benchmark("Synthetic", documents, reps);
+	free_documents(documents);
+
+	return EXIT_SUCCESS;
+}
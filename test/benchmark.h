@@ -0,0 +1,110 @@
+/**
+
+	MultiMarkdown 6 -- Lightweight markup processor to produce HTML, LaTeX, and more.
+
+	@file benchmark.h
+
+	@brief Run the stages of libMultiMarkdown one at a time for mmd_benchmark.
+
+
+	@author	Fletcher T. Penney
+	@bug
+
+**/
+
+/*
+
+	Copyright © 2016 - 2017 Fletcher T. Penney.
+
+
+	The `MultiMarkdown 6` project is released under the MIT License..
+
+	GLibFacade.c and GLibFacade.h are from the MultiMarkdown v4 project:
+
+		https://github.com/fletcher/MultiMarkdown-4/
+
+	MMD 4 is released under both the MIT License and GPL.
+
+
+	CuTest is released under the zlib/libpng license. See CuTest.c for the text
+	of the license.
+
+
+	## The MIT License ##
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in
+	all copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+	THE SOFTWARE.
+
+*/
+
+
+#ifndef BENCHMARK_MULTIMARKDOWN_H
+#define BENCHMARK_MULTIMARKDOWN_H
+
+/// Stages that are measured
+enum benchmark_stage {
+	STAGE_TOKENIZE,
+	STAGE_PARSE,
+	STAGE_AMBIDEXTROUS,
+	STAGE_PAIRINGS1,
+	STAGE_PAIRINGS2,
+	STAGE_PAIRINGS3,
+	STAGE_PAIRINGS4,
+	STAGE_EMPHASIS,
+	STAGE_SEARCH_TERMS,
+	STAGE_COUNT
+};
+
+
+/// Results for one stage
+typedef struct {
+	double			seconds;					//!< Time taken (added to by each run)
+	long			heap;						//!< Largest growth of heap in use (KB) from start to end of a run
+} stage_result;
+
+
+/// Run the stages of mmd_engine_parse_substring() one at a time, then find
+/// the abbreviations and glossary terms as export would
+void benchmark_parse_stages(
+	const char * text,							//!< Document to parse
+	unsigned long extensions,					//!< Extensions to use
+	stage_result * results						//!< STAGE_COUNT results to update
+);
+
+
+/// Parse the text (untimed), then export it
+void benchmark_export(
+	const char * text,							//!< Document to export
+	unsigned long extensions,					//!< Extensions to use
+	short format,								//!< Format to export to
+	stage_result * result						//!< Result to update
+);
+
+
+/// Search the text for a set of terms, with the trie and then with the
+/// compact automaton built from it (the two ways to find abbreviations and
+/// glossary terms)
+void benchmark_search(
+	const char * text,							//!< Text to search
+	const char ** terms,						//!< Terms to search for
+	size_t count,								//!< Number of terms
+	stage_result * trie_result,					//!< Result to update for trie
+	stage_result * automaton_result				//!< Result to update for automaton
+);
+
+#endif
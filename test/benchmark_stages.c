@@ -0,0 +1,258 @@
+/**
+
+	MultiMarkdown 6 -- Lightweight markup processor to produce HTML, LaTeX, and more.
+
+	@file benchmark_stages.c
+
+	@brief Run the stages of libMultiMarkdown one at a time for mmd_benchmark.
+
+	Kept apart from benchmark.c, since `link` in writer.h collides with
+	link() from <unistd.h>.
+
+	@author	Fletcher T. Penney
+	@bug
+
+**/
+
+/*
+
+	Copyright © 2016 - 2017 Fletcher T. Penney.
+
+
+	The `MultiMarkdown 6` project is released under the MIT License..
+
+	GLibFacade.c and GLibFacade.h are from the MultiMarkdown v4 project:
+
+		https://github.com/fletcher/MultiMarkdown-4/
+
+	MMD 4 is released under both the MIT License and GPL.
+
+
+	CuTest is released under the zlib/libpng license. See CuTest.c for the text
+	of the license.
+
+
+	## The MIT License ##
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in
+	all copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+	THE SOFTWARE.
+
+*/
+
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__GLIBC__)
+	#include <malloc.h>
+#elif defined(__APPLE__)
+	#include <malloc/malloc.h>
+#else
+	#include <sys/resource.h>
+#endif
+
+#include "aho-corasick.h"
+#include "benchmark.h"
+#include "libMultiMarkdown.h"
+#include "mmd.h"
+#include "stack.h"
+#include "token.h"
+#include "writer.h"
+
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/// Bytes of heap in use.  Unlike the maximum resident set size, this goes
+/// down again when memory is freed, so each stage can be measured on its own.
+static long heap_in_use(void) {
+	#if defined(__GLIBC__) && ((__GLIBC__ > 2) || (__GLIBC_MINOR__ >= 33))
+	struct mallinfo2 info = mallinfo2();
+
+	return info.uordblks + info.hblkhd;
+	#elif defined(__GLIBC__)
+	// Counters are only int sized before glibc 2.33
+	struct mallinfo info = mallinfo();
+
+	return (unsigned int) info.uordblks + (unsigned int) info.hblkhd;
+	#elif defined(__APPLE__)
+	malloc_statistics_t info;
+	malloc_zone_statistics(NULL, &info);
+
+	return info.size_in_use;
+	#else
+	// No way to ask the allocator -- use growth of maximum resident set size
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+
+	return usage.ru_maxrss * 1024;
+	#endif
+}
+
+
+/// Keep timing and memory for a stage
+typedef struct {
+	double			start;
+	long			heap;
+} stage_timer;
+
+
+static void timer_start(stage_timer * t) {
+	t->heap = heap_in_use();
+	t->start = now();
+}
+
+
+static void timer_stop(stage_timer * t, stage_result * r) {
+	r->seconds += now() - t->start;
+
+	long growth = (heap_in_use() - t->heap) / 1024;
+
+	if (growth > r->heap) {
+		r->heap = growth;
+	}
+}
+
+
+/// Run the stages of mmd_engine_parse_substring() one at a time, then find
+/// the abbreviations and glossary terms as export would
+void benchmark_parse_stages(const char * text, unsigned long extensions, stage_result * results) {
+	mmd_engine * e = mmd_engine_create_with_string(text, extensions);
+	stage_timer t;
+
+	e->exported = false;
+
+	#ifdef kUseObjectPool
+	struct pool * old_pool = token_pool_set_active(e->token_pool);
+	#endif
+
+	timer_start(&t);
+	token * doc = mmd_tokenize_string(e, 0, e->dstr->currentStringLength, false);
+	timer_stop(&t, &results[STAGE_TOKENIZE]);
+
+	timer_start(&t);
+	mmd_parse_token_chain(e, doc);
+	timer_stop(&t, &results[STAGE_PARSE]);
+
+	if (doc) {
+		timer_start(&t);
+		mmd_assign_ambidextrous_tokens_in_block(e, doc, 0);
+		timer_stop(&t, &results[STAGE_AMBIDEXTROUS]);
+
+		stack * pair_stack = stack_new(0);
+		token_pair_engine * pairings[] = {e->pairings1, e->pairings2, e->pairings3, e->pairings4};
+
+		for (int i = 0; i < 4; ++i) {
+			timer_start(&t);
+			mmd_pair_tokens_in_block(doc, pairings[i], pair_stack);
+			timer_stop(&t, &results[STAGE_PAIRINGS1 + i]);
+		}
+
+		stack_free(pair_stack);
+
+		timer_start(&t);
+		pair_emphasis_tokens(doc);
+		timer_stop(&t, &results[STAGE_EMPHASIS]);
+	}
+
+	e->root = doc;
+
+	// Prepare for searching as mmd_engine_export_token_tree() does
+	process_definition_stack(e);
+	process_header_stack(e);
+	process_table_stack(e);
+
+	scratch_pad * scratch = scratch_pad_new(e, FORMAT_HTML);
+	process_metadata_stack(e, scratch);
+
+	timer_start(&t);
+	identify_global_search_terms(e, scratch);
+	timer_stop(&t, &results[STAGE_SEARCH_TERMS]);
+
+	scratch_pad_free(scratch);
+
+	#ifdef kUseObjectPool
+	token_pool_set_active(old_pool);
+	#endif
+
+	mmd_engine_free(e, true);
+}
+
+
+/// Parse the text (untimed), then export it
+void benchmark_export(const char * text, unsigned long extensions, short format, stage_result * result) {
+	mmd_engine * e = mmd_engine_create_with_string(text, extensions);
+	DString * out = d_string_new("");
+	stage_timer t;
+
+	mmd_engine_parse_string(e);
+
+	timer_start(&t);
+	mmd_engine_export_token_tree(out, e, format);
+	timer_stop(&t, result);
+
+	d_string_free(out, true);
+	mmd_engine_free(e, true);
+}
+
+
+/// Search the text for a set of terms, with the trie and then with the
+/// compact automaton built from it.  Memory includes building each one.
+void benchmark_search(const char * text, const char ** terms, size_t count, stage_result * trie_result, stage_result * automaton_result) {
+	size_t len = strlen(text);
+	stage_timer t;
+	long heap;
+	match * m;
+
+	heap = heap_in_use();
+	trie * a = trie_new(0);
+
+	for (size_t i = 0; i < count; ++i) {
+		trie_insert(a, terms[i], 1);
+	}
+
+	ac_trie_prepare(a);
+
+	timer_start(&t);
+	t.heap = heap;
+	m = ac_trie_leftmost_longest_search(a, text, 0, len);
+	timer_stop(&t, trie_result);
+	match_free(m);
+
+	heap = heap_in_use();
+	ac_automaton * ac = ac_automaton_new(a);
+
+	if (ac) {
+		timer_start(&t);
+		t.heap = heap;
+		m = ac_automaton_leftmost_longest_search(ac, text, 0, len);
+		timer_stop(&t, automaton_result);
+		match_free(m);
+
+		ac_automaton_free(ac);
+	}
+
+	trie_free(a);
+}
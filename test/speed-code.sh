@@ -0,0 +1,43 @@
+#!/bin/bash
+# Code heavy documents, with long link destinations and titles that have to
+# be escaped, exported to each of the main formats.
+
+cd ../build;
+
+
+make_document () {
+	awk -v sections=$1 'BEGIN {
+		srand(42);
+		split("alpha beta gamma delta epsilon zeta theta kappa lambda sigma", word, " ");
+
+		for (i = 0; i < sections; i++) {
+			path = "";
+
+			for (j = 0; j < 12; j++) {
+				path = path "/" word[1 + int(rand() * 10)];
+			}
+
+			printf("## Section %d\n\n", i);
+			printf("Call `%s(x, y)` or see [the reference](https://example.com%s?a=1&b=2&c=%d \"Notes on <%s> & \\\"%s\\\" in section %d\")\n", word[1 + i % 10], path, i, word[1 + i % 10], path, i);
+			printf("and <https://example.com%s/%d?q=%s&lang=c_cpp>.\n\n", path, i, word[1 + int(rand() * 10)]);
+
+			printf("```c\n");
+
+			for (j = 0; j < 8; j++) {
+				printf("\tif (x->%s < y->%s && *p != \"%s\") { return &q[%d]; }\n", word[1 + int(rand() * 10)], word[1 + int(rand() * 10)], path, j);
+			}
+
+			printf("```\n\n");
+		}
+	}' > speedcode.txt
+}
+
+
+make_document 5000
+
+for format in html latex odt; do
+	echo "MMD 6 - $format"
+	/usr/bin/env time -p ./multimarkdown -t $format speedcode.txt > /dev/null
+done
+
+rm speedcode.txt
@@ -0,0 +1,37 @@
+#!/bin/bash
+# Footnotes, citations and headers are written with numbered anchors and ids,
+# so time documents with many of them.  Build with `cmake -DSTATS=1` to also
+# see how often string buffers had to grow (`multimarkdown --stats`).
+
+cd ../build;
+
+
+make_document () {
+	awk -v sections=$1 'BEGIN {
+		for (i = 0; i < sections; i++) {
+			printf("## Section %d\n\n", i);
+
+			for (j = 0; j < 4; j++) {
+				printf("A claim[^n%d_%d] with a source[#c%d_%d] and another note[^n%d_%d].\n\n", i, j, i, j, i, j + 4);
+			}
+
+			for (j = 0; j < 8; j++) {
+				printf("[^n%d_%d]: Footnote %d of section %d.\n\n", i, j, j, i);
+			}
+
+			for (j = 0; j < 4; j++) {
+				printf("[#c%d_%d]: Citation %d of section %d.\n\n", i, j, j, i);
+			}
+		}
+	}' > speedfootnotes.txt
+}
+
+
+make_document 3000
+
+for format in html latex fodt; do
+	echo "MMD 6 - $format"
+	/usr/bin/env time -p ./multimarkdown --stats -t $format speedfootnotes.txt > /dev/null
+done
+
+rm speedfootnotes.txt
@@ -0,0 +1,53 @@
+#!/bin/bash
+# Abbreviations and glossary terms are searched for throughout the document,
+# so time documents with increasing numbers of them.
+
+cd ../build;
+
+
+make_document () {
+	awk -v terms=$1 -v paras=$2 'BEGIN {
+		srand(42);
+		split("the of and a to in is was for on that with as by at from it an be this which or are", common, " ");
+
+		for (i = 1; i <= terms; i++) {
+			word = "";
+			len = 4 + int(rand() * 8);
+
+			for (j = 0; j < len; j++) {
+				word = word sprintf("%c", 97 + int(rand() * 26));
+			}
+
+			if (i % 2) {
+				term[i] = toupper(substr(word, 1, 1)) substr(word, 2);
+				printf("[?%s]: Definition of %s\n\n", term[i], term[i]);
+			} else {
+				term[i] = toupper(substr(word, 1, 3));
+				printf("*[%s]: Abbreviation for %s\n\n", term[i], word);
+			}
+		}
+
+		for (i = 0; i < paras; i++) {
+			line = "";
+
+			for (j = 0; j < 60; j++) {
+				if (rand() < 0.05) {
+					line = line term[1 + int(rand() * terms)] " ";
+				} else {
+					line = line common[1 + int(rand() * 22)] " ";
+				}
+			}
+
+			print line "\n";
+		}
+	}' > speedglossary.txt
+}
+
+
+for terms in 250 500 1000 2000 4000 8000; do
+	echo "MMD 6 - $terms terms"
+	make_document $terms 20000
+	/usr/bin/env time -p ./multimarkdown speedglossary.txt > /dev/null
+done
+
+rm speedglossary.txt